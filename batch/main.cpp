@@ -0,0 +1,255 @@
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "compute/context.h"
+
+#include "scene/brush-ball.h"
+#include "scene/brush-composite.h"
+#include "scene/brush-cube.h"
+#include "scene/scene.h"
+
+#include "utils/log.h"
+
+using namespace std;
+using namespace glm;
+namespace fs = boost::filesystem;
+
+namespace {
+struct Options {
+    string script;
+    string output;
+    string scene_dir;
+    int lod;
+    vm::VolumeParams params;
+};
+
+void usage(const char *program) {
+    LOG(error) << "Usage: " << program
+               << " [--scene <dir>] [--lod <level>] [--chunk-size <voxels>]"
+                  " [--voxel-size <size>] [--distance-samples]"
+                  " [--blend-radius <radius>] <script> <output.obj>";
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    options.lod = 0;
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--scene" && i + 1 < argc) {
+            options.scene_dir = argv[++i];
+        } else if (arg == "--lod" && i + 1 < argc) {
+            options.lod = atoi(argv[++i]);
+        } else if (arg == "--chunk-size" && i + 1 < argc) {
+            options.params.chunk_size = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--voxel-size" && i + 1 < argc) {
+            options.params.voxel_size = strtod(argv[++i], nullptr);
+        } else if (arg == "--distance-samples") {
+            options.params.distance_samples = true;
+        } else if (arg == "--blend-radius" && i + 1 < argc) {
+            options.params.distance_samples = true;
+            options.params.blend_radius = strtod(argv[++i], nullptr);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        return false;
+    }
+    options.script = positional[0];
+    options.output = positional[1];
+    return true;
+}
+
+vec3 read_vec3(istringstream &in, const string &what) {
+    vec3 v;
+    if (!(in >> v.x >> v.y >> v.z)) {
+        throw runtime_error("expected 3 numbers after " + what);
+    }
+    return v;
+}
+
+/**
+ * Reads the rest of the line as a postfix program of the composite @p brush,
+ * i.e. primitives "ball|cube <x> <y> <z> <sx> <sy> <sz>" and operations
+ * "union|intersection|difference".
+ */
+void read_program(istringstream &in, vm::BrushComposite &brush) {
+    using Node = vm::BrushComposite::Node;
+    string node;
+    while (in >> node) {
+        if (node == "ball" || node == "cube") {
+            const vec3 origin = read_vec3(in, node + " origin");
+            const vec3 scale = read_vec3(in, node + " scale");
+            brush.push(node == "ball" ? Node::Ball : Node::Cube, origin, scale);
+        } else if (node == "union") {
+            brush.combine(Node::Union);
+        } else if (node == "intersection") {
+            brush.combine(Node::Intersection);
+        } else if (node == "difference") {
+            brush.combine(Node::Difference);
+        } else {
+            throw runtime_error("unknown program node " + node);
+        }
+    }
+    if (!brush.is_complete()) {
+        throw runtime_error("program must leave exactly one shape");
+    }
+}
+
+/**
+ * Applies each operation of the script to the scene. Every non-empty line
+ * (apart from # comments) is an operation:
+ *
+ *   add|sub ball|cube|composite <x> <y> <z> [scale <x> <y> <z>]
+ *                                 [rotation <x> <y> <z>] [material <id>]
+ *                                 [program <nodes>...]
+ *
+ * Rotation is given in degrees, scale defaults to 1 and material to 0. The
+ * program (see read_program()) is required by, and must be the last option
+ * of a composite brush.
+ */
+size_t apply_script(vm::Scene &scene, const string &path) {
+    ifstream script(path);
+    if (!script) {
+        throw runtime_error("Cannot open " + path);
+    }
+    size_t num_operations = 0;
+    string line;
+    for (size_t line_number = 1; getline(script, line); ++line_number) {
+        try {
+            line = line.substr(0, line.find('#'));
+            istringstream in(line);
+            string operation;
+            if (!(in >> operation)) {
+                continue;
+            }
+            if (operation != "add" && operation != "sub") {
+                throw runtime_error("unknown operation " + operation);
+            }
+            string shape;
+            in >> shape;
+            unique_ptr<vm::Brush> brush;
+            if (shape == "ball") {
+                brush = make_unique<vm::BrushBall>();
+            } else if (shape == "cube") {
+                brush = make_unique<vm::BrushCube>();
+            } else if (shape == "composite") {
+                brush = make_unique<vm::BrushComposite>();
+            } else {
+                throw runtime_error("unknown brush " + shape);
+            }
+            brush->set_origin(read_vec3(in, "the brush"));
+
+            string option;
+            while (in >> option) {
+                if (option == "scale") {
+                    brush->set_scale(read_vec3(in, option));
+                } else if (option == "rotation") {
+                    brush->set_rotation(radians(read_vec3(in, option)));
+                } else if (option == "material") {
+                    int material;
+                    if (!(in >> material)) {
+                        throw runtime_error("expected material id");
+                    }
+                    brush->set_material(material);
+                } else if (option == "program" && shape == "composite") {
+                    read_program(in,
+                                 static_cast<vm::BrushComposite &>(*brush));
+                } else {
+                    throw runtime_error("unknown option " + option);
+                }
+            }
+
+            if (shape == "composite"
+                && !static_cast<vm::BrushComposite &>(*brush).is_complete()) {
+                throw runtime_error("composite brush needs a program");
+            }
+            if (operation == "add") {
+                scene.add_async(*brush).get();
+            } else {
+                scene.sub_async(*brush).get();
+            }
+            ++num_operations;
+        } catch (const exception &e) {
+            throw runtime_error(path + ":" + to_string(line_number) + ": "
+                                + e.what());
+        }
+    }
+    return num_operations;
+}
+
+void export_obj(vm::Scene &scene, int lod, const string &path) {
+    ofstream out(path);
+    if (!out) {
+        throw runtime_error("Cannot open " + path);
+    }
+    size_t num_vertices = 0;
+    size_t num_triangles = 0;
+    scene.read_meshes(lod, [&](const ivec3 &coord,
+                               const vector<vec3> &vertices,
+                               const vector<uint32_t> &indices) {
+        out << "o chunk_" << coord.x << '_' << coord.y << '_' << coord.z
+            << '\n';
+        for (const vec3 &vertex : vertices) {
+            out << "v " << vertex.x << ' ' << vertex.y << ' ' << vertex.z
+                << '\n';
+        }
+        // OBJ indices are 1-based and global to the file.
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            out << "f " << num_vertices + indices[i + 0] + 1 << ' '
+                << num_vertices + indices[i + 1] + 1 << ' '
+                << num_vertices + indices[i + 2] + 1 << '\n';
+        }
+        num_vertices += vertices.size();
+        num_triangles += indices.size() / 3;
+    });
+    if (!out.flush()) {
+        throw runtime_error("Cannot write " + path);
+    }
+    LOG(info) << "Exported " << num_vertices << " vertices and "
+              << num_triangles << " triangles to " << path;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    setenv("CUDA_CACHE_DISABLE", "1", 1);
+
+    // Without a scene directory the scene is built from scratch, in a
+    // temporary one.
+    const bool temporary = options.scene_dir.empty();
+    if (temporary) {
+        options.scene_dir = (fs::temp_directory_path()
+                             / fs::unique_path("vm-batch-%%%%-%%%%"))
+                                    .string();
+    }
+    int status = 0;
+    try {
+        auto scene = make_unique<vm::Scene>(vm::make_compute_context(),
+                                            make_shared<vm::Camera>(),
+                                            options.scene_dir,
+                                            options.params);
+        const size_t num_operations = apply_script(*scene, options.script);
+        LOG(info) << "Applied " << num_operations << " operations";
+        export_obj(*scene, options.lod, options.output);
+    } catch (const exception &e) {
+        LOG(error) << e.what();
+        status = 1;
+    }
+    if (temporary) {
+        fs::remove_all(options.scene_dir);
+    }
+    return status;
+}
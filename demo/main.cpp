@@ -5,6 +5,7 @@
 #include <memory>
 #include <chrono>
 #include <fstream>
+#include <future>
 #include <thread>
 
 #ifndef NDEBUG
@@ -17,6 +18,7 @@
 #include "scene/scene.h"
 #include "scene/brush-cube.h"
 #include "scene/brush-ball.h"
+#include "scene/brush-composite.h"
 
 #include "utils/log.h"
 
@@ -42,9 +44,19 @@ static shared_ptr<vm::ComputeContext> g_compute_ctx;
 static chrono::time_point<chrono::steady_clock> g_frametime_beg;
 static chrono::time_point<chrono::steady_clock> g_frametime_end;
 
+static unique_ptr<vm::Brush> make_rounded_cube_brush() {
+    using Node = vm::BrushComposite::Node;
+    auto brush = make_unique<vm::BrushComposite>();
+    brush->push(Node::Cube, vec3(0, 0, 0));
+    brush->push(Node::Ball, vec3(0, 0, 0), vec3(1.4f, 1.4f, 1.4f));
+    brush->combine(Node::Intersection);
+    return move(brush);
+}
+
 static unique_ptr<vm::Brush> g_brushes[] = {
     make_unique<vm::BrushCube>(),
-    make_unique<vm::BrushBall>()
+    make_unique<vm::BrushBall>(),
+    make_rounded_cube_brush()
 };
 static int g_brush_id;
 static vec3 g_brush_scale(1,1,1);
@@ -144,6 +156,9 @@ static void handle_keyboard() {
     if (glfwGetKey(g_window, GLFW_KEY_2) == GLFW_PRESS) {
         g_brush_id = 1;
     }
+    if (glfwGetKey(g_window, GLFW_KEY_3) == GLFW_PRESS) {
+        g_brush_id = 2;
+    }
     if (glfwGetKey(g_window, GLFW_KEY_F1) == GLFW_PRESS) {
         glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     }
@@ -158,18 +173,19 @@ static void handle_keyboard() {
 static void handle_scroll(GLFWwindow *window, double xoffset, double yoffset) {
     (void) window;
     (void) xoffset;
+    const float voxel_size = g_scene->params().voxel_size;
     if (glfwGetKey(g_window, GLFW_KEY_X)) {
-        g_brush_scale.x += 2*VM_VOXEL_SIZE * yoffset;
+        g_brush_scale.x += 2*voxel_size * yoffset;
     } else if (glfwGetKey(g_window, GLFW_KEY_Y)) {
-        g_brush_scale.y += 2*VM_VOXEL_SIZE * yoffset;
+        g_brush_scale.y += 2*voxel_size * yoffset;
     } else if (glfwGetKey(g_window, GLFW_KEY_Z)) {
-        g_brush_scale.z += 2*VM_VOXEL_SIZE * yoffset;
+        g_brush_scale.z += 2*voxel_size * yoffset;
     } else {
         g_material_id += yoffset;
         g_material_id = std::max(0, std::min(g_material_id, int(g_material_array.size())-1));
         get_current_brush()->set_material(g_material_id);
     }
-    const float min_scale = 3.5 * VM_VOXEL_SIZE;
+    const float min_scale = 3.5 * voxel_size;
     g_brush_scale = max(vec3(min_scale, min_scale, min_scale), g_brush_scale);
 }
 
@@ -204,11 +220,23 @@ static void handle_mouse() {
         g_camera->set_rotation_y(g_roty);
     }
 
+    // Don't pile up edits faster than the scene is able to process them.
+    static future<void> edit;
+    if (edit.valid()) {
+        if (edit.wait_for(chrono::seconds(0)) != future_status::ready) {
+            return;
+        }
+        try {
+            edit.get();
+        } catch (exception &e) {
+            LOG(error) << "Edit failed: " << e.what();
+        }
+    }
     if (g_mouse_grabbed && !brush_lock && left_button == GLFW_PRESS) {
-        g_scene->add(*get_current_brush());
+        edit = g_scene->add_async(*get_current_brush());
     }
     if (g_mouse_grabbed && !brush_lock && right_button == GLFW_PRESS) {
-        g_scene->sub(*get_current_brush());
+        edit = g_scene->sub_async(*get_current_brush());
     }
 
 }
@@ -311,6 +339,7 @@ int main(int argc, char **argv) {
         glfwPollEvents();
         handle_resize();
         handle_events();
+        g_scene->update();
         render_scene();
         glfwSwapBuffers(g_window);
         g_frametime_end = steady_clock::now();
@@ -2,27 +2,37 @@
 
 #include "media/kernels/utils.h"
 
-kernel void copy_vertices(global float *out_vbo,
-                          global const float *voxel_vertices,
-                          global const uint *voxel_mask,
-                          global const uint *scanned_voxels) {
+/**
+ * Writes indices of the set elements of the @p mask (of @p size elements)
+ * densely, in order, as given by their inclusive prefix sums @p scanned.
+ */
+kernel void compact(global uint *out_indices,
+                    global const uint *mask,
+                    global const uint *scanned,
+                    uint size) {
     const uint tid = get_global_id(0);
-    if (tid
-        >= (VM_CHUNK_SIZE + 2) * (VM_CHUNK_SIZE + 2) * (VM_CHUNK_SIZE + 2)) {
+    if (tid >= size || !mask[tid]) {
         return;
     }
-    const uint mask = voxel_mask[tid];
-    if (!mask) {
+    out_indices[scanned[tid] - 1] = tid;
+}
+
+kernel void copy_vertices(global float *out_vbo,
+                          global const float *voxel_vertices,
+                          global const uint *active_voxels,
+                          uint num_active_voxels) {
+    const uint tid = get_global_id(0);
+    if (tid >= num_active_voxels) {
         return;
     }
-    const uint index = 3 * (scanned_voxels[tid] - 1);
-    for (uint i = 0; i < 3; ++i) {
-        out_vbo[index + i] = voxel_vertices[3 * tid + i];
+    const uint voxel = VERTEX_SIZE * active_voxels[tid];
+    for (uint i = 0; i < VERTEX_SIZE; ++i) {
+        out_vbo[VERTEX_SIZE * tid + i] = voxel_vertices[voxel + i];
     }
 }
 
 int voxel_index(int x, int y, int z) {
-    return x + (VM_CHUNK_SIZE + 2) * (y + (VM_CHUNK_SIZE + 2) * z);
+    return x + DIM_EXTENDED_VOXEL_GRID * (y + DIM_EXTENDED_VOXEL_GRID * z);
 }
 
 constant uint triangles[2][6] = {
@@ -30,26 +40,19 @@ constant uint triangles[2][6] = {
     { 0, 2, 1, 0, 3, 2 }
 };
 
-kernel void make_indices(global uint *out_ibo,
-                         global const uint *edge_mask,
-                         global const uint *scanned_edges,
-                         global const uint *scanned_voxels,
-                         read_only image3d_t samples) {
-
-    const uint tid = get_global_id(0);
-    if (tid >= 3 * (VM_CHUNK_SIZE + 3) * (VM_CHUNK_SIZE + 3)
-                       * (VM_CHUNK_SIZE + 3)) {
-        return;
-    }
-
-    if (!edge_mask[tid]) {
-        return;
-    }
-    const uint axis = tid % 3;
-    const uint offset = (tid - axis) / 3;
-    int e0x = offset % (VM_CHUNK_SIZE + 3);
-    int e0y = ((offset - e0x) / (VM_CHUNK_SIZE + 3)) % (VM_CHUNK_SIZE + 3);
-    int e0z = ((offset - e0x) / (VM_CHUNK_SIZE + 3) - e0y) / (VM_CHUNK_SIZE+3);
+/**
+ * Computes vertex indices of the 2 triangles of the quad around the active
+ * @p edge, i.e. joining vertices of the 4 voxels sharing it.
+ */
+void edge_indices(uint edge,
+                  global const uint *scanned_voxels,
+                  read_only image3d_t samples,
+                  uint indices[6]) {
+    const uint axis = edge % 3;
+    const uint offset = (edge - axis) / 3;
+    int e0x = offset % DIM_SAMPLES;
+    int e0y = ((offset - e0x) / DIM_SAMPLES) % DIM_SAMPLES;
+    int e0z = ((offset - e0x) / DIM_SAMPLES - e0y) / DIM_SAMPLES;
 
     int cells[4];
     cells[0] = voxel_index(e0x, e0y, e0z);
@@ -74,9 +77,40 @@ kernel void make_indices(global uint *out_ibo,
 
     float value = sample_at(samples, e0x, e0y, e0z);
     int triangulation = value <= 0 ? 0 : 1;
-    const uint index = 6 * (scanned_edges[tid] - 1);
     for (uint i = 0; i < 6; ++i) {
-        out_ibo[index + i] = scanned_voxels[cells[triangles[triangulation][i]]] - 1;
+        indices[i] = scanned_voxels[cells[triangles[triangulation][i]]] - 1;
     }
 }
 
+kernel void make_indices(global uint *out_ibo,
+                         global const uint *active_edges,
+                         global const uint *scanned_voxels,
+                         read_only image3d_t samples,
+                         uint num_active_edges) {
+    const uint tid = get_global_id(0);
+    if (tid >= num_active_edges) {
+        return;
+    }
+    uint indices[6];
+    edge_indices(active_edges[tid], scanned_voxels, samples, indices);
+    for (uint i = 0; i < 6; ++i) {
+        out_ibo[6 * tid + i] = indices[i];
+    }
+}
+
+/* Same as make_indices, for meshes of at most 65536 vertices */
+kernel void make_indices_16(global ushort *out_ibo,
+                            global const uint *active_edges,
+                            global const uint *scanned_voxels,
+                            read_only image3d_t samples,
+                            uint num_active_edges) {
+    const uint tid = get_global_id(0);
+    if (tid >= num_active_edges) {
+        return;
+    }
+    uint indices[6];
+    edge_indices(active_edges[tid], scanned_voxels, samples, indices);
+    for (uint i = 0; i < 6; ++i) {
+        out_ibo[6 * tid + i] = (ushort)indices[i];
+    }
+}
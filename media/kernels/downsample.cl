@@ -0,0 +1,67 @@
+#include "config/config.h"
+
+#pragma OPENCL EXTENSION cl_khr_3d_image_writes : enable
+
+#include "media/kernels/utils.h"
+
+/**
+ * Finds the crossing of the coarse edge originated at the full resolution
+ * sample @p p0, spanning LOD_SCALE full resolution edges along @p axis. The
+ * first active full resolution edge on the way is taken.
+ */
+float4 downsample_edge(read_only image3d_t samples,
+                       read_only image3d_t edges,
+                       int3 p0,
+                       int3 axis) {
+    short s0 = sample_at(samples, p0.x, p0.y, p0.z);
+    for (int i = 0; i < LOD_SCALE; ++i) {
+        const int3 p = p0 + i * axis;
+        const short s1 = sample_at(samples, p.x + axis.x, p.y + axis.y,
+                                   p.z + axis.z);
+        if (active_edge(s0, s1)) {
+            const float4 edge = read_edge(edges, p);
+            return (float4)(edge.xyz, (i + edge.w) / LOD_SCALE);
+        }
+        s0 = s1;
+    }
+    /* Coarse edge is not active, so this won't be ever read */
+    return (float4)(0, 0, 0, 0.5f);
+}
+
+/**
+ * Builds the volume of a chunk at VM_LOD level of detail out of its full
+ * resolution volume. Coarser samples (and their materials) are point-sampled,
+ * so that they coincide with every LOD_SCALE-th full resolution one (see
+ * vertex_at()).
+ */
+kernel void downsample(read_only image3d_t samples,
+                       read_only image3d_t edges_x,
+                       read_only image3d_t edges_y,
+                       read_only image3d_t edges_z,
+                       write_only image3d_t out_samples,
+                       write_only image3d_t out_edges_x,
+                       write_only image3d_t out_edges_y,
+                       write_only image3d_t out_edges_z,
+                       read_only image3d_t materials,
+                       write_only image3d_t out_materials) {
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int z = get_global_id(2);
+
+    if (!IS_SAMPLE_COORD(x, y, z)) {
+        return;
+    }
+    /* Samples past the full resolution volume are clamped to its border */
+    const int3 p0 = (int3)(x, y, z) * LOD_SCALE;
+    const int3 p = (int3)(x, y, z);
+    write_imagei(out_samples, (int4)(p, 0),
+                 (int4)(sample_at(samples, p0.x, p0.y, p0.z), 0, 0, 0));
+    write_imageui(out_materials, (int4)(p, 0),
+                  (uint4)(material_at(materials, p0.x, p0.y, p0.z), 0, 0, 0));
+    write_edge(out_edges_x, p,
+               downsample_edge(samples, edges_x, p0, (int3)(1, 0, 0)));
+    write_edge(out_edges_y, p,
+               downsample_edge(samples, edges_y, p0, (int3)(0, 1, 0)));
+    write_edge(out_edges_z, p,
+               downsample_edge(samples, edges_z, p0, (int3)(0, 0, 1)));
+}
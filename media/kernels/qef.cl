@@ -49,18 +49,17 @@ float4 edge_data(read_only image3d_t edges_x,
                  int vy,
                  int vz,
                  int edge) {
-    const int4 xyzw = (int4)(vx + edge_offset[edge][0],
-                             vy + edge_offset[edge][1],
-                             vz + edge_offset[edge][2],
-                             0);
+    const int3 p = (int3)(vx + edge_offset[edge][0],
+                          vy + edge_offset[edge][1],
+                          vz + edge_offset[edge][2]);
     switch (edge_axis[edge]) {
     default:
     case 0:
-        return read_imagef(edges_x, nearest_sampler, xyzw);
+        return read_edge(edges_x, p);
     case 1:
-        return read_imagef(edges_y, nearest_sampler, xyzw);
+        return read_edge(edges_y, p);
     case 2:
-        return read_imagef(edges_z, nearest_sampler, xyzw);
+        return read_edge(edges_z, p);
     }
 }
 
@@ -82,13 +81,43 @@ bool is_edge_active(short signs[2][2][2], int edge) {
     return active_edge(s0, s1);
 }
 
+/**
+ * @returns the most common material of the voxel's corners inside the volume
+ * (or on its surface), according to their @p signs
+ */
+uint voxel_material(short signs[2][2][2], uint materials[2][2][2]) {
+    uint material = 0;
+    int best_count = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (signs[i >> 2][(i >> 1) & 1][i & 1] > 0) {
+            continue;
+        }
+        const uint candidate = materials[i >> 2][(i >> 1) & 1][i & 1];
+        int count = 0;
+        for (int j = 0; j < 8; ++j) {
+            count += signs[j >> 2][(j >> 1) & 1][j & 1] <= 0
+                     && materials[j >> 2][(j >> 1) & 1][j & 1] == candidate;
+        }
+        if (count > best_count) {
+            material = candidate;
+            best_count = count;
+        }
+    }
+    return material;
+}
+
+/**
+ * Solves the vertex of each active voxel, and stores it along with the voxel's
+ * material into @p voxel_vertices (VERTEX_SIZE floats per voxel).
+ */
 kernel void solve_qef(read_only image3d_t samples,
                       read_only image3d_t edges_x,
                       read_only image3d_t edges_y,
                       read_only image3d_t edges_z,
                       float3 chunk_origin,
                       global float *voxel_vertices,
-                      global uint *voxel_mask) {
+                      global uint *voxel_mask,
+                      read_only image3d_t materials) {
     const int x = get_global_id(0);
     const int y = get_global_id(1);
     const int z = get_global_id(2);
@@ -140,9 +169,20 @@ kernel void solve_qef(read_only image3d_t samples,
 #else
         const float3 vertex = masspoint / (float)(active_edges);
 #endif // WITH_FEATURES
-        voxel_vertices[3 * index + 0] = vertex.x;
-        voxel_vertices[3 * index + 1] = vertex.y;
-        voxel_vertices[3 * index + 2] = vertex.z;
+        uint corner_materials[2][2][2];
+        for (int k = 0; k < 2; ++k) {
+            for (int j = 0; j < 2; ++j) {
+                for (int i = 0; i < 2; ++i) {
+                    corner_materials[k][j][i] =
+                            material_at(materials, x + i, y + j, z + k);
+                }
+            }
+        }
+        voxel_vertices[VERTEX_SIZE * index + 0] = vertex.x;
+        voxel_vertices[VERTEX_SIZE * index + 1] = vertex.y;
+        voxel_vertices[VERTEX_SIZE * index + 2] = vertex.z;
+        voxel_vertices[VERTEX_SIZE * index + 3] =
+                (float) voxel_material(values, corner_materials);
     }
     voxel_mask[index] = !!active_edges;
 }
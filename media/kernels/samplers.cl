@@ -14,90 +14,372 @@ float sdf_cube(float3 p, float3 origin, float3 scale, mat3 rotation) {
     return max(p.x - scale.x, max(p.y - scale.y, p.z - scale.z));
 }
 
+#if defined(BRUSH_COMPOSITE)
+/* Must match BrushComposite */
+#define NODE_BALL 0
+#define NODE_CUBE 1
+#define NODE_UNION 2
+#define NODE_INTERSECTION 3
+#define NODE_DIFFERENCE 4
+#define NODE_SIZE 16
+#define MAX_DEPTH 8
+
+/**
+ * Evaluates the postfix program of @p num_nodes at @p p. Primitives are placed
+ * in the brush space, where the brush of size (2 * scale) is of size 1, and
+ * their distances are scaled back to the world like sdf_ball() does: exactly
+ * for a uniform scale, as a lower bound otherwise.
+ */
+float sdf_composite(float3 p,
+                    float3 origin,
+                    float3 scale,
+                    mat3 rotation,
+                    constant const float *nodes,
+                    int num_nodes) {
+    const float3 q = mul_mat3_float3(rotation, p - origin) / (2 * scale);
+    float stack[MAX_DEPTH];
+    int top = 0;
+    for (int i = 0; i < num_nodes; ++i) {
+        constant const float *node = nodes + NODE_SIZE * i;
+        const int type = (int) node[0];
+        if (type == NODE_BALL || type == NODE_CUBE) {
+            mat3 node_rotation;
+            node_rotation.row0 = vload3(0, node + 7);
+            node_rotation.row1 = vload3(0, node + 10);
+            node_rotation.row2 = vload3(0, node + 13);
+            const float3 node_origin = vload3(0, node + 1);
+            const float3 node_scale = vload3(0, node + 4);
+            stack[top++] = type == NODE_BALL
+                                   ? sdf_ball(q, node_origin, node_scale,
+                                              node_rotation)
+                                   : sdf_cube(q, node_origin, node_scale,
+                                              node_rotation);
+            continue;
+        }
+        const float rhs = stack[--top];
+        const float lhs = stack[top - 1];
+        switch (type) {
+        case NODE_UNION: stack[top - 1] = min(lhs, rhs); break;
+        case NODE_INTERSECTION: stack[top - 1] = max(lhs, rhs); break;
+        case NODE_DIFFERENCE: stack[top - 1] = max(lhs, -rhs); break;
+        }
+    }
+    return stack[0] * 2 * min(min(scale.x, scale.y), scale.z);
+}
+#endif
+
+/**
+ * Evaluates the brush selected at the build time at @p p. Only the composite
+ * brush uses @p nodes.
+ */
+float sdf_func(float3 p,
+               float3 origin,
+               float3 scale,
+               mat3 rotation,
+               constant const float *nodes,
+               int num_nodes) {
 #if defined(BRUSH_BALL)
-#define sdf_func sdf_ball
+    return sdf_ball(p, origin, scale, rotation);
 #elif defined(BRUSH_CUBE)
-#define sdf_func sdf_cube
+    return sdf_cube(p, origin, scale, rotation);
+#elif defined(BRUSH_COMPOSITE)
+    return sdf_composite(p, origin, scale, rotation, nodes, num_nodes);
 #endif
+}
+
+#define SDF(p) sdf_func(p, brush_origin, brush_scale, brush_rotation, \
+                        brush_nodes, num_brush_nodes)
 
 #define OPERATION_ADD 0
 #define OPERATION_SUB 1
 
-kernel void sample(read_only image3d_t samples_in,
-                   write_only image3d_t samples_out,
-                   int operation_type,
-                   float3 chunk_origin,
-                   float3 brush_origin,
-                   float3 brush_scale,
-                   mat3 brush_rotation) {
-    const int x = get_global_id(0);
-    const int y = get_global_id(1);
-    const int z = get_global_id(2);
-
-    if (!IS_SAMPLE_COORD(x, y, z)) {
-        return;
-    }
+#if defined(VM_DISTANCE_SAMPLES)
+/* Must match VolumeParams */
+#define SAMPLES_PER_VOXEL 256.0f
+#define MAX_SAMPLE 32767.0f
+/* Blend radius, in voxels */
+#define BLEND_RADIUS ((float) (VM_BLEND_RADIUS) / (float) (VM_VOXEL_SIZE))
 
-    const short old_sample =
-            read_imagei(samples_in, nearest_sampler, (int4)(x, y, z, 0)).x;
+/**
+ * @returns smooth minimum of @p a and @p b, which differs from the plain one
+ * if they are closer than @p k to each other.
+ */
+float smooth_min(float a, float b, float k) {
+    if (k <= 0) {
+        return min(a, b);
+    }
+    const float h = max(k - fabs(a - b), 0.0f) / k;
+    return min(a, b) - 0.25f * h * h * k;
+}
 
-    short new_sample = as_sign(sdf_func(vertex_at(x, y, z, chunk_origin),
-                                     brush_origin,
-                                     brush_scale,
-                                     brush_rotation));
+/**
+ * @returns the @p old_sample with the operation applied, for the brush at
+ * distance @p d. Distances are kept in voxels, so that they fit in 16 bits.
+ */
+short apply_brush(short old_sample, float d, int operation_type) {
+    const float a = old_sample / SAMPLES_PER_VOXEL;
+    const float b = d / (float) (VM_VOXEL_SIZE);
+    float value;
     switch (operation_type) {
     default:
     case OPERATION_ADD:
-        new_sample = min(new_sample, old_sample);
+        value = smooth_min(a, b, BLEND_RADIUS);
         break;
     case OPERATION_SUB:
-        new_sample = max((short)(-new_sample), old_sample);
+        value = -smooth_min(-a, b, BLEND_RADIUS);
         break;
     }
-    write_imagei(samples_out, (int4)(x, y, z, 0),
-                 (int4)(new_sample, 0, 0, 0));
+    return (short) clamp(round(value * SAMPLES_PER_VOXEL), -MAX_SAMPLE,
+                         MAX_SAMPLE);
+}
+#else
+/**
+ * @returns the @p old_sample with the operation applied, for the brush at
+ * distance @p d. Only signs are kept.
+ */
+short apply_brush(short old_sample, float d, int operation_type) {
+    const short sample = as_sign(d);
+    switch (operation_type) {
+    default:
+    case OPERATION_ADD:
+        return min(sample, old_sample);
+    case OPERATION_SUB:
+        return max((short) (-sample), old_sample);
+    }
+}
+#endif
+
+/**
+ * Computes the range of sample values, and of their materials, over the whole
+ * chunk. Each invocation goes over a single row of samples, so that there are
+ * only (N+3)^2 atomics per range.
+ */
+kernel void classify_samples(read_only image3d_t samples,
+                             read_only image3d_t materials,
+                             global int *out_ranges,
+                             uint slot) {
+    const int y = get_global_id(0);
+    const int z = get_global_id(1);
+
+    if (!IS_SAMPLE_COORD(0, y, z)) {
+        return;
+    }
+
+    int lo = sample_at(samples, 0, y, z);
+    int hi = lo;
+    int material_lo = material_at(materials, 0, y, z);
+    int material_hi = material_lo;
+    for (int x = 1; x < DIM_SAMPLES; ++x) {
+        const int value = sample_at(samples, x, y, z);
+        lo = min(lo, value);
+        hi = max(hi, value);
+        const int material = material_at(materials, x, y, z);
+        material_lo = min(material_lo, material);
+        material_hi = max(material_hi, material);
+    }
+    atomic_min(&out_ranges[4 * slot + 0], lo);
+    atomic_max(&out_ranges[4 * slot + 1], hi);
+    atomic_min(&out_ranges[4 * slot + 2], material_lo);
+    atomic_max(&out_ranges[4 * slot + 3], material_hi);
 }
 
 float3 compute_sdf_normal(float3 p,
-                          float3 origin,
-                          float3 scale,
-                          mat3 rotation,
+                          float3 brush_origin,
+                          float3 brush_scale,
+                          mat3 brush_rotation,
+                          constant const float *brush_nodes,
+                          int num_brush_nodes,
                           float epsilon) {
     const float2 E = (float2)(epsilon, 0);
-    const float f = sdf_func(p, origin, scale, rotation);
-    const float dx = sdf_func(p + E.xyy, origin, scale, rotation)
-                     - sdf_func(p - E.xyy, origin, scale, rotation);
-    const float dy = sdf_func(p + E.yxy, origin, scale, rotation)
-                     - sdf_func(p - E.yxy, origin, scale, rotation);
-    const float dz = sdf_func(p + E.yyx, origin, scale, rotation)
-                     - sdf_func(p - E.yyx, origin, scale, rotation);
+    const float dx = SDF(p + E.xyy) - SDF(p - E.xyy);
+    const float dy = SDF(p + E.yxy) - SDF(p - E.yxy);
+    const float dz = SDF(p + E.yyx) - SDF(p - E.yyx);
     return normalize((float3)(dx, dy, dz));
 }
 
+/*
+ * Root finders locate the crossing of an edge with the brush surface. The one
+ * selected at the build time defines:
+ *
+ *   float find_crossing(v0, v1, d0, d1, brush...)
+ *     @returns where (0 - at v0, 1 - at v1) the edge from v0 (inside, brush
+ *     distance d0 <= 0) to v1 (outside, d1 >= 0) crosses the surface
+ *   float3 brush_normal(p, brush...)
+ *     @returns normal of the brush surface at p
+ */
+#if defined(ROOT_FINDER_ANALYTIC) && defined(BRUSH_BALL)
+float find_crossing(float3 v0,
+                    float3 v1,
+                    float d0,
+                    float d1,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    /* Exit from the unit sphere in the brush space: the larger root of
+       |q0 + t * dq|^2 = 1, of opposite sign to the other one as q0 is in */
+    const float3 q0 =
+            mul_mat3_float3(brush_rotation, v0 - brush_origin) / brush_scale;
+    const float3 dq = mul_mat3_float3(brush_rotation, v1 - v0) / brush_scale;
+    const float a = dot(dq, dq);
+    const float b = dot(q0, dq);
+    const float c = dot(q0, q0) - 1;
+    const float root = sqrt(max(b * b - a * c, 0.0f));
+    /* Avoid the cancellation of -b + root */
+    const float t = b > 0 ? -c / (b + root) : (root - b) / a;
+    return clamp(t, 0.0f, 1.0f);
+}
+
+float3 brush_normal(float3 p,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    const float3 q =
+            mul_mat3_float3(brush_rotation, p - brush_origin) / brush_scale;
+    return normalize(
+            mul_mat3_transposed_float3(brush_rotation, q / brush_scale));
+}
+#elif defined(ROOT_FINDER_ANALYTIC) && defined(BRUSH_CUBE)
+float find_crossing(float3 v0,
+                    float3 v1,
+                    float d0,
+                    float d1,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    /* Exit from the box in the brush space: the first slab to be left */
+    const float3 q0 = mul_mat3_float3(brush_rotation, v0 - brush_origin);
+    const float3 dq = mul_mat3_float3(brush_rotation, v1 - v0);
+    const float3 exits = select((copysign(brush_scale, dq) - q0) / dq,
+                                (float3)(1.0f), dq == 0);
+    return clamp(min(exits.x, min(exits.y, exits.z)), 0.0f, 1.0f);
+}
+
+float3 brush_normal(float3 p,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    const float3 q = mul_mat3_float3(brush_rotation, p - brush_origin);
+    const float3 d = fabs(q) - brush_scale;
+    float3 normal;
+    if (d.x >= max(d.y, d.z)) {
+        normal = (float3)(sign(q.x), 0, 0);
+    } else if (d.y >= d.z) {
+        normal = (float3)(0, sign(q.y), 0);
+    } else {
+        normal = (float3)(0, 0, sign(q.z));
+    }
+    return mul_mat3_transposed_float3(brush_rotation, normal);
+}
+#elif defined(ROOT_FINDER_ANALYTIC)
+#error "The brush has no analytic root finder"
+#else
+#if defined(ROOT_FINDER_BISECTION)
 #define MAX_BISECTION_STEPS 16
-kernel void update_edges(write_only image3d_t edges,
-                         int axis,
-                         float3 chunk_origin,
-                         float3 brush_origin,
-                         float3 brush_scale,
-                         mat3 brush_rotation) {
-    /* Minimal edge endpoint */
-    const int x0 = get_global_id(0);
-    const int y0 = get_global_id(1);
-    const int z0 = get_global_id(2);
-
-    if (!IS_EDGE_COORD(x0, y0, z0, axis)) {
-        return;
+float find_crossing(float3 v0,
+                    float3 v1,
+                    float d0,
+                    float d1,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    float lo = 0.0f;
+    float hi = 1.0f;
+    float mid = 0.0f;
+    for (int i = 0; i < MAX_BISECTION_STEPS; ++i) {
+        mid = 0.5f * (lo + hi);
+        const float value = SDF(mix(v0, v1, mid));
+        if (value > 0) {
+            hi = mid;
+        } else if (value < 0) {
+            lo = mid;
+        } else {
+            break;
+        }
+    }
+    return mid;
+}
+#else
+#define MAX_ILLINOIS_STEPS 8
+/* Brush distance close enough to the surface, well below the edge precision */
+#define ROOT_TOLERANCE (1e-4f * (float) (VM_VOXEL_SIZE))
+/**
+ * Regula falsi with the Illinois modification: the bracket end that is kept
+ * twice in a row gets its distance halved, so that both ends converge.
+ */
+float find_crossing(float3 v0,
+                    float3 v1,
+                    float d0,
+                    float d1,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    float lo = 0.0f;
+    float hi = 1.0f;
+    float t = 0.5f;
+    int kept = 0;
+    for (int i = 0; i < MAX_ILLINOIS_STEPS && d0 < d1; ++i) {
+        t = (lo * d1 - hi * d0) / (d1 - d0);
+        const float value = SDF(mix(v0, v1, t));
+        if (fabs(value) <= ROOT_TOLERANCE) {
+            break;
+        } else if (value > 0) {
+            hi = t;
+            d1 = value;
+            d0 *= kept < 0 ? 0.5f : 1.0f;
+            kept = -1;
+        } else {
+            lo = t;
+            d0 = value;
+            d1 *= kept > 0 ? 0.5f : 1.0f;
+            kept = 1;
+        }
     }
-    /* Maximal edge endpoint */
-    const int x1 = get_global_id(0) + (axis == 0);
-    const int y1 = get_global_id(1) + (axis == 1);
-    const int z1 = get_global_id(2) + (axis == 2);
+    return t;
+}
+#endif
+
+float3 brush_normal(float3 p,
+                    float3 brush_origin,
+                    float3 brush_scale,
+                    mat3 brush_rotation,
+                    constant const float *brush_nodes,
+                    int num_brush_nodes) {
+    return compute_sdf_normal(p, brush_origin, brush_scale, brush_rotation,
+                              brush_nodes, num_brush_nodes, 1e-5);
+}
+#endif
 
-    float3 v0 = vertex_at(x0, y0, z0, chunk_origin);
-    float3 v1 = vertex_at(x1, y1, z1, chunk_origin);
-    short s0 = as_sign(sdf_func(v0, brush_origin, brush_scale, brush_rotation));
-    short s1 = as_sign(sdf_func(v1, brush_origin, brush_scale, brush_rotation));
+/**
+ * Finds the intersection of the edge (@p v0, @p v1), whose endpoints have the
+ * brush distances @p d0 and @p d1, with the brush surface, and stores it at
+ * @p p0 of the @p edges image. Edges the brush surface doesn't cross are left
+ * untouched.
+ */
+void update_edge(write_only image3d_t edges,
+                 int3 p0,
+                 float3 v0,
+                 float3 v1,
+                 float d0,
+                 float d1,
+                 float3 brush_origin,
+                 float3 brush_scale,
+                 mat3 brush_rotation,
+                 constant const float *brush_nodes,
+                 int num_brush_nodes) {
+    short s0 = as_sign(d0);
+    short s1 = as_sign(d1);
 
     /* This must be weaker than active_edge() or otherwise SDF subtraction
        won't work. */
@@ -110,32 +392,235 @@ kernel void update_edges(write_only image3d_t edges,
     bool swapped = false;
     if (s0 > s1) {
         swap(float3, v0, v1);
+        swap(float, d0, d1);
         swapped = true;
     }
 
-    float lo = 0.0f;
-    float hi = 1.0f;
-    float mid = 0.0f;
-    float value;
-    float3 point;
+    float t = find_crossing(v0, v1, d0, d1, brush_origin, brush_scale,
+                            brush_rotation, brush_nodes, num_brush_nodes);
+    const float3 normal =
+            brush_normal(mix(v0, v1, t), brush_origin, brush_scale,
+                         brush_rotation, brush_nodes, num_brush_nodes);
+    if (swapped) {
+        t = 1 - t;
+    }
+    write_edge(edges, p0, (float4)(normal, t));
+}
 
-    for (int i = 0; i < MAX_BISECTION_STEPS; ++i) {
-        mid = 0.5f * (lo + hi);
-        point = mix(v0, v1, mid);
-        value = sdf_func(point, brush_origin, brush_scale, brush_rotation);
+/* @returns true if @p p lies within the box [@p lo, @p hi] */
+bool in_box(int3 p, int3 lo, int3 hi) {
+    return all(p >= lo) && all(p <= hi);
+}
 
-        if (value > 0) {
-            hi = mid;
-        } else if (value < 0) {
-            lo = mid;
-        } else {
-            break;
+#if defined(VM_DISTANCE_SAMPLES)
+/**
+ * @returns the sample at @p q once the brush is applied to the box
+ * [@p box_min, @p box_max] of samples, as sample_and_update_edges() writes it.
+ */
+float blended_sample_at(read_only image3d_t samples_in,
+                        int3 q,
+                        int3 box_min,
+                        int3 box_max,
+                        float3 chunk_origin,
+                        int operation_type,
+                        float3 brush_origin,
+                        float3 brush_scale,
+                        mat3 brush_rotation,
+                        constant const float *brush_nodes,
+                        int num_brush_nodes) {
+    /* Coordinates past the image are clamped, as they are when read */
+    q = clamp(q, 0, DIM_SAMPLES - 1);
+    const short old_sample = sample_at(samples_in, q.x, q.y, q.z);
+    if (!in_box(q, box_min, box_max)) {
+        return old_sample;
+    }
+    return apply_brush(old_sample, SDF(vertex_at(q.x, q.y, q.z, chunk_origin)),
+                       operation_type);
+}
+
+/* @returns central difference gradient of the blended samples at @p q */
+float3 blended_gradient_at(read_only image3d_t samples_in,
+                           int3 q,
+                           int3 box_min,
+                           int3 box_max,
+                           float3 chunk_origin,
+                           int operation_type,
+                           float3 brush_origin,
+                           float3 brush_scale,
+                           mat3 brush_rotation,
+                           constant const float *brush_nodes,
+                           int num_brush_nodes) {
+#define BLENDED(q)                                                            \
+    blended_sample_at(samples_in, q, box_min, box_max, chunk_origin,          \
+                      operation_type, brush_origin, brush_scale,              \
+                      brush_rotation, brush_nodes, num_brush_nodes)
+    const int3 dx = (int3)(1, 0, 0);
+    const int3 dy = (int3)(0, 1, 0);
+    const int3 dz = (int3)(0, 0, 1);
+    return (float3)(BLENDED(q + dx) - BLENDED(q - dx),
+                    BLENDED(q + dy) - BLENDED(q - dy),
+                    BLENDED(q + dz) - BLENDED(q - dz));
+#undef BLENDED
+}
+
+/**
+ * Interpolates the crossing of the edge from @p p0 to @p p1 with the surface,
+ * out of the samples @p s0 and @p s1 at its endpoints, and stores it at @p p0
+ * of the @p edges image. Edges whose samples are left the same as they were
+ * (@p old0, @p old1) are untouched, as are inactive ones.
+ *
+ * The normal is the gradient of the blended samples rather than of the brush,
+ * which is what orients the surface across the blend.
+ */
+void interpolate_edge(write_only image3d_t edges,
+                      read_only image3d_t samples_in,
+                      int3 p0,
+                      int3 p1,
+                      short old0,
+                      short old1,
+                      short s0,
+                      short s1,
+                      int3 box_min,
+                      int3 box_max,
+                      float3 chunk_origin,
+                      int operation_type,
+                      float3 brush_origin,
+                      float3 brush_scale,
+                      mat3 brush_rotation,
+                      constant const float *brush_nodes,
+                      int num_brush_nodes) {
+    if (!active_edge(s0, s1) || (s0 == old0 && s1 == old1)) {
+        return;
+    }
+    const float t = (float) s0 / (float) (s0 - s1);
+#define GRADIENT(p)                                                           \
+    blended_gradient_at(samples_in, p, box_min, box_max, chunk_origin,        \
+                        operation_type, brush_origin, brush_scale,            \
+                        brush_rotation, brush_nodes, num_brush_nodes)
+    const float3 gradient = mix(GRADIENT(p0), GRADIENT(p1), t);
+#undef GRADIENT
+    /* Flat samples (e.g. clamped ones) are oriented by the brush instead */
+    const float3 normal =
+            length(gradient) > 0
+                    ? normalize(gradient)
+                    : brush_normal(mix(vertex_at(p0.x, p0.y, p0.z,
+                                                 chunk_origin),
+                                       vertex_at(p1.x, p1.y, p1.z,
+                                                 chunk_origin),
+                                       t),
+                                   brush_origin, brush_scale, brush_rotation,
+                                   brush_nodes, num_brush_nodes);
+    write_edge(edges, p0, (float4)(normal, t));
+}
+#endif
+
+/**
+ * Applies the brush to the box [@p box_min, @p box_max] of samples, giving the
+ * ones it adds to the volume its @p material, and updates edges of all 3 axes
+ * (including the ones ending at the first sample of the box) whose endpoints
+ * it puts on the opposite sides of its surface.
+ * Distance samples are interpolated instead, for edges whose samples change.
+ * They are read from @p samples_in and written to a separate @p samples_out,
+ * as samples of the neighbours are needed.
+ *
+ * The brush is evaluated just once per sample: each work-group evaluates it
+ * over its block of samples, extended by one towards the further endpoints of
+ * its edges, into the local @p block. The launch must start at most one
+ * sample before the box, its extra invocations do nothing.
+ */
+kernel void sample_and_update_edges(read_only image3d_t samples_in,
+                                    write_only image3d_t samples_out,
+                                    write_only image3d_t edges_x,
+                                    write_only image3d_t edges_y,
+                                    write_only image3d_t edges_z,
+                                    write_only image3d_t materials,
+                                    int operation_type,
+                                    uint material,
+                                    int3 box_min,
+                                    int3 box_max,
+                                    float3 chunk_origin,
+                                    float3 brush_origin,
+                                    float3 brush_scale,
+                                    mat3 brush_rotation,
+                                    constant const float *brush_nodes,
+                                    int num_brush_nodes,
+                                    local float *block) {
+    const int3 local_id =
+            (int3)(get_local_id(0), get_local_id(1), get_local_id(2));
+    const int3 local_size =
+            (int3)(get_local_size(0), get_local_size(1), get_local_size(2));
+    const int3 p = (int3)(get_global_id(0), get_global_id(1), get_global_id(2));
+    const int3 block_min = p - local_id;
+    const int3 block_size = local_size + 1;
+
+    const int num_invocations = local_size.x * local_size.y * local_size.z;
+    const int block_count = block_size.x * block_size.y * block_size.z;
+    const int local_index =
+            local_id.x
+            + local_size.x * (local_id.y + local_size.y * local_id.z);
+    for (int i = local_index; i < block_count; i += num_invocations) {
+        const int3 q = block_min
+                       + (int3)(i % block_size.x,
+                                (i / block_size.x) % block_size.y,
+                                i / (block_size.x * block_size.y));
+        block[i] = SDF(vertex_at(q.x, q.y, q.z, chunk_origin));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+#define BLOCK_AT(q) \
+    block[(q).x + block_size.x * ((q).y + block_size.y * (q).z)]
+    const float d = BLOCK_AT(local_id);
+    const float3 v = vertex_at(p.x, p.y, p.z, chunk_origin);
+    const short old_sample = sample_at(samples_in, p.x, p.y, p.z);
+    const bool sampled = in_box(p, box_min, box_max);
+    const short new_sample =
+            sampled ? apply_brush(old_sample, d, operation_type) : old_sample;
+    if (sampled && IS_SAMPLE_COORD(p.x, p.y, p.z)) {
+        write_imagei(samples_out, (int4)(p, 0), (int4)(new_sample, 0, 0, 0));
+        /* Removed samples keep their material, so that it shows again once
+           the brush exposes them */
+        if (operation_type == OPERATION_ADD && new_sample <= 0
+            && new_sample < old_sample) {
+            write_imageui(materials, (int4)(p, 0), (uint4)(material, 0, 0, 0));
         }
     }
-    if (swapped) {
-        mid = 1 - mid;
+
+#if defined(VM_DISTANCE_SAMPLES)
+#define UPDATE_EDGE(edges, axis)                                              \
+    do {                                                                      \
+        const int3 p1 = p + (axis);                                           \
+        const float d1 = BLOCK_AT(local_id + (axis));                         \
+        const short old1 = sample_at(samples_in, p1.x, p1.y, p1.z);           \
+        const short new1 = in_box(p1, box_min, box_max)                       \
+                                   ? apply_brush(old1, d1, operation_type)    \
+                                   : old1;                                    \
+        interpolate_edge(edges, samples_in, p, p1, old_sample, old1,          \
+                         new_sample, new1, box_min, box_max, chunk_origin,    \
+                         operation_type, brush_origin, brush_scale,           \
+                         brush_rotation, brush_nodes, num_brush_nodes);       \
+    } while (0)
+#else
+#define UPDATE_EDGE(edges, axis)                                              \
+    do {                                                                      \
+        const int3 p1 = p + (axis);                                           \
+        update_edge(edges, p, v, vertex_at(p1.x, p1.y, p1.z, chunk_origin),   \
+                    d, BLOCK_AT(local_id + (axis)), brush_origin,             \
+                    brush_scale, brush_rotation, brush_nodes,                 \
+                    num_brush_nodes);                                         \
+    } while (0)
+#endif
+    const int3 dx = (int3)(1, 0, 0);
+    const int3 dy = (int3)(0, 1, 0);
+    const int3 dz = (int3)(0, 0, 1);
+    if (in_box(p, box_min - dx, box_max) && IS_X_EDGE_COORD(p.x, p.y, p.z)) {
+        UPDATE_EDGE(edges_x, dx);
+    }
+    if (in_box(p, box_min - dy, box_max) && IS_Y_EDGE_COORD(p.x, p.y, p.z)) {
+        UPDATE_EDGE(edges_y, dy);
+    }
+    if (in_box(p, box_min - dz, box_max) && IS_Z_EDGE_COORD(p.x, p.y, p.z)) {
+        UPDATE_EDGE(edges_z, dz);
     }
-    const float3 normal = compute_sdf_normal(point, brush_origin, brush_scale,
-                                             brush_rotation, 1e-5);
-    write_imagef(edges, (int4)(x0, y0, z0, 0), (float4)(normal, mid));
+#undef UPDATE_EDGE
+#undef BLOCK_AT
 }
@@ -9,6 +9,13 @@ short sample_at(read_only image3d_t samples, int x, int y, int z) {
     return read_imagei(samples, nearest_sampler, (int4)(x, y, z, 0)).x;
 }
 
+uint material_at(read_only image3d_t materials, int x, int y, int z) {
+    return read_imageui(materials, nearest_sampler, (int4)(x, y, z, 0)).x;
+}
+
+/* Floats of each mesh vertex: position and material (see ChunkMesh) */
+#define VERTEX_SIZE 4
+
 bool active_edge(short s0, short s1) {
     return (s0 > 0 && s1 == 0) || (s0 == 0 && s1 > 0) || (s0 * s1 < 0);
 }
@@ -31,8 +38,15 @@ short as_sign(float value) {
         b = tmp;         \
     } while (0)
 
+/* Level of detail kernels are built for (0 - full resolution) */
+#ifndef VM_LOD
+#define VM_LOD 0
+#endif
+/* Number of full resolution voxels spanned by a single voxel at VM_LOD */
+#define LOD_SCALE (1 << (VM_LOD))
+
 /* Dimension of a voxel grid without additional layer used to "fix" cracks */
-#define DIM_VOXEL_GRID (VM_CHUNK_SIZE)
+#define DIM_VOXEL_GRID (VM_CHUNK_SIZE >> (VM_LOD))
 /* Dimension of a voxel grid with additional layer used to "fix" cracks */
 #define DIM_EXTENDED_VOXEL_GRID (DIM_VOXEL_GRID + 2)
 /* Dimension of a samples array (including samples for voxels in additional layer) */
@@ -84,10 +98,73 @@ float3 vertex_at(int x, int y, int z, float3 chunk_origin) {
     const float3 half_dim =
             0.5f
             * (float3)(VM_CHUNK_SIZE + 3, VM_CHUNK_SIZE + 3, VM_CHUNK_SIZE + 3);
-    return (float) (VM_VOXEL_SIZE) * ((float3)(x, y, z) - half_dim)
+    /* Coarser samples coincide with every LOD_SCALE-th full resolution one */
+    return (float) (VM_VOXEL_SIZE)
+                   * ((float3)(x, y, z) * LOD_SCALE - half_dim)
            + chunk_origin;
 }
 
+#if defined(WITH_COMPACT_EDGES)
+/* Bits of each octahedral normal coordinate, and of the crossing */
+#define EDGE_NORMAL_BITS 11
+#define EDGE_CROSSING_BITS 10
+#define EDGE_NORMAL_MAX ((1 << EDGE_NORMAL_BITS) - 1)
+#define EDGE_CROSSING_MAX ((1 << EDGE_CROSSING_BITS) - 1)
+
+/**
+ * Packs the @p normal, projected onto an octahedron and unfolded onto a
+ * square, and the crossing @p t in [0, 1] into 32 bits.
+ */
+uint encode_edge(float3 normal, float t) {
+    const float norm = fabs(normal.x) + fabs(normal.y) + fabs(normal.z);
+    const float3 n = norm > 0 ? normal / norm : (float3)(0, 0, 1);
+    float2 e = n.xy;
+    if (n.z < 0) {
+        e = (1 - fabs(n.yx)) * (float2)(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+    }
+    const uint2 q = convert_uint2_sat_rte((0.5f * e + 0.5f) * EDGE_NORMAL_MAX);
+    const uint qt = convert_uint_sat_rte(t * EDGE_CROSSING_MAX);
+    return q.x | (q.y << EDGE_NORMAL_BITS)
+           | (qt << (2 * EDGE_NORMAL_BITS));
+}
+
+/** @returns (normal, crossing) packed by encode_edge() */
+float4 decode_edge(uint edge) {
+    const float2 e = (float2)(edge & EDGE_NORMAL_MAX,
+                              (edge >> EDGE_NORMAL_BITS) & EDGE_NORMAL_MAX)
+                             / EDGE_NORMAL_MAX * 2
+                     - 1;
+    float3 n = (float3)(e, 1 - fabs(e.x) - fabs(e.y));
+    const float fold = max(-n.z, 0.0f);
+    n.x += n.x >= 0 ? -fold : fold;
+    n.y += n.y >= 0 ? -fold : fold;
+    const float t =
+            (float) (edge >> (2 * EDGE_NORMAL_BITS)) / EDGE_CROSSING_MAX;
+    return (float4)(normalize(n), t);
+}
+#endif
+
+#if defined(cl_khr_3d_image_writes)
+/** Stores the (normal, crossing) @p edge at @p p of the @p edges image */
+void write_edge(write_only image3d_t edges, int3 p, float4 edge) {
+#if defined(WITH_COMPACT_EDGES)
+    write_imageui(edges, (int4)(p, 0),
+                  (uint4)(encode_edge(edge.xyz, edge.w), 0, 0, 0));
+#else
+    write_imagef(edges, (int4)(p, 0), edge);
+#endif
+}
+#endif
+
+/** @returns (normal, crossing) of the edge at @p p of the @p edges image */
+float4 read_edge(read_only image3d_t edges, int3 p) {
+#if defined(WITH_COMPACT_EDGES)
+    return decode_edge(read_imageui(edges, nearest_sampler, (int4)(p, 0)).x);
+#else
+    return read_imagef(edges, nearest_sampler, (int4)(p, 0));
+#endif
+}
+
 typedef struct {
     float3 row0;
     float3 row1;
@@ -105,6 +182,11 @@ float3 mul_mat3_float3(mat3 A, float3 v) {
     return (float3)(dot(A.row0, v), dot(A.row1, v), dot(A.row2, v));
 }
 
+/* @returns A^T v, e.g. a brush space vector rotated back to the world space */
+float3 mul_mat3_transposed_float3(mat3 A, float3 v) {
+    return v.x * A.row0 + v.y * A.row1 + v.z * A.row2;
+}
+
 float4 mul_mat4_float4(mat4 A, float4 v) {
     return (float4)(dot(A.row0, v), dot(A.row1, v), dot(A.row2, v), dot(A.row3, v));
 }
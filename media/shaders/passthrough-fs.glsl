@@ -1,8 +1,33 @@
 out vec4 out_color;
-in vec3 vs_position;
 in vec3 gs_normal;
+in vec3 gs_position;
+flat in vec3 gs_materials;
+in vec3 gs_weights;
+
+#if defined(WITH_MATERIALS)
+layout(binding=0) uniform sampler2DArray materials;
+
+vec3 triplanar(in vec3 N, in vec3 P, in float material_id) {
+    vec3 blending = clamp(abs(N) - 0.5, 0.0, 1.0);
+    blending *= blending;
+    blending *= blending;
+    blending /= max(dot(blending, vec3(1,1,1)), 1e-5);
+    vec3 xaxis = texture(materials, vec3(P.yz, material_id)).rgb;
+    vec3 yaxis = texture(materials, vec3(P.xz, material_id)).rgb;
+    vec3 zaxis = texture(materials, vec3(P.xy, material_id)).rgb;
+    return xaxis*blending.x + yaxis*blending.y + zaxis*blending.z;
+}
+#endif
 
 void main() {
     const vec3 L = normalize(vec3(1,1,1));
+#if defined(WITH_MATERIALS)
+    /* Materials of the vertices blend across the triangle */
+    vec3 albedo = gs_weights.x * triplanar(gs_normal, gs_position, gs_materials.x)
+                + gs_weights.y * triplanar(gs_normal, gs_position, gs_materials.y)
+                + gs_weights.z * triplanar(gs_normal, gs_position, gs_materials.z);
+    out_color = vec4(max(0.1, dot(gs_normal, -L)) * albedo, 1);
+#else
     out_color = vec4(gs_normal.xyz*abs(min(0.1, dot(gs_normal, -L))), 1);
+#endif
 }
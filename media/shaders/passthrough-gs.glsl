@@ -3,22 +3,38 @@ layout(triangle_strip, max_vertices=3) out;
 
 uniform mat4 g_mvp;
 
+in float vs_material[];
+
 out vec3 gs_normal;
+out vec3 gs_position;
+/* Materials of the triangle's vertices, and weights of each of them */
+flat out vec3 gs_materials;
+out vec3 gs_weights;
 
 void main() {
     vec3 v0 = gl_in[0].gl_Position.xyz;
     vec3 v1 = gl_in[1].gl_Position.xyz;
     vec3 v2 = gl_in[2].gl_Position.xyz;
     vec3 normal = normalize(cross(v1-v0, v2-v0));
+    vec3 materials = vec3(vs_material[0], vs_material[1], vs_material[2]);
 
     gl_Position = g_mvp * vec4(v0, 1);
     gs_normal = normal;
+    gs_position = v0;
+    gs_materials = materials;
+    gs_weights = vec3(1, 0, 0);
     EmitVertex();
     gl_Position = g_mvp * vec4(v1, 1);
     gs_normal = normal;
+    gs_position = v1;
+    gs_materials = materials;
+    gs_weights = vec3(0, 1, 0);
     EmitVertex();
     gl_Position = g_mvp * vec4(v2, 1);
     gs_normal = normal;
+    gs_position = v2;
+    gs_materials = materials;
+    gs_weights = vec3(0, 0, 1);
     EmitVertex();
     EndPrimitive();
 }
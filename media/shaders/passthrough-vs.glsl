@@ -1,6 +1,9 @@
 layout(location=0) in vec3 position;
-layout(location=1) in vec3 normal;
+layout(location=1) in float material;
+
+out float vs_material;
 
 void main() {
     gl_Position = vec4(position, 1);
+    vs_material = material;
 }
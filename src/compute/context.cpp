@@ -5,7 +5,13 @@ using namespace std;
 
 namespace vm {
 
-ComputeContext::ComputeContext(MakeSharedEnabler, bool gl_shared) {
+ComputeContext::ComputeContext(MakeSharedEnabler, bool gl_shared)
+        : context()
+        , queue()
+        , queue_mutex()
+        , programs()
+        , programs_mutex()
+        , gl_shared(gl_shared) {
     if (gl_shared) {
         context = move(compute::opengl_create_shared_context());
     } else {
@@ -15,6 +15,8 @@
 #include <boost/compute/image.hpp>
 #include <boost/compute/interop/opengl.hpp>
 #include <boost/compute/utility/dim.hpp>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <mutex>
 
@@ -30,6 +32,11 @@ public:
     compute::context context;
     compute::command_queue queue;
     std::mutex queue_mutex;
+    /* Programs built for the context so far, see build_program() */
+    std::map<uint64_t, compute::program> programs;
+    std::mutex programs_mutex;
+    /* Whether the context can share buffers with the current GL context */
+    const bool gl_shared;
 
     ComputeContext(MakeSharedEnabler, bool gl_shared);
 
@@ -0,0 +1,78 @@
+#include "compute/gl-sync.h"
+#include "utils/log.h"
+
+using namespace std;
+
+namespace vm {
+
+GLSync::GLSync(const ComputeContext &ctx)
+        : m_context(ctx.context)
+        , m_create_event_from_gl_sync(nullptr)
+        , m_gl_waits_for_events(false) {
+    const compute::device device = m_context.get_device();
+    if (!ctx.gl_shared || !device.supports_extension("cl_khr_gl_event")
+        || !GLEW_ARB_sync) {
+        LOG(info) << "GL/CL interop synchronized with glFinish";
+        return;
+    }
+    m_create_event_from_gl_sync = reinterpret_cast<CreateEventFromGLsync>(
+            device.platform().get_extension_function_address(
+                    "clCreateEventFromGLsyncKHR"));
+    if (!m_create_event_from_gl_sync) {
+        LOG(warning) << "clCreateEventFromGLsyncKHR missing, GL/CL interop "
+                        "synchronized with glFinish";
+        return;
+    }
+    m_gl_waits_for_events = GLEW_ARB_cl_event;
+    LOG(info) << "GL/CL interop synchronized with events"
+              << (m_gl_waits_for_events ? " on both sides" : "");
+}
+
+void GLSync::acquire(compute::command_queue &queue,
+                     const vector<cl_mem> &objects) {
+    if (!has_events()) {
+        glFinish();
+        // Acquiring more objects at once deadlocked on some drivers.
+        for (cl_mem object : objects) {
+            compute::opengl_enqueue_acquire_gl_objects(1, &object, queue);
+        }
+        return;
+    }
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // Fence has to reach the GL server before CL may wait for it.
+    glFlush();
+    cl_int error = CL_SUCCESS;
+    compute::event fenced(m_create_event_from_gl_sync(
+                                  m_context.get(),
+                                  reinterpret_cast<cl_GLsync>(fence),
+                                  &error),
+                          false);
+    glDeleteSync(fence);
+    if (error != CL_SUCCESS) {
+        BOOST_THROW_EXCEPTION(compute::opencl_error(error));
+    }
+    compute::opengl_enqueue_acquire_gl_objects(
+            objects.size(), objects.data(), queue, compute::wait_list(fenced));
+}
+
+compute::event GLSync::release(compute::command_queue &queue,
+                               const vector<cl_mem> &objects) {
+    compute::event released = compute::opengl_enqueue_release_gl_objects(
+            objects.size(), objects.data(), queue);
+    if (!has_events()) {
+        queue.finish();
+        return released;
+    }
+    queue.flush();
+    if (m_gl_waits_for_events) {
+        GLsync sync = glCreateSyncFromCLeventARB(
+                m_context.get(), released.get(), 0);
+        glWaitSync(sync, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(sync);
+    }
+    // Otherwise cl_khr_gl_event itself orders GL commands issued from now on
+    // after the flushed release.
+    return released;
+}
+
+} // namespace vm
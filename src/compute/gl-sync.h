@@ -0,0 +1,54 @@
+#ifndef VM_COMPUTE_GL_SYNC_H
+#define VM_COMPUTE_GL_SYNC_H
+#include "compute/context.h"
+
+#include <vector>
+
+namespace vm {
+
+/**
+ * Orders OpenCL work on shared GL objects with the GL pipeline.
+ *
+ * With cl_khr_gl_event, objects are acquired once a GL fence signals rather
+ * than after glFinish(), and with GL_ARB_cl_event as well, GL waits for the
+ * release on its own side, so that neither the renderer nor the caller stalls.
+ * Without the extensions, both pipelines are drained instead.
+ */
+class GLSync {
+    typedef cl_event(CL_API_CALL *CreateEventFromGLsync)(cl_context,
+                                                         cl_GLsync,
+                                                         cl_int *);
+    compute::context m_context;
+    CreateEventFromGLsync m_create_event_from_gl_sync;
+    bool m_gl_waits_for_events;
+
+public:
+    /** Checks which extensions the @p ctx and the current GL context have */
+    explicit GLSync(const ComputeContext &ctx);
+
+    /** @returns whether synchronization goes through events */
+    inline bool has_events() const {
+        return m_create_event_from_gl_sync != nullptr;
+    }
+
+    /**
+     * Enqueues acquisition of the @p objects on @p queue, past the GL commands
+     * issued so far. Must be called from the thread owning the GL context.
+     */
+    void acquire(compute::command_queue &queue,
+                 const std::vector<cl_mem> &objects);
+
+    /**
+     * Enqueues release of the @p objects on @p queue, which GL commands issued
+     * after this call are ordered after. Must be called from the thread owning
+     * the GL context.
+     *
+     * @returns event completing once the objects are released
+     */
+    compute::event release(compute::command_queue &queue,
+                           const std::vector<cl_mem> &objects);
+};
+
+} // namespace vm
+
+#endif /* VM_COMPUTE_GL_SYNC_H */
@@ -13,6 +13,13 @@ struct Vec3Repr {
     Vec3Repr() : Vec3Repr(glm::vec3(0, 0, 0)) {}
 };
 
+struct Ivec3Repr {
+    cl_int3 row;
+
+    Ivec3Repr(const glm::ivec3 &v) : row({ v.x, v.y, v.z }) {}
+    Ivec3Repr() : Ivec3Repr(glm::ivec3(0, 0, 0)) {}
+};
+
 struct Vec4Repr {
     cl_float4 row;
 
@@ -70,6 +77,14 @@ struct set_kernel_arg<glm::vec3> {
     }
 };
 
+template <>
+struct set_kernel_arg<glm::ivec3> {
+    void operator()(kernel &kernel_, size_t index, const glm::ivec3 &v) {
+        vm::Ivec3Repr value(v);
+        kernel_.set_arg(index, sizeof(value), &value);
+    }
+};
+
 template <>
 struct set_kernel_arg<glm::vec4> {
     void operator()(kernel &kernel_, size_t index, const glm::vec4 &v) {
@@ -0,0 +1,240 @@
+#include "program-cache.h"
+
+#include "utils/log.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace vm {
+
+namespace {
+const uint32_t CACHE_MAGIC = 0x43504d56; // "VMPC"
+const uint32_t CACHE_VERSION = 1;
+
+/* 64-bit FNV-1a, stable across runs and platforms unlike std::hash */
+class Hash {
+    uint64_t m_value;
+
+public:
+    Hash() : m_value(0xcbf29ce484222325ull) {}
+
+    Hash &operator<<(const string &data) {
+        for (unsigned char c : data) {
+            m_value = (m_value ^ c) * 0x100000001b3ull;
+        }
+        // Separator, so that ("ab", "c") and ("a", "bc") differ.
+        m_value = (m_value ^ 0xff) * 0x100000001b3ull;
+        return *this;
+    }
+
+    uint64_t value() const {
+        return m_value;
+    }
+};
+
+string read_file(const string &path) {
+    ifstream file(path, ios::in | ios::binary);
+    if (!file) {
+        throw runtime_error("Cannot open " + path);
+    }
+    ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+/**
+ * Hashes the files @p source includes (recursively), as the compiler resolves
+ * them relative to the working directory. Files that can't be read just
+ * contribute their names, the compiler is going to complain about them anyway.
+ */
+void hash_includes(const string &source, Hash &hash, set<string> &visited) {
+    istringstream lines(source);
+    string line;
+    while (getline(lines, line)) {
+        const size_t directive = line.find("#include");
+        if (directive == string::npos) {
+            continue;
+        }
+        const size_t begin = line.find('"', directive);
+        const size_t end = line.find('"', begin + 1);
+        if (begin == string::npos || end == string::npos) {
+            continue;
+        }
+        const string path = line.substr(begin + 1, end - begin - 1);
+        if (!visited.insert(path).second) {
+            continue;
+        }
+        hash << path;
+        try {
+            const string included = read_file(path);
+            hash << included;
+            hash_includes(included, hash, visited);
+        } catch (const exception &) {
+        }
+    }
+}
+
+uint64_t build_key(const compute::context &context,
+                   const string &source,
+                   const string &options) {
+    const compute::device device = context.get_device();
+    const compute::platform platform = device.platform();
+    Hash hash;
+    hash << source << options << device.name() << device.vendor()
+         << device.version() << device.driver_version() << platform.name()
+         << platform.version();
+    set<string> visited;
+    hash_includes(source, hash, visited);
+    return hash.value();
+}
+
+/** @returns directory of the disk cache, empty if it is disabled */
+string cache_directory() {
+    if (const char *dir = getenv("VM_PROGRAM_CACHE_DIR")) {
+        return dir;
+    }
+    if (const char *dir = getenv("XDG_CACHE_HOME")) {
+        return (fs::path(dir) / "volume-modeler").string();
+    }
+    if (const char *dir = getenv("HOME")) {
+        return (fs::path(dir) / ".cache" / "volume-modeler").string();
+    }
+    return string();
+}
+
+string cache_filename(const string &directory, uint64_t key) {
+    return (fs::path(directory)
+            / boost::str(boost::format("%016x.bin") % key))
+            .string();
+}
+
+bool load_binary(const string &filename,
+                 uint64_t key,
+                 vector<unsigned char> &binary) {
+    ifstream file(filename, ios::in | ios::binary);
+    if (!file) {
+        return false;
+    }
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t stored_key = 0;
+    uint64_t size = 0;
+    file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(&stored_key), sizeof(stored_key));
+    file.read(reinterpret_cast<char *>(&size), sizeof(size));
+    if (!file || magic != CACHE_MAGIC || version != CACHE_VERSION
+        || stored_key != key || size > (uint64_t(1) << 30)) {
+        return false;
+    }
+    binary.resize(size);
+    file.read(reinterpret_cast<char *>(binary.data()), size);
+    return file && !binary.empty();
+}
+
+void store_binary(const string &directory,
+                  uint64_t key,
+                  const vector<unsigned char> &binary) {
+    fs::create_directories(directory);
+    const string filename = cache_filename(directory, key);
+    // Written aside and renamed, so that concurrent runs never see a part.
+    const string temporary =
+            filename + fs::unique_path(".%%%%-%%%%").string();
+    {
+        ofstream file(temporary, ios::out | ios::binary);
+        const uint64_t size = binary.size();
+        file.write(reinterpret_cast<const char *>(&CACHE_MAGIC),
+                   sizeof(CACHE_MAGIC));
+        file.write(reinterpret_cast<const char *>(&CACHE_VERSION),
+                   sizeof(CACHE_VERSION));
+        file.write(reinterpret_cast<const char *>(&key), sizeof(key));
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(reinterpret_cast<const char *>(binary.data()),
+                   binary.size());
+        if (!file.flush()) {
+            fs::remove(temporary);
+            throw runtime_error("Cannot write " + temporary);
+        }
+    }
+    fs::rename(temporary, filename);
+}
+
+/** Builds the program of the @p key, from the disk cache if possible */
+compute::program build_keyed_program(const compute::context &context,
+                                     uint64_t key,
+                                     const string &source,
+                                     const string &options) {
+    const string directory = cache_directory();
+    compute::program program;
+    vector<unsigned char> binary;
+    if (!directory.empty()
+        && load_binary(cache_filename(directory, key), key, binary)) {
+        try {
+            program = compute::program::create_with_binary(binary, context);
+            program.build(options);
+            LOG(trace) << "Loaded cached program "
+                       << cache_filename(directory, key);
+        } catch (const exception &e) {
+            LOG(warning) << "Rebuilding stale cached program "
+                         << cache_filename(directory, key) << ": "
+                         << e.what();
+            program = compute::program();
+        }
+    }
+    if (!program.get()) {
+        program = compute::program::create_with_source(source, context);
+        program.build(options);
+        if (!directory.empty()) {
+            try {
+                store_binary(directory, key, program.binary());
+            } catch (const exception &e) {
+                LOG(warning) << "Cannot cache program binary: " << e.what();
+            }
+        }
+    }
+    return program;
+}
+} // namespace
+
+compute::program build_program(ComputeContext &ctx,
+                               const string &source,
+                               const string &options) {
+    const uint64_t key = build_key(ctx.context, source, options);
+    lock_guard<mutex> programs_lock(ctx.programs_mutex);
+    auto it = ctx.programs.find(key);
+    if (it != ctx.programs.end()) {
+        return it->second;
+    }
+    const compute::program program =
+            build_keyed_program(ctx.context, key, source, options);
+    ctx.programs.emplace(key, program);
+    return program;
+}
+
+compute::program build_program(const compute::context &context,
+                               const string &source,
+                               const string &options) {
+    return build_keyed_program(context,
+                               build_key(context, source, options),
+                               source,
+                               options);
+}
+
+compute::program build_program_from_file(ComputeContext &ctx,
+                                         const string &path,
+                                         const string &options) {
+    return build_program(ctx, read_file(path), options);
+}
+
+} // namespace vm
@@ -0,0 +1,41 @@
+#ifndef VM_COMPUTE_PROGRAM_CACHE_H
+#define VM_COMPUTE_PROGRAM_CACHE_H
+#include "compute/context.h"
+
+#include <string>
+
+namespace vm {
+
+/**
+ * Builds the program from @p source with @p options, reusing the binary of an
+ * identical build whenever possible.
+ *
+ * Builds are keyed by the source (along with the files it includes), the
+ * options, the device and its driver version. Programs are shared by the users
+ * of @p ctx, and released along with it, while their binaries are kept on disk
+ * (in $VM_PROGRAM_CACHE_DIR, or $XDG_CACHE_HOME/volume-modeler by default) for
+ * the next runs. A binary that fails to load or build is silently replaced by
+ * a build from the source. Setting VM_PROGRAM_CACHE_DIR to an empty string
+ * disables the disk cache.
+ */
+compute::program build_program(ComputeContext &ctx,
+                               const std::string &source,
+                               const std::string &options = std::string());
+
+/**
+ * Same as build_program(), for a bare @p context, so that the program is not
+ * shared with anyone and only its binary is cached.
+ */
+compute::program build_program(const compute::context &context,
+                               const std::string &source,
+                               const std::string &options = std::string());
+
+/** Same as build_program(), but reads the source from the file at @p path */
+compute::program
+build_program_from_file(ComputeContext &ctx,
+                        const std::string &path,
+                        const std::string &options = std::string());
+
+} // namespace vm
+
+#endif /* VM_COMPUTE_PROGRAM_CACHE_H */
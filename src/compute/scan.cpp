@@ -1,5 +1,7 @@
 #include "scan.h"
 
+#include "compute/program-cache.h"
+
 #include "utils/log.h"
 
 #include <sstream>
@@ -73,6 +75,12 @@ static size_t align_to_block_size(size_t input, size_t block_size) {
     }
     return input;
 }
+
+static string scan_options(size_t block_size) {
+    std::ostringstream inclusive_opts;
+    inclusive_opts << " -DBLK_SIZE=" << block_size;
+    return inclusive_opts.str();
+}
 } // namespace
 
 Scan::Scan()
@@ -83,22 +91,29 @@ Scan::Scan()
         , m_fixup_scan() {}
 
 Scan::Scan(compute::command_queue &queue, size_t input_size)
+        : Scan(queue,
+               build_program(queue.get_context(),
+                             scan_source,
+                             scan_options(Scan::BLOCK_SIZE)),
+               input_size) {}
+
+Scan::Scan(ComputeContext &ctx,
+           compute::command_queue &queue,
+           size_t input_size)
+        : Scan(queue,
+               build_program(ctx,
+                             scan_source,
+                             scan_options(Scan::BLOCK_SIZE)),
+               input_size) {}
+
+Scan::Scan(compute::command_queue &queue,
+           const compute::program &program,
+           size_t input_size)
         : m_input_size(input_size)
         , m_aligned_size(align_to_block_size(input_size, Scan::BLOCK_SIZE))
         , m_phases()
-        , m_local_inclusive_scan()
-        , m_fixup_scan() {
-    {
-        auto program =
-                compute::program::create_with_source(scan_source,
-                                                     queue.get_context());
-        std::ostringstream inclusive_opts;
-        inclusive_opts << " -DBLK_SIZE=" << Scan::BLOCK_SIZE;
-        program.build(inclusive_opts.str());
-        m_local_inclusive_scan = program.create_kernel("local_scan");
-        m_fixup_scan = program.create_kernel("fixup_scan");
-    }
-
+        , m_local_inclusive_scan(program.create_kernel("local_scan"))
+        , m_fixup_scan(program.create_kernel("fixup_scan")) {
     size_t num_phases = 0;
     {
         size_t size = m_input_size;
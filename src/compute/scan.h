@@ -17,9 +17,15 @@ class Scan {
     compute::kernel m_local_inclusive_scan;
     compute::kernel m_fixup_scan;
 
+    Scan(compute::command_queue &queue,
+         const compute::program &program,
+         size_t input_size);
+
 public:
     Scan();
     Scan(compute::command_queue &queue, size_t input_size);
+    /** Same as above, sharing the program with other users of the @p ctx */
+    Scan(ComputeContext &ctx, compute::command_queue &queue, size_t input_size);
 
     Scan(Scan &&) = default;
     Scan &operator=(Scan &&) = default;
@@ -20,6 +20,46 @@ compute::event enqueue_auto_distributed_nd_range_kernel(
             kernel, N, nullptr, global_work_size.data(), nullptr, events);
 }
 
+// Same as above, but the global ids start at @p global_work_offset.
+template <size_t N>
+compute::event enqueue_auto_distributed_nd_range_kernel(
+        compute::command_queue &queue,
+        const compute::kernel &kernel,
+        const compute::extents<N> &global_work_offset,
+        const compute::extents<N> &global_work_size,
+        const compute::wait_list &events = compute::wait_list()) {
+    return queue.enqueue_nd_range_kernel(kernel,
+                                         N,
+                                         global_work_offset.data(),
+                                         global_work_size.data(),
+                                         nullptr,
+                                         events);
+}
+
+// Runs the kernel in work-groups of @p local_work_size, over the
+// @p global_work_size rounded up to whole work-groups. Kernels have to ignore
+// the extra invocations themselves.
+template <size_t N>
+compute::event enqueue_nd_range_kernel_in_groups(
+        compute::command_queue &queue,
+        const compute::kernel &kernel,
+        const compute::extents<N> &global_work_offset,
+        const compute::extents<N> &global_work_size,
+        const compute::extents<N> &local_work_size,
+        const compute::wait_list &events = compute::wait_list()) {
+    compute::extents<N> rounded_work_size;
+    for (size_t i = 0; i < N; ++i) {
+        rounded_work_size[i] = (global_work_size[i] + local_work_size[i] - 1)
+                               / local_work_size[i] * local_work_size[i];
+    }
+    return queue.enqueue_nd_range_kernel(kernel,
+                                         N,
+                                         global_work_offset.data(),
+                                         rounded_work_size.data(),
+                                         local_work_size.data(),
+                                         events);
+}
+
 static inline compute::event
 enqueue_read_image3d_async(compute::command_queue &queue,
                            const compute::image3d &image,
@@ -41,6 +81,51 @@ enqueue_read_image3d_async(compute::command_queue &queue,
     return event;
 }
 
+// Reads just the box of the @p image at @p origin of @p region size, packed.
+static inline compute::event
+enqueue_read_image3d_async(compute::command_queue &queue,
+                           const compute::image3d &image,
+                           const compute::extents<3> &origin,
+                           const compute::extents<3> &region,
+                           void *hostptr) {
+    compute::event event;
+    cl_int retval = clEnqueueReadImage(queue.get(),
+                                       image.get(),
+                                       CL_FALSE,
+                                       origin.data(),
+                                       region.data(),
+                                       0,
+                                       0,
+                                       hostptr,
+                                       0,
+                                       nullptr,
+                                       &event.get());
+    assert(retval == CL_SUCCESS);
+    (void) retval;
+    return event;
+}
+
+static inline compute::event
+enqueue_write_image3d_async(compute::command_queue &queue,
+                            compute::image3d &image,
+                            const void *hostptr) {
+    compute::event event;
+    cl_int retval = clEnqueueWriteImage(queue.get(),
+                                        image.get(),
+                                        CL_FALSE,
+                                        compute::dim(0, 0, 0).data(),
+                                        image.size().data(),
+                                        0,
+                                        0,
+                                        hostptr,
+                                        0,
+                                        nullptr,
+                                        &event.get());
+    assert(retval == CL_SUCCESS);
+    (void) retval;
+    return event;
+}
+
 static inline compute::event
 enqueue_write_image3d(compute::command_queue &queue,
                       compute::image3d &image,
@@ -80,6 +165,10 @@ image_format_size(const compute::image_format &format) {
         case CL_UNSIGNED_INT16:
         case CL_HALF_FLOAT:
             return 2;
+        case CL_SIGNED_INT32:
+        case CL_UNSIGNED_INT32:
+        case CL_FLOAT:
+            return 4;
         default:
             throw std::invalid_argument("unsupported channel format");
         }
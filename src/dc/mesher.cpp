@@ -3,6 +3,7 @@
 #include "mesher.h"
 
 #include "compute/interop.h"
+#include "compute/program-cache.h"
 #include "compute/utils.h"
 
 #include "scene/chunk.h"
@@ -10,103 +11,257 @@
 
 #include "utils/log.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <string>
+
 using namespace std;
 namespace vm {
 namespace dc {
 
-static const size_t N = VM_CHUNK_SIZE;
-
-void Mesher::init_buffers() {
-    // Actually this is a bit too much than it needs to be, because the
-    // regular grid of (N+2) voxels has 3 * (N+2)*(N+3)*(N+3) edges.
-    //
-    // Allocating a bigger buffer makes compute kernels easier to write
-    // though.
-    const size_t num_edges = 3 * ((N + 3) * (N + 3) * (N + 3));
-    m_edges_scan = move(Scan(m_compute_ctx->queue, num_edges));
-    m_edge_mask = compute::vector<uint32_t>(num_edges, m_compute_ctx->context);
-    m_scanned_edges =
-            compute::vector<uint32_t>(num_edges, m_compute_ctx->context);
-    compute::fill(m_scanned_edges.begin(),
-                  m_scanned_edges.end(),
-                  0,
-                  m_compute_ctx->queue);
-    compute::fill(
-            m_edge_mask.begin(), m_edge_mask.end(), 0, m_compute_ctx->queue);
-
-    const size_t num_voxels = (N + 2) * (N + 2) * (N + 2);
-    m_voxels_scan = move(Scan(m_compute_ctx->queue, num_voxels));
-    m_voxel_mask =
-            compute::vector<uint32_t>(num_voxels, m_compute_ctx->context);
-    m_scanned_voxels =
-            compute::vector<uint32_t>(num_voxels, m_compute_ctx->context);
-
-    m_voxel_vertices =
-            compute::vector<float>(3 * num_voxels, m_compute_ctx->context);
-}
-
-void Mesher::init_kernels() {
-    {
-        auto program = compute::program::create_with_source_file(
-                "media/kernels/selectors.cl", m_compute_ctx->context);
-        program.build();
+constexpr size_t Mesher::MAX_16_BIT_VERTICES;
+
+void Mesher::init_buffers(Workspace &workspace) {
+    compute::command_queue &queue = workspace.queue;
+    for (Level &level : workspace.levels) {
+        const size_t n = level.dim;
+        // Actually this is a bit too much than it needs to be, because the
+        // regular grid of (n+2) voxels has 3 * (n+2)*(n+3)*(n+3) edges.
+        //
+        // Allocating a bigger buffer makes compute kernels easier to write
+        // though.
+        const size_t num_edges = 3 * ((n + 3) * (n + 3) * (n + 3));
+        level.edges_scan = move(Scan(*m_compute_ctx, queue, num_edges));
+        level.edge_mask =
+                compute::vector<uint32_t>(num_edges, m_compute_ctx->context);
+        level.scanned_edges =
+                compute::vector<uint32_t>(num_edges, m_compute_ctx->context);
+        compute::fill(level.scanned_edges.begin(),
+                      level.scanned_edges.end(),
+                      0,
+                      queue);
+        compute::fill(level.edge_mask.begin(), level.edge_mask.end(), 0, queue);
+        level.active_edges =
+                compute::vector<uint32_t>(num_edges, m_compute_ctx->context);
+
+        const size_t num_voxels = (n + 2) * (n + 2) * (n + 2);
+        level.voxels_scan = move(Scan(*m_compute_ctx, queue, num_voxels));
+        level.voxel_mask =
+                compute::vector<uint32_t>(num_voxels, m_compute_ctx->context);
+        level.scanned_voxels =
+                compute::vector<uint32_t>(num_voxels, m_compute_ctx->context);
+
+        level.active_voxels =
+                compute::vector<uint32_t>(num_voxels, m_compute_ctx->context);
+
+        level.voxel_vertices = compute::vector<float>(
+                ChunkMesh::VERTEX_BYTES / sizeof(float) * num_voxels,
+                m_compute_ctx->context);
+    }
 
-        m_select_active_edges = program.create_kernel("select_active_edges");
+    if (workspace.levels.size() > 1) {
+        // Big enough for any coarser level, as they only use a corner of it.
+        const size_t n = workspace.levels[1].dim;
+        const compute::context &context = m_compute_ctx->context;
+        Volume &volume = workspace.lod_volume;
+        volume.samples = compute::image3d(
+                context, n + 3, n + 3, n + 3, Scene::samples_format());
+        volume.edges_x = compute::image3d(
+                context, n + 3, n + 3, n + 3, Scene::edges_format());
+        volume.edges_y = compute::image3d(
+                context, n + 3, n + 3, n + 3, Scene::edges_format());
+        volume.edges_z = compute::image3d(
+                context, n + 3, n + 3, n + 3, Scene::edges_format());
+        volume.materials = compute::image3d(
+                context, n + 3, n + 3, n + 3, Scene::materials_format());
     }
+    queue.finish();
+}
 
-    {
-        auto program = compute::program::create_with_source_file(
-                "media/kernels/qef.cl", m_compute_ctx->context);
-        program.build();
-        m_solve_qef = program.create_kernel("solve_qef");
+void Mesher::init_kernels(Workspace &workspace) {
+    // Programs are built just once, each workspace has its own kernels for
+    // their arguments to be set independently.
+    for (size_t lod = 0; lod < workspace.levels.size(); ++lod) {
+        Level &level = workspace.levels[lod];
+        const string options =
+                "-DVM_LOD=" + to_string(lod) + " " + m_params.build_options();
+        {
+            auto program = build_program_from_file(*m_compute_ctx,
+                                                   "media/kernels/selectors.cl",
+                                                   options);
+
+            level.select_active_edges =
+                    program.create_kernel("select_active_edges");
+        }
+
+        {
+            auto program = build_program_from_file(*m_compute_ctx,
+                                                   "media/kernels/qef.cl",
+                                                   options);
+            level.solve_qef = program.create_kernel("solve_qef");
+        }
+
+        {
+            auto program = build_program_from_file(*m_compute_ctx,
+                                                   "media/kernels/contour.cl",
+                                                   options);
+            level.compact_edges = program.create_kernel("compact");
+            level.compact_voxels = program.create_kernel("compact");
+            level.copy_vertices = program.create_kernel("copy_vertices");
+            level.make_indices = program.create_kernel("make_indices");
+            level.make_indices_16 = program.create_kernel("make_indices_16");
+        }
+
+        if (lod > 0) {
+            auto program = build_program_from_file(
+                    *m_compute_ctx,
+                    "media/kernels/downsample.cl",
+                    options);
+            level.downsample = program.create_kernel("downsample");
+        }
     }
+}
 
+Mesher::Mesher(const shared_ptr<ComputeContext> &compute_ctx,
+               const VolumeParams &params,
+               size_t num_workspaces,
+               size_t max_16_bit_vertices)
+        : m_compute_ctx(compute_ctx)
+        , m_params(params)
+        , m_max_16_bit_vertices(
+                  std::min(max_16_bit_vertices, MAX_16_BIT_VERTICES))
+        , m_workspaces()
+        , m_free_workspaces_mutex()
+        , m_free_workspaces_cv()
+        , m_free_workspaces()
+        , m_upload_queue(compute_ctx->context,
+                         compute_ctx->context.get_device())
+        , m_gl_sync(*compute_ctx)
+        , m_thread_pool(std::max<size_t>(num_workspaces, 1)) {
+    m_params.validate();
+    for (size_t i = 0; i < std::max<size_t>(num_workspaces, 1); ++i) {
+        auto workspace = make_unique<Workspace>();
+        for (size_t lod = 0; lod < workspace->levels.size(); ++lod) {
+            workspace->levels[lod].dim = m_params.chunk_size >> lod;
+        }
+        workspace->queue = compute::command_queue(
+                compute_ctx->context, compute_ctx->context.get_device());
+        workspace->unordered_queue = compute_ctx->make_out_of_order_queue();
+        init_buffers(*workspace);
+        init_kernels(*workspace);
+        m_free_workspaces.push_back(workspace.get());
+        m_workspaces.push_back(move(workspace));
+    }
+}
+
+Mesher::Workspace &Mesher::acquire_workspace() {
+    unique_lock<mutex> free_lock(m_free_workspaces_mutex);
+    m_free_workspaces_cv.wait(free_lock,
+                              [&]() { return !m_free_workspaces.empty(); });
+    Workspace *workspace = m_free_workspaces.back();
+    m_free_workspaces.pop_back();
+    return *workspace;
+}
+
+void Mesher::release_workspace(Workspace &workspace) {
     {
-        auto program = compute::program::create_with_source_file(
-                "media/kernels/contour.cl", m_compute_ctx->context);
-        program.build();
-        m_copy_vertices = program.create_kernel("copy_vertices");
-        m_make_indices = program.create_kernel("make_indices");
+        lock_guard<mutex> free_lock(m_free_workspaces_mutex);
+        m_free_workspaces.push_back(&workspace);
     }
+    m_free_workspaces_cv.notify_one();
 }
 
-Mesher::Mesher(const shared_ptr<ComputeContext> &compute_ctx)
-        : m_compute_ctx(compute_ctx)
-        , m_unordered_queue(compute_ctx->make_out_of_order_queue()) {
-    init_buffers();
-    init_kernels();
+void Mesher::enqueue_downsample(Workspace &workspace,
+                                Level &level,
+                                const Volume &volume) {
+    const Volume &lod_volume = workspace.lod_volume;
+    level.downsample.set_arg(0, volume.samples);
+    level.downsample.set_arg(1, volume.edges_x);
+    level.downsample.set_arg(2, volume.edges_y);
+    level.downsample.set_arg(3, volume.edges_z);
+    level.downsample.set_arg(4, lod_volume.samples);
+    level.downsample.set_arg(5, lod_volume.edges_x);
+    level.downsample.set_arg(6, lod_volume.edges_y);
+    level.downsample.set_arg(7, lod_volume.edges_z);
+    level.downsample.set_arg(8, volume.materials);
+    level.downsample.set_arg(9, lod_volume.materials);
+
+    const size_t n = level.dim;
+    enqueue_auto_distributed_nd_range_kernel<3>(
+            workspace.queue,
+            level.downsample,
+            compute::dim(n + 3, n + 3, n + 3));
+    // Both of the next kernels read it, from the out of order queue.
+    workspace.queue.finish();
 }
 
-void Mesher::enqueue_select_edges(Chunk &chunk) {
+void Mesher::enqueue_select_edges(Workspace &workspace,
+                                  Level &level,
+                                  const Volume &volume) {
     // Mark active edges
-    m_select_active_edges.set_arg(0, m_edge_mask);
-    m_select_active_edges.set_arg(1, chunk.samples);
+    level.select_active_edges.set_arg(0, level.edge_mask);
+    level.select_active_edges.set_arg(1, volume.samples);
 
+    const size_t n = level.dim;
     auto event = enqueue_auto_distributed_nd_range_kernel<3>(
-            m_unordered_queue,
-            m_select_active_edges,
-            compute::dim(N + 3, N + 3, N + 3));
+            workspace.unordered_queue,
+            level.select_active_edges,
+            compute::dim(n + 3, n + 3, n + 3));
 
     // Count them
-    m_edges_scan.inclusive_scan(
-            m_edge_mask, m_scanned_edges, m_unordered_queue, event);
+    event = level.edges_scan.inclusive_scan(level.edge_mask,
+                                            level.scanned_edges,
+                                            workspace.unordered_queue,
+                                            event);
+
+    // And list them, for indices to be made just for the active ones
+    const size_t num_edges = level.edge_mask.size();
+    level.compact_edges.set_arg(0, level.active_edges);
+    level.compact_edges.set_arg(1, level.edge_mask);
+    level.compact_edges.set_arg(2, level.scanned_edges);
+    level.compact_edges.set_arg(3, static_cast<cl_uint>(num_edges));
+    enqueue_auto_distributed_nd_range_kernel<1>(workspace.unordered_queue,
+                                                level.compact_edges,
+                                                compute::dim(num_edges),
+                                                event);
 }
 
-void Mesher::enqueue_solve_qef(Chunk &chunk) {
-    m_solve_qef.set_arg(0, chunk.samples);
-    m_solve_qef.set_arg(1, chunk.edges_x);
-    m_solve_qef.set_arg(2, chunk.edges_y);
-    m_solve_qef.set_arg(3, chunk.edges_z);
-    m_solve_qef.set_arg(4, Scene::get_chunk_origin(chunk.coord));
-    m_solve_qef.set_arg(5, m_voxel_vertices);
-    m_solve_qef.set_arg(6, m_voxel_mask);
-
+void Mesher::enqueue_solve_qef(Workspace &workspace,
+                               Level &level,
+                               const Volume &volume,
+                               const glm::vec3 &origin) {
+    level.solve_qef.set_arg(0, volume.samples);
+    level.solve_qef.set_arg(1, volume.edges_x);
+    level.solve_qef.set_arg(2, volume.edges_y);
+    level.solve_qef.set_arg(3, volume.edges_z);
+    level.solve_qef.set_arg(4, origin);
+    level.solve_qef.set_arg(5, level.voxel_vertices);
+    level.solve_qef.set_arg(6, level.voxel_mask);
+    level.solve_qef.set_arg(7, volume.materials);
+
+    const size_t n = level.dim;
     auto event = enqueue_auto_distributed_nd_range_kernel<3>(
-            m_unordered_queue, m_solve_qef, compute::dim(N + 2, N + 2, N + 2));
+            workspace.unordered_queue,
+            level.solve_qef,
+            compute::dim(n + 2, n + 2, n + 2));
 
     // Count active voxels
-    m_voxels_scan.inclusive_scan(
-            m_voxel_mask, m_scanned_voxels, m_unordered_queue, event);
+    event = level.voxels_scan.inclusive_scan(level.voxel_mask,
+                                             level.scanned_voxels,
+                                             workspace.unordered_queue,
+                                             event);
+
+    // And list them
+    const size_t num_voxels = level.voxel_mask.size();
+    level.compact_voxels.set_arg(0, level.active_voxels);
+    level.compact_voxels.set_arg(1, level.voxel_mask);
+    level.compact_voxels.set_arg(2, level.scanned_voxels);
+    level.compact_voxels.set_arg(3, static_cast<cl_uint>(num_voxels));
+    enqueue_auto_distributed_nd_range_kernel<1>(workspace.unordered_queue,
+                                                level.compact_voxels,
+                                                compute::dim(num_voxels),
+                                                event);
 }
 
 namespace {
@@ -118,112 +273,233 @@ size_t align(size_t value, size_t alignment = 4096) {
 }
 
 void realloc_vbo_if_necessary(std::shared_ptr<ComputeContext> &ctx,
-                              Chunk &chunk,
+                              ChunkMesh &mesh,
                               uint32_t num_voxels) {
-    const size_t vertex_size = sizeof(glm::vec3);
-    if (chunk.vbo.size() < vertex_size * num_voxels) {
-        chunk.vbo = move(Buffer(BufferDesc{ GL_ARRAY_BUFFER,
-                                            GL_DYNAMIC_DRAW,
-                                            nullptr,
-                                            align(vertex_size * num_voxels) }));
-        chunk.cl_vbo = compute::opengl_buffer(ctx->context, chunk.vbo.id());
+    const size_t vertex_bytes = ChunkMesh::VERTEX_BYTES;
+    if (mesh.vbo.size() < vertex_bytes * num_voxels) {
+        mesh.vbo = move(Buffer(BufferDesc{ GL_ARRAY_BUFFER,
+                                           GL_DYNAMIC_DRAW,
+                                           nullptr,
+                                           align(vertex_bytes * num_voxels) }));
+        mesh.cl_vbo = compute::opengl_buffer(ctx->context, mesh.vbo.id());
     }
 }
 
 void realloc_ibo_if_necessary(std::shared_ptr<ComputeContext> &ctx,
-                              Chunk &chunk,
-                              size_t num_edges) {
-    if (chunk.ibo.size() < 6 * sizeof(unsigned) * num_edges) {
-        chunk.ibo = move(
-                Buffer(BufferDesc{ GL_ELEMENT_ARRAY_BUFFER,
-                                   GL_DYNAMIC_DRAW,
-                                   nullptr,
-                                   align(6 * sizeof(unsigned) * num_edges) }));
-        chunk.cl_ibo = compute::opengl_buffer(ctx->context, chunk.ibo.id());
+                              ChunkMesh &mesh,
+                              size_t num_indices,
+                              GLenum index_type) {
+    const size_t ibo_size = ChunkMesh::index_size(index_type) * num_indices;
+    if (mesh.ibo.size() < ibo_size) {
+        mesh.ibo = move(Buffer(BufferDesc{ GL_ELEMENT_ARRAY_BUFFER,
+                                           GL_DYNAMIC_DRAW,
+                                           nullptr,
+                                           align(ibo_size) }));
+        mesh.cl_ibo = compute::opengl_buffer(ctx->context, mesh.ibo.id());
+    }
+}
+
+void realloc_staged_if_necessary(std::shared_ptr<ComputeContext> &ctx,
+                                 ChunkMesh &mesh,
+                                 uint32_t num_voxels,
+                                 uint32_t num_edges) {
+    const size_t vbo_size = ChunkMesh::VERTEX_BYTES * num_voxels;
+    const size_t ibo_size =
+            6 * ChunkMesh::index_size(mesh.staged_index_type) * num_edges;
+    if (!mesh.staged_vbo.get() || mesh.staged_vbo.size() < vbo_size) {
+        mesh.staged_vbo = compute::buffer(ctx->context, align(vbo_size));
+    }
+    if (!mesh.staged_ibo.get() || mesh.staged_ibo.size() < ibo_size) {
+        mesh.staged_ibo = compute::buffer(ctx->context, align(ibo_size));
     }
 }
 } // namespace
 
-void Mesher::enqueue_contour(Chunk &chunk) {
-    uint32_t num_voxels = m_scanned_voxels.back();
-    uint32_t num_edges = m_scanned_edges.back();
-    realloc_vbo_if_necessary(m_compute_ctx, chunk, num_voxels);
-    realloc_ibo_if_necessary(m_compute_ctx, chunk, num_edges);
-    chunk.num_indices = 6 * num_edges;
-
-    // Ensure we don't have any race with acquire commands.
-    glFinish();
-
-    // TODO: Why acquiring ibo and vbo together causes deadlocks?!
-    clEnqueueAcquireGLObjects(m_compute_ctx->queue.get(),
-                              1,
-                              &chunk.cl_vbo.get(),
-                              0,
-                              nullptr,
-                              nullptr);
-    m_copy_vertices.set_arg(0, chunk.cl_vbo);
-    m_copy_vertices.set_arg(1, m_voxel_vertices);
-    m_copy_vertices.set_arg(2, m_voxel_mask);
-    m_copy_vertices.set_arg(3, m_scanned_voxels);
-    enqueue_auto_distributed_nd_range_kernel<1>(m_compute_ctx->queue,
-                                                m_copy_vertices,
-                                                compute::dim((N + 2) * (N + 2)
-                                                             * (N + 2)));
-
-    clEnqueueReleaseGLObjects(m_compute_ctx->queue.get(),
-                              1,
-                              &chunk.cl_vbo.get(),
-                              0,
-                              nullptr,
-                              nullptr);
-
-    clEnqueueAcquireGLObjects(m_compute_ctx->queue.get(),
-                              1,
-                              &chunk.cl_ibo.get(),
-                              0,
-                              nullptr,
-                              nullptr);
-    // TODO: Why this is necessary? I mean, the queue is ordered after all
-    m_compute_ctx->queue.flush();
-    m_compute_ctx->queue.finish();
-
-    m_make_indices.set_arg(0, chunk.cl_ibo);
-    m_make_indices.set_arg(1, m_edge_mask);
-    m_make_indices.set_arg(2, m_scanned_edges);
-    m_make_indices.set_arg(3, m_scanned_voxels);
-    m_make_indices.set_arg(4, chunk.samples);
+void Mesher::enqueue_contour(Workspace &workspace,
+                             Level &level,
+                             const Volume &volume,
+                             ChunkMesh &mesh) {
+    uint32_t num_voxels = level.scanned_voxels.back();
+    uint32_t num_edges = level.scanned_edges.back();
+
+    mesh.num_staged_vertices = num_voxels;
+    mesh.num_staged_indices = 6 * num_edges;
+    // Halves the index buffer of most of the meshes.
+    mesh.staged_index_type = num_voxels <= m_max_16_bit_vertices
+                                     ? GL_UNSIGNED_SHORT
+                                     : GL_UNSIGNED_INT;
+    mesh.pending = true;
+    if (!num_voxels || !num_edges) {
+        return;
+    }
+    realloc_staged_if_necessary(m_compute_ctx, mesh, num_voxels, num_edges);
+
+    level.copy_vertices.set_arg(0, mesh.staged_vbo);
+    level.copy_vertices.set_arg(1, level.voxel_vertices);
+    level.copy_vertices.set_arg(2, level.active_voxels);
+    level.copy_vertices.set_arg(3, static_cast<cl_uint>(num_voxels));
+    enqueue_auto_distributed_nd_range_kernel<1>(
+            workspace.queue, level.copy_vertices, compute::dim(num_voxels));
+
+    compute::kernel &make_indices = mesh.staged_index_type == GL_UNSIGNED_SHORT
+                                            ? level.make_indices_16
+                                            : level.make_indices;
+    make_indices.set_arg(0, mesh.staged_ibo);
+    make_indices.set_arg(1, level.active_edges);
+    make_indices.set_arg(2, level.scanned_voxels);
+    make_indices.set_arg(3, volume.samples);
+    make_indices.set_arg(4, static_cast<cl_uint>(num_edges));
     enqueue_auto_distributed_nd_range_kernel<1>(
-            m_compute_ctx->queue,
-            m_make_indices,
-            compute::dim(3 * (N + 3) * (N + 3) * (N + 3)));
+            workspace.queue, make_indices, compute::dim(num_edges));
 
-    clEnqueueReleaseGLObjects(m_compute_ctx->queue.get(),
-                              1,
-                              &chunk.cl_ibo.get(),
-                              0,
-                              nullptr,
-                              nullptr);
+    workspace.queue.finish();
+}
+
+void Mesher::contour(Workspace &workspace, Chunk &chunk) {
+    const Volume volume{ chunk.samples, chunk.edges_x, chunk.edges_y,
+                         chunk.edges_z, chunk.materials };
+    const glm::vec3 origin = m_params.chunk_origin(chunk.coord);
+    // Staging buffers are about to be overwritten.
+    for (ChunkMesh &mesh : chunk.meshes) {
+        if (mesh.uploaded.get()) {
+            mesh.uploaded.wait();
+        }
+    }
 
-    m_compute_ctx->queue.flush();
-    m_compute_ctx->queue.finish();
-    chunk.num_vertices = num_voxels;
+    for (size_t lod = 0; lod < workspace.levels.size(); ++lod) {
+        Level &level = workspace.levels[lod];
+        if (lod > 0) {
+            enqueue_downsample(workspace, level, volume);
+        }
+        const Volume &level_volume = lod > 0 ? workspace.lod_volume : volume;
+        enqueue_select_edges(workspace, level, level_volume);
+        enqueue_solve_qef(workspace, level, level_volume, origin);
+        workspace.unordered_queue.finish();
+        enqueue_contour(workspace, level, level_volume, chunk.meshes[lod]);
+    }
 }
 
 void Mesher::contour(Chunk &chunk) {
-    enqueue_select_edges(chunk);
-    enqueue_solve_qef(chunk);
-    m_unordered_queue.finish();
-#if 0
-    static size_t counter = 0;
-    if (counter == 10000) {
-        uint32_t active_edges = m_scanned_edges.back();
-        uint32_t active_voxels = m_scanned_voxels.back();
-        fprintf(stderr, "Active edges: %d; active voxels %d\n", active_edges, active_voxels);
-        counter = 0;
-    }
-    ++counter;
-#endif
-    enqueue_contour(chunk);
+    Workspace &workspace = acquire_workspace();
+    try {
+        contour(workspace, chunk);
+    } catch (...) {
+        release_workspace(workspace);
+        throw;
+    }
+    release_workspace(workspace);
+}
+
+void Mesher::contour(const vector<Chunk *> &chunks) {
+    if (chunks.size() == 1) {
+        contour(*chunks.front());
+        return;
+    }
+    mutex done_mutex;
+    condition_variable done_cv;
+    size_t remaining = chunks.size();
+    exception_ptr error;
+    for (Chunk *chunk : chunks) {
+        m_thread_pool.enqueue([&, chunk]() {
+            try {
+                contour(*chunk);
+            } catch (...) {
+                lock_guard<mutex> done_lock(done_mutex);
+                if (!error) {
+                    error = current_exception();
+                }
+            }
+            lock_guard<mutex> done_lock(done_mutex);
+            if (--remaining == 0) {
+                done_cv.notify_one();
+            }
+        });
+    }
+    unique_lock<mutex> done_lock(done_mutex);
+    done_cv.wait(done_lock, [&]() { return remaining == 0; });
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+void Mesher::upload(Chunk &chunk) {
+    for (ChunkMesh &mesh : chunk.meshes) {
+        if (mesh.pending) {
+            upload(mesh);
+        }
+    }
+}
+
+void Mesher::upload(ChunkMesh &mesh) {
+    const size_t num_vertices = mesh.num_staged_vertices;
+    const size_t num_indices = mesh.num_staged_indices;
+    mesh.pending = false;
+
+    if (!num_vertices || !num_indices) {
+        mesh.vbo = Buffer();
+        mesh.cl_vbo = compute::opengl_buffer();
+        mesh.ibo = Buffer();
+        mesh.cl_ibo = compute::opengl_buffer();
+        mesh.num_vertices = 0;
+        mesh.num_indices = 0;
+        return;
+    }
+    realloc_vbo_if_necessary(m_compute_ctx, mesh, num_vertices);
+    realloc_ibo_if_necessary(
+            m_compute_ctx, mesh, num_indices, mesh.staged_index_type);
+
+    const vector<cl_mem> objects{ mesh.cl_vbo.get(), mesh.cl_ibo.get() };
+    m_gl_sync.acquire(m_upload_queue, objects);
+    m_upload_queue.enqueue_copy_buffer(mesh.staged_vbo,
+                                       mesh.cl_vbo,
+                                       0,
+                                       0,
+                                       ChunkMesh::VERTEX_BYTES * num_vertices);
+    m_upload_queue.enqueue_copy_buffer(
+            mesh.staged_ibo,
+            mesh.cl_ibo,
+            0,
+            0,
+            ChunkMesh::index_size(mesh.staged_index_type) * num_indices);
+    mesh.uploaded = m_gl_sync.release(m_upload_queue, objects);
+    mesh.num_vertices = num_vertices;
+    mesh.num_indices = num_indices;
+    mesh.index_type = mesh.staged_index_type;
+}
+
+void Mesher::download(const ChunkMesh &mesh,
+                      vector<glm::vec3> &vertices,
+                      vector<uint32_t> &indices) {
+    vertices.resize(mesh.num_staged_vertices);
+    indices.resize(mesh.num_staged_indices);
+    if (vertices.empty() || indices.empty()) {
+        return;
+    }
+    // Vertices are packed as 4 floats, the same as glm::vec4.
+    vector<glm::vec4> staged_vertices(vertices.size());
+    m_compute_ctx->queue.enqueue_read_buffer(mesh.staged_vbo,
+                                             0,
+                                             ChunkMesh::VERTEX_BYTES
+                                                     * vertices.size(),
+                                             staged_vertices.data());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        vertices[i] = glm::vec3(staged_vertices[i]);
+    }
+    if (mesh.staged_index_type == GL_UNSIGNED_SHORT) {
+        vector<uint16_t> staged_indices(indices.size());
+        m_compute_ctx->queue.enqueue_read_buffer(mesh.staged_ibo,
+                                                 0,
+                                                 sizeof(uint16_t)
+                                                         * indices.size(),
+                                                 staged_indices.data());
+        copy(staged_indices.begin(), staged_indices.end(), indices.begin());
+    } else {
+        m_compute_ctx->queue.enqueue_read_buffer(mesh.staged_ibo,
+                                                 0,
+                                                 sizeof(uint32_t)
+                                                         * indices.size(),
+                                                 indices.data());
+    }
 }
 
 } // namespace dc
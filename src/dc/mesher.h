@@ -1,48 +1,168 @@
 #ifndef VM_DC_MESHER_H
 #define VM_DC_MESHER_H
+#include <config.h>
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
 
 #include "compute/context.h"
+#include "compute/gl-sync.h"
 #include "compute/scan.h"
 
+#include "scene/volume-params.h"
+
+#include "utils/thread-pool.h"
+
 namespace vm {
 class Chunk;
+class ChunkMesh;
 
 namespace dc {
 
 class Mesher {
+public:
+    /** Meshes of up to that many vertices are indexed with 16 bits */
+    static const constexpr size_t MAX_16_BIT_VERTICES = size_t(UINT16_MAX) + 1;
+
+private:
     std::shared_ptr<ComputeContext> m_compute_ctx;
-    compute::kernel m_select_active_edges;
-    compute::kernel m_solve_qef;
-    Scan m_edges_scan;
-    Scan m_voxels_scan;
-    /* Binary vector for each edge that tells whether an edge is active */
-    compute::vector<uint32_t> m_edge_mask;
-    /* Binary vector for each voxel that tells whether a voxel is active */
-    compute::vector<uint32_t> m_voxel_mask;
-    /* Prefixsums of active edges / voxels */
-    compute::vector<uint32_t> m_scanned_edges;
-    compute::vector<uint32_t> m_scanned_voxels;
-    /* Vertices solved by the QEF */
-    compute::vector<float> m_voxel_vertices;
-
-    /* Finally, some geometry generator */
-    compute::kernel m_copy_vertices;
-    compute::kernel m_make_indices;
-
-    /* A queue where active-edges and qef will be computed */
-    compute::command_queue m_unordered_queue;
-
-    void init_buffers();
-    void init_kernels();
-    void enqueue_select_edges(Chunk &chunk);
-    void enqueue_solve_qef(Chunk &chunk);
-    void enqueue_contour(Chunk &chunk);
+    VolumeParams m_params;
+    size_t m_max_16_bit_vertices;
+
+    /* Volumetric data to extract the surface from */
+    struct Volume {
+        compute::image3d samples;
+        compute::image3d edges_x;
+        compute::image3d edges_y;
+        compute::image3d edges_z;
+        compute::image3d materials;
+    };
+
+    /* Kernels and temporaries needed to mesh a single level of detail */
+    struct Level {
+        /* Number of voxels along each axis of the chunk */
+        size_t dim;
+        compute::kernel select_active_edges;
+        compute::kernel solve_qef;
+        /* Builds the volume of this level (unused at the full resolution) */
+        compute::kernel downsample;
+        Scan edges_scan;
+        Scan voxels_scan;
+        /* Binary vector for each edge that tells whether an edge is active */
+        compute::vector<uint32_t> edge_mask;
+        /* Binary vector for each voxel that tells whether a voxel is active */
+        compute::vector<uint32_t> voxel_mask;
+        /* Prefixsums of active edges / voxels */
+        compute::vector<uint32_t> scanned_edges;
+        compute::vector<uint32_t> scanned_voxels;
+        /* Vertices solved by the QEF, along with their materials */
+        compute::vector<float> voxel_vertices;
+        /* Indices of active edges / voxels, densely packed by compaction */
+        compute::kernel compact_edges;
+        compute::kernel compact_voxels;
+        compute::vector<uint32_t> active_edges;
+        compute::vector<uint32_t> active_voxels;
+
+        /* Finally, some geometry generator, run just over the active ones */
+        compute::kernel copy_vertices;
+        compute::kernel make_indices;
+        /* Writes 16-bit indices, for meshes with few enough vertices */
+        compute::kernel make_indices_16;
+    };
+
+    /**
+     * Everything needed to mesh a single chunk. Each chunk being meshed takes
+     * one out of the pool, so that several of them may be meshed at once.
+     */
+    struct Workspace {
+        std::array<Level, VM_LOD_LEVELS> levels;
+        /* Downsampled volume of the chunk being meshed at the coarser levels */
+        Volume lod_volume;
+        /* A queue where downsampling and contouring are done */
+        compute::command_queue queue;
+        /* A queue where active-edges and qef will be computed */
+        compute::command_queue unordered_queue;
+    };
+    std::vector<std::unique_ptr<Workspace>> m_workspaces;
+    std::mutex m_free_workspaces_mutex;
+    std::condition_variable m_free_workspaces_cv;
+    std::vector<Workspace *> m_free_workspaces;
+
+    /* A queue where finished meshes are copied into GL buffers */
+    compute::command_queue m_upload_queue;
+    GLSync m_gl_sync;
+    /* Meshes batches of chunks, a thread per workspace */
+    ThreadPool m_thread_pool;
+
+    void init_buffers(Workspace &workspace);
+    void init_kernels(Workspace &workspace);
+    /** Waits for a free workspace, and takes it out of the pool */
+    Workspace &acquire_workspace();
+    void release_workspace(Workspace &workspace);
+    void enqueue_downsample(Workspace &workspace,
+                            Level &level,
+                            const Volume &volume);
+    void enqueue_select_edges(Workspace &workspace,
+                              Level &level,
+                              const Volume &volume);
+    void enqueue_solve_qef(Workspace &workspace,
+                           Level &level,
+                           const Volume &volume,
+                           const glm::vec3 &origin);
+    void enqueue_contour(Workspace &workspace,
+                         Level &level,
+                         const Volume &volume,
+                         ChunkMesh &mesh);
+    void contour(Workspace &workspace, Chunk &chunk);
+    void upload(ChunkMesh &mesh);
 
 public:
-    Mesher(const std::shared_ptr<ComputeContext> &compute_ctx);
+    /**
+     * Prepares meshing of chunks with the specified @p params, up to
+     * @p num_workspaces of them at once. Meshes of more than
+     * @p max_16_bit_vertices (at most MAX_16_BIT_VERTICES) get 32-bit indices.
+     */
+    Mesher(const std::shared_ptr<ComputeContext> &compute_ctx,
+           const VolumeParams &params,
+           size_t num_workspaces = VM_MESHER_WORKSPACES,
+           size_t max_16_bit_vertices = MAX_16_BIT_VERTICES);
 
+    /**
+     * Extracts the surface from the @p chunk's volume at every level of
+     * detail, into staging buffers of its meshes (ChunkMesh::staged_vbo and
+     * ChunkMesh::staged_ibo). No GL calls are made, so this can be done on
+     * any thread. Meshing uses queues of its own, so the volume must be ready
+     * (i.e. the work writing it finished) beforehand, and the meshes are ready
+     * once this returns.
+     *
+     * Chunks may be meshed concurrently from many threads, each of them takes
+     * a workspace from the pool (or waits for one to become free).
+     */
     void contour(Chunk &chunk);
+
+    /** Meshes all of the @p chunks, concurrently on all the workspaces */
+    void contour(const std::vector<Chunk *> &chunks);
+
+    /**
+     * Copies the staged meshes of the @p chunk into their GL buffers. Must be
+     * called from the thread owning GL context, with the chunk locked.
+     */
+    void upload(Chunk &chunk);
+
+    /**
+     * Reads the staged @p mesh back to the host, as world space @p vertices
+     * (without their materials) and triangle @p indices into them. Needs no
+     * GL, so it works with any compute context.
+     */
+    void download(const ChunkMesh &mesh,
+                  std::vector<glm::vec3> &vertices,
+                  std::vector<uint32_t> &indices);
 };
 
 } // namespace dc
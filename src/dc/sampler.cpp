@@ -1,85 +1,315 @@
 #include <config.h>
 
+#include <algorithm>
 #include <chrono>
+#include <climits>
 #include <sstream>
+#include <stdexcept>
 
 #include "sampler.h"
 
 #include "scene/brush.h"
+#include "scene/brush-composite.h"
 #include "scene/chunk.h"
 #include "scene/scene.h"
 
 #include "compute/interop.h"
+#include "compute/program-cache.h"
 #include "compute/utils.h"
 
 #include "utils/log.h"
 
+#include <boost/compute/memory/local_buffer.hpp>
+
 using namespace std;
 using namespace glm;
 namespace vm {
 namespace dc {
 namespace {
-vector<pair<string, Brush::Id>> supported_brushes() {
-    return { { "BRUSH_BALL", Brush::Id::Ball },
-             { "BRUSH_CUBE", Brush::Id::Cube } };
+struct SupportedBrush {
+    string define;
+    Brush::Id id;
+    /* Fastest root finder of the brush */
+    Sampler::RootFinder root_finder;
+};
+
+vector<SupportedBrush> supported_brushes() {
+    using RootFinder = Sampler::RootFinder;
+    return { { "BRUSH_BALL", Brush::Id::Ball, RootFinder::Analytic },
+             { "BRUSH_CUBE", Brush::Id::Cube, RootFinder::Analytic },
+             { "BRUSH_COMPOSITE",
+               Brush::Id::Composite,
+               RootFinder::Illinois } };
+}
+
+string root_finder_define(Sampler::RootFinder root_finder) {
+    switch (root_finder) {
+    case Sampler::RootFinder::Bisection: return "ROOT_FINDER_BISECTION";
+    case Sampler::RootFinder::Illinois: return "ROOT_FINDER_ILLINOIS";
+    case Sampler::RootFinder::Analytic: return "ROOT_FINDER_ANALYTIC";
+    }
+    throw invalid_argument("Unknown root finder");
 }
-} // namespace
 
-Sampler::Sampler(const shared_ptr<ComputeContext> &compute_ctx)
-        : m_compute_ctx(compute_ctx) {
+/**
+ * Computes the box of sample coordinates of the chunk at @p chunk_origin that
+ * the @p aabb may affect.
+ *
+ * @returns false if the box is empty
+ */
+bool get_footprint(const VolumeParams &params,
+                   const AABB &aabb,
+                   const vec3 &chunk_origin,
+                   ivec3 &out_min,
+                   ivec3 &out_max) {
+    const float max_coord = float(params.chunk_size + 2);
+    const float voxel_size = float(params.voxel_size);
+    const vec3 margin(params.brush_margin());
+    const vec3 half_dim = 0.5f * vec3(max_coord + 1);
+    // One more sample on each side to stay safe from rounding errors.
+    const vec3 lo =
+            floor((aabb.min - margin - chunk_origin) / voxel_size + half_dim)
+            - 1.0f;
+    const vec3 hi =
+            ceil((aabb.max + margin - chunk_origin) / voxel_size + half_dim)
+            + 1.0f;
+    if (any(greaterThan(lo, vec3(max_coord))) || any(lessThan(hi, vec3(0)))) {
+        return false;
+    }
+    out_min = ivec3(clamp(lo, vec3(0), vec3(max_coord)));
+    out_max = ivec3(clamp(hi, vec3(0), vec3(max_coord)));
+    return true;
+}
 
+/**
+ * @returns size of the blocks of samples the @p kernel is run in, as big as
+ * the @p device allows it to be (up to 8x4x4).
+ */
+compute::extents<3> get_block_size(const compute::kernel &kernel,
+                                   const compute::device &device) {
+    const size_t max_size = kernel.get_work_group_info<size_t>(
+            device, CL_KERNEL_WORK_GROUP_SIZE);
+    compute::extents<3> size = compute::dim(8, 4, 4);
+    while (size[0] * size[1] * size[2] > max_size) {
+        size_t &largest = *max_element(size.begin(), size.end());
+        if (largest == 1) {
+            break;
+        }
+        largest /= 2;
+    }
+    return size;
+}
+} // namespace
+
+Sampler::Sampler(const shared_ptr<ComputeContext> &compute_ctx,
+                 const VolumeParams &params,
+                 const boost::optional<RootFinder> &root_finder)
+        : m_compute_ctx(compute_ctx)
+        , m_params(params)
+        , m_sdf_samplers()
+        , m_brush_nodes(BrushComposite::MAX_NODES * BrushComposite::NODE_SIZE,
+                        compute_ctx->context)
+        , m_scratch_samples()
+        , m_classifier()
+        , m_sample_range(4, compute_ctx->context) {
+    m_params.validate();
+    if (m_params.distance_samples) {
+        const size_t n = m_params.chunk_size + 3;
+        m_scratch_samples = compute::image3d(
+                compute_ctx->context, n, n, n, Scene::samples_format());
+    }
     for (const auto &supported_brush : supported_brushes()) {
-        auto program = compute::program::create_with_source_file(
-                "media/kernels/samplers.cl", compute_ctx->context);
-        program.build("-D" + supported_brush.first);
-
-        m_sdf_samplers.at(static_cast<size_t>(supported_brush.second)).sampler =
-                program.create_kernel("sample");
-        m_sdf_samplers.at(static_cast<size_t>(supported_brush.second)).updater =
-                program.create_kernel("update_edges");
+        // Only the primitives have closed forms.
+        RootFinder brush_root_finder = supported_brush.root_finder;
+        if (root_finder
+            && (*root_finder != RootFinder::Analytic
+                || brush_root_finder == RootFinder::Analytic)) {
+            brush_root_finder = *root_finder;
+        }
+        const string options = "-D" + supported_brush.define + " -D"
+                               + root_finder_define(brush_root_finder) + " "
+                               + m_params.build_options();
+        auto program = build_program_from_file(*compute_ctx,
+                                               "media/kernels/samplers.cl",
+                                               options);
+
+        SDFSampler &sdf_sampler =
+                m_sdf_samplers.at(static_cast<size_t>(supported_brush.id));
+        sdf_sampler.kernel = program.create_kernel("sample_and_update_edges");
+        sdf_sampler.block_size = get_block_size(
+                sdf_sampler.kernel, compute_ctx->context.get_device());
+        m_classifier = program.create_kernel("classify_samples");
+    }
+}
+
+cl_int Sampler::upload_brush_nodes(const Brush &brush) {
+    if (brush.id() != Brush::Id::Composite) {
+        return 0;
+    }
+    const auto &composite = static_cast<const BrushComposite &>(brush);
+    if (!composite.is_complete()) {
+        throw logic_error("Composite brush program is incomplete");
+    }
+    const vector<float> &program = composite.get_program();
+    m_compute_ctx->queue.enqueue_write_buffer(m_brush_nodes.get_buffer(),
+                                              0,
+                                              sizeof(float) * program.size(),
+                                              program.data());
+    return static_cast<cl_int>(composite.num_nodes());
+}
+
+void Sampler::enqueue_sample(Chunk &chunk,
+                             const Brush &brush,
+                             Operation operation,
+                             cl_int num_brush_nodes) {
+    SDFSampler &sdf_sampler =
+            m_sdf_samplers.at(static_cast<size_t>(brush.id()));
+    const vec3 chunk_origin = m_params.chunk_origin(chunk.coord);
+
+    // Samples outside of the brush's box can't change (apart from an unset
+    // sample becoming 1, which is equivalent), so don't launch over them.
+    ivec3 box_min;
+    ivec3 box_max;
+    if (!get_footprint(
+                m_params, brush.get_aabb(), chunk_origin, box_min, box_max)) {
+        return;
+    }
+    // Edges ending at the first sample of the box are updated as well.
+    chunk.mark_dirty(box_min - 1, box_max);
+    const ivec3 launch_min = glm::max(box_min - 1, ivec3(0));
+    const ivec3 launch_size = box_max - launch_min + 1;
+
+    compute::kernel &kernel = sdf_sampler.kernel;
+    const compute::extents<3> &block_size = sdf_sampler.block_size;
+    // Sign samples are just clamped in place, distances need the neighbours.
+    kernel.set_arg(0, chunk.samples);
+    kernel.set_arg(1,
+                   m_params.distance_samples ? m_scratch_samples
+                                             : chunk.samples);
+    kernel.set_arg(2, chunk.edges_x);
+    kernel.set_arg(3, chunk.edges_y);
+    kernel.set_arg(4, chunk.edges_z);
+    kernel.set_arg(5, chunk.materials);
+    kernel.set_arg(6, static_cast<cl_int>(operation));
+    // Materials are stored in 8 bits.
+    kernel.set_arg(7, static_cast<cl_uint>(clamp(brush.material(), 0, 255)));
+    kernel.set_arg(8, box_min);
+    kernel.set_arg(9, box_max);
+    kernel.set_arg(10, chunk_origin);
+    kernel.set_arg(11, brush.get_origin());
+    kernel.set_arg(12, 0.5f * brush.get_scale());
+    kernel.set_arg(13, brush.get_rotation());
+    kernel.set_arg(14, m_brush_nodes);
+    kernel.set_arg(15, num_brush_nodes);
+    // Brush distances of the block, and one more layer on its far sides.
+    kernel.set_arg(16,
+                   compute::local_buffer<float>((block_size[0] + 1)
+                                                * (block_size[1] + 1)
+                                                * (block_size[2] + 1)));
+
+    enqueue_nd_range_kernel_in_groups<3>(
+            m_compute_ctx->queue,
+            kernel,
+            compute::dim(launch_min.x, launch_min.y, launch_min.z),
+            compute::dim(launch_size.x, launch_size.y, launch_size.z),
+            block_size);
+    if (m_params.distance_samples) {
+        const ivec3 box_size = box_max - box_min + 1;
+        const compute::extents<3> origin =
+                compute::dim(box_min.x, box_min.y, box_min.z);
+        m_compute_ctx->queue.enqueue_copy_image<3>(
+                m_scratch_samples,
+                chunk.samples,
+                origin,
+                origin,
+                compute::dim(box_size.x, box_size.y, box_size.z));
     }
 }
 
 void Sampler::sample(Chunk &chunk, const Brush &brush, Operation operation) {
-    compute::kernel &sampler =
-            m_sdf_samplers.at(static_cast<size_t>(brush.id())).sampler;
-    const vec3 chunk_origin = Scene::get_chunk_origin(chunk.coord);
-    const vec3 brush_scale = 0.5f * brush.get_scale();
-    const vec3 brush_origin = brush.get_origin();
-    const mat3 brush_rotation = brush.get_rotation();
-
-    sampler.set_arg(0, chunk.samples);
-    sampler.set_arg(1, chunk.samples);
-    sampler.set_arg(2, static_cast<cl_int>(operation));
-    sampler.set_arg(3, chunk_origin);
-    sampler.set_arg(4, brush_origin);
-    sampler.set_arg(5, brush_scale);
-    sampler.set_arg(6, brush_rotation);
-
-    compute::kernel &updater =
-            m_sdf_samplers.at(static_cast<size_t>(brush.id())).updater;
-
-    const size_t N = VM_CHUNK_SIZE;
-    enqueue_auto_distributed_nd_range_kernel<3>(
-            m_compute_ctx->queue, sampler, compute::dim(N + 3, N + 3, N + 3));
-
-    updater.set_arg(2, chunk_origin);
-    updater.set_arg(3, brush_origin);
-    updater.set_arg(4, brush_scale);
-    updater.set_arg(5, brush_rotation);
-
-    // TODO: Either this should be run in a single kernel or at unordered queue
-    for (int axis = 0; axis < 3; ++axis) {
-        updater.set_arg(0, (&chunk.edges_x)[axis]);
-        updater.set_arg(1, static_cast<cl_int>(axis));
-        enqueue_auto_distributed_nd_range_kernel<3>(
-                m_compute_ctx->queue,
-                updater,
-                compute::dim(N + 3, N + 3, N + 3));
+    sample(vector<Chunk *>{ &chunk }, brush, operation);
+}
+
+void Sampler::sample(const vector<Chunk *> &chunks,
+                     const Brush &brush,
+                     Operation operation) {
+    // Kernel arguments are captured at the enqueue time, so all the launches
+    // can be issued back to back and waited for just once. Even a composite
+    // brush is sampled in a single pass, its program is uploaded just once.
+    const cl_int num_brush_nodes = upload_brush_nodes(brush);
+    for (Chunk *chunk : chunks) {
+        enqueue_sample(*chunk, brush, operation, num_brush_nodes);
     }
     m_compute_ctx->queue.flush();
     m_compute_ctx->queue.finish();
 }
 
+boost::optional<Sampler::Uniform> Sampler::uniform_value(Chunk &chunk) {
+    return uniform_values(vector<Chunk *>{ &chunk }).front();
+}
+
+vector<boost::optional<Sampler::Uniform>>
+Sampler::uniform_values(const vector<Chunk *> &chunks) {
+    // Range of the samples and of their materials, for each chunk.
+    if (m_sample_range.size() < 4 * chunks.size()) {
+        m_sample_range = compute::vector<cl_int>(4 * chunks.size(),
+                                                 m_compute_ctx->context);
+    }
+    vector<cl_int> ranges(4 * chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ranges[4 * i + 0] = INT_MAX;
+        ranges[4 * i + 1] = INT_MIN;
+        ranges[4 * i + 2] = INT_MAX;
+        ranges[4 * i + 3] = INT_MIN;
+    }
+    compute::copy(ranges.begin(),
+                  ranges.end(),
+                  m_sample_range.begin(),
+                  m_compute_ctx->queue);
+
+    const size_t N = m_params.chunk_size;
+    m_classifier.set_arg(2, m_sample_range);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        m_classifier.set_arg(0, chunks[i]->samples);
+        m_classifier.set_arg(1, chunks[i]->materials);
+        m_classifier.set_arg(3, static_cast<cl_uint>(i));
+        enqueue_auto_distributed_nd_range_kernel<2>(
+                m_compute_ctx->queue, m_classifier, compute::dim(N + 3, N + 3));
+    }
+    compute::copy(m_sample_range.begin(),
+                  m_sample_range.begin() + ranges.size(),
+                  ranges.begin(),
+                  m_compute_ctx->queue);
+
+    vector<boost::optional<Uniform>> values(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const cl_int lo = ranges[4 * i + 0];
+        const cl_int hi = ranges[4 * i + 1];
+        const cl_int material_lo = ranges[4 * i + 2];
+        const cl_int material_hi = ranges[4 * i + 3];
+        bool outside;
+        bool inside;
+        if (m_params.distance_samples) {
+            // Distances matter to the next edits, unless they are all the
+            // farthest ones.
+            outside = lo == m_params.outside_sample();
+            inside = hi == m_params.inside_sample();
+        } else {
+            // All positive samples (1 - outside, 2 - unset) are equivalent,
+            // as are all negative ones. Zeros lie on the surface though.
+            outside = lo > 0;
+            inside = hi < 0;
+        }
+        // Materials of the samples outside never show, unlike those inside.
+        if (outside) {
+            values[i] = Uniform{ m_params.outside_sample(), 0 };
+        } else if (inside && material_lo == material_hi) {
+            values[i] = Uniform{ m_params.inside_sample(),
+                                 static_cast<uint8_t>(material_lo) };
+        }
+    }
+    return values;
+}
+
 } // namespace dc
 } // namespace vm
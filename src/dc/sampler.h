@@ -2,7 +2,12 @@
 #define VM_DC_SAMPLER_H
 #include "compute/context.h"
 
+#include "scene/volume-params.h"
+
 #include <array>
+#include <vector>
+
+#include <boost/optional.hpp>
 
 namespace vm {
 class Chunk;
@@ -12,23 +17,62 @@ namespace dc {
 
 class Sampler {
     std::shared_ptr<ComputeContext> m_compute_ctx;
+    VolumeParams m_params;
     struct SDFSampler {
-        /* Volume sampler */
-        compute::kernel sampler;
-        /* Edge updater */
-        compute::kernel updater;
+        /* Samples the brush and updates the edges, all in a single launch */
+        compute::kernel kernel;
+        /* Blocks of samples each work-group evaluates the brush over */
+        compute::extents<3> block_size;
     };
-    std::array<SDFSampler, 2> m_sdf_samplers;
+    std::array<SDFSampler, 3> m_sdf_samplers;
+    /* Program of the composite brush being sampled */
+    compute::vector<float> m_brush_nodes;
+    /* Distance samples are written here first, then copied to the chunk */
+    compute::image3d m_scratch_samples;
+    /* Computes range of the samples in a chunk */
+    compute::kernel m_classifier;
+    compute::vector<cl_int> m_sample_range;
 
 public:
     enum class Operation { Add = 0, Sub = 1 };
 
+    /** Value of all samples of a uniform chunk */
+    struct Uniform {
+        int16_t sample;
+        uint8_t material;
+    };
+
+    /** Ways of finding where edges cross the brush surface */
+    enum class RootFinder {
+        /* Halving the edge a fixed number of times, works for any brush */
+        Bisection,
+        /* Regula falsi, converging in fewer steps for any brush */
+        Illinois,
+        /* Closed form crossings and normals, for primitive brushes only */
+        Analytic
+    };
+
+private:
+    void enqueue_sample(Chunk &chunk,
+                        const Brush &brush,
+                        Operation operation,
+                        cl_int num_brush_nodes);
+    /** @returns number of nodes of the @p brush program, uploaded if any */
+    cl_int upload_brush_nodes(const Brush &brush);
+
+public:
     /**
      * Initializes brush sampler.
      *
      * @param compute_ctx   Compute context to perform sampling operations on.
+     * @param params        Parameters of the volumes to sample.
+     * @param root_finder   Root finder to use instead of the fastest one of
+     *                      each brush, e.g. to compare them. Brushes without
+     *                      analytic one keep theirs.
      */
-    Sampler(const std::shared_ptr<ComputeContext> &compute_ctx);
+    Sampler(const std::shared_ptr<ComputeContext> &compute_ctx,
+            const VolumeParams &params,
+            const boost::optional<RootFinder> &root_finder = boost::none);
 
     /**
      * Samples the @p brush over specified @p chunk, and performs any operations
@@ -39,6 +83,27 @@ public:
      * @param operation Type of the operation to perform.
      */
     void sample(Chunk &chunk, const Brush &brush, Operation operation);
+
+    /**
+     * Samples the @p brush over all of the @p chunks at once, with a single
+     * synchronization point at the end.
+     */
+    void sample(const std::vector<Chunk *> &chunks,
+                const Brush &brush,
+                Operation operation);
+
+    /**
+     * Checks whether all samples of the @p chunk are equivalent, i.e. it is
+     * entirely outside or entirely inside the volume (of a single material).
+     * NOTE: this blocks until the result is read back.
+     *
+     * @returns sample value representing the whole chunk, if there is one.
+     */
+    boost::optional<Uniform> uniform_value(Chunk &chunk);
+
+    /** Same as @ref uniform_value, but for many chunks with one read back */
+    std::vector<boost::optional<Uniform>>
+    uniform_values(const std::vector<Chunk *> &chunks);
 };
 
 } // namespace dc
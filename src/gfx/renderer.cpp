@@ -30,9 +30,14 @@ void Renderer::init_buffer() {
     m_shape_vbo = make_unique<Buffer>(
             BufferDesc{ GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW, nullptr, 4096 });
 
+    // Chunk mesh vertices: position and material (see ChunkMesh).
     glEnableVertexArrayAttrib(m_geometry_vao, 0);
     glVertexArrayAttribFormat(m_geometry_vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
     glVertexArrayAttribBinding(m_geometry_vao, 0, 0);
+    glEnableVertexArrayAttrib(m_geometry_vao, 1);
+    glVertexArrayAttribFormat(
+            m_geometry_vao, 1, 1, GL_FLOAT, GL_FALSE, sizeof(vec3));
+    glVertexArrayAttribBinding(m_geometry_vao, 1, 0);
 
     glEnableVertexArrayAttrib(m_shape_vao, 0);
     glVertexArrayAttribFormat(m_shape_vao, 0, 3, GL_FLOAT, GL_FALSE, 0u);
@@ -41,6 +46,9 @@ void Renderer::init_buffer() {
 
 void Renderer::init_shaders() {
     m_passthrough = Program{};
+    if (m_material_array) {
+        m_passthrough.define("WITH_MATERIALS");
+    }
     m_passthrough.set_shader_from_file(GL_VERTEX_SHADER,
                                        "media/shaders/passthrough-vs.glsl");
     m_passthrough.set_shader_from_file(GL_FRAGMENT_SHADER,
@@ -98,8 +106,8 @@ Renderer::Renderer(shared_ptr<ComputeContext> ctx,
         , m_width(0)
         , m_height(0) {
     init_buffer();
-    init_shaders();
     init_materials(materials);
+    init_shaders();
 
     glEnable(GL_SCISSOR_TEST);
     glEnable(GL_CULL_FACE);
@@ -123,14 +131,18 @@ void Renderer::render(const Scene &scene) {
     m_passthrough.set_constant("g_mvp",
                                camera->get_proj() * camera->get_view());
 
+    if (m_material_array) {
+        glBindTextureUnit(0, m_material_array->id());
+    }
     glBindVertexArray(m_geometry_vao);
     for (const auto &chunk : scene.get_chunks_to_render()) {
-        if (!chunk->num_vertices) {
+        const ChunkMesh &mesh = chunk->meshes[chunk->lod];
+        if (!mesh.num_vertices) {
             continue;
         }
-        glBindVertexBuffer(0, chunk->vbo.id(), 0, sizeof(vec3));
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk->ibo.id());
-        glDrawElements(GL_TRIANGLES, chunk->num_indices, GL_UNSIGNED_INT, 0u);
+        glBindVertexBuffer(0, mesh.vbo.id(), 0, ChunkMesh::VERTEX_BYTES);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo.id());
+        glDrawElements(GL_TRIANGLES, mesh.num_indices, mesh.index_type, 0u);
     }
 }
 
@@ -0,0 +1,33 @@
+#include "frustum.h"
+
+namespace vm {
+using namespace glm;
+
+Frustum::Frustum(const mat4 &view_proj) : planes() {
+    // Gribb & Hartmann: planes are the sums / differences of the matrix rows.
+    const mat4 m = transpose(view_proj);
+    planes[0] = m[3] + m[0];
+    planes[1] = m[3] - m[0];
+    planes[2] = m[3] + m[1];
+    planes[3] = m[3] - m[1];
+    planes[4] = m[3] + m[2];
+    planes[5] = m[3] - m[2];
+    for (vec4 &plane : planes) {
+        plane /= length(vec3(plane));
+    }
+}
+
+bool Frustum::intersects(const AABB &aabb) const {
+    for (const vec4 &plane : planes) {
+        // Corner of the box that is the furthest along the plane normal.
+        const vec3 corner = mix(aabb.min,
+                                aabb.max,
+                                greaterThanEqual(vec3(plane), vec3(0.0f)));
+        if (dot(vec3(plane), corner) + plane.w < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace vm
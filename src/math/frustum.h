@@ -0,0 +1,36 @@
+#ifndef VM_MATH_FRUSTUM_H
+#define VM_MATH_FRUSTUM_H
+
+#include <array>
+
+#include <glm/glm.hpp>
+
+#include "math/aabb.h"
+
+namespace vm {
+
+struct Frustum {
+    /**
+     * Planes bounding the frustum (left, right, bottom, top, near, far), with
+     * normals pointing inwards, i.e. dot(plane.xyz, p) + plane.w >= 0 for
+     * every point p inside.
+     */
+    std::array<glm::vec4, 6> planes;
+
+    /**
+     * Extracts frustum planes from the @p view_proj matrix (i.e. projection
+     * matrix multiplied by the view matrix).
+     */
+    explicit Frustum(const glm::mat4 &view_proj);
+
+    /**
+     * @returns false if the @p aabb lies entirely outside of the frustum, true
+     * otherwise. Boxes close to frustum corners may be reported as
+     * intersecting even if they are not.
+     */
+    bool intersects(const AABB &aabb) const;
+};
+
+} // namespace vm
+
+#endif /* VM_MATH_FRUSTUM_H */
@@ -7,8 +7,17 @@ namespace vm {
 class BrushBall : public Brush {
 public:
     virtual AABB get_aabb() const {
-        return AABB(get_origin() - 0.5f * get_scale(),
-                    get_origin() + 0.5f * get_scale());
+        // Box of the rotated box enclosing the ellipsoid, so not the tightest.
+        // The rotation maps world to brush space, hence the inverse.
+        const glm::vec3 min = -0.5f * get_scale();
+        const glm::vec3 max = +0.5f * get_scale();
+        const AABB aabb = AABB(min, max).transform(
+                glm::transpose(get_rotation()));
+        return AABB(aabb.min + get_origin(), aabb.max + get_origin());
+    }
+
+    virtual std::unique_ptr<Brush> clone() const {
+        return std::make_unique<BrushBall>(*this);
     }
 
     virtual int id() const {
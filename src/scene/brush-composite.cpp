@@ -0,0 +1,119 @@
+#include "brush-composite.h"
+
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace glm;
+namespace vm {
+
+BrushComposite::BrushComposite() : Brush(), m_program(), m_bounds() {}
+
+void BrushComposite::append(const float *node) {
+    if (num_nodes() == MAX_NODES) {
+        throw length_error("Composite brush may have at most "
+                           + to_string(MAX_NODES) + " nodes");
+    }
+    const Node type = static_cast<Node>(int(node[0]));
+    switch (type) {
+    case Node::Ball:
+    case Node::Cube: {
+        if (m_bounds.size() == MAX_DEPTH) {
+            throw length_error("Composite brush stack may have at most "
+                               + to_string(MAX_DEPTH) + " shapes");
+        }
+        const vec3 origin(node[1], node[2], node[3]);
+        const vec3 half_scale(node[4], node[5], node[6]);
+        const mat3 rotation(node[7],
+                            node[10],
+                            node[13],
+                            node[8],
+                            node[11],
+                            node[14],
+                            node[9],
+                            node[12],
+                            node[15]);
+        const AABB aabb = AABB(-half_scale, half_scale)
+                                  .transform(transpose(rotation));
+        m_bounds.emplace_back(aabb.min + origin, aabb.max + origin);
+        break;
+    }
+    case Node::Union:
+    case Node::Intersection:
+    case Node::Difference: {
+        if (m_bounds.size() < 2) {
+            throw logic_error("Composite brush operation needs 2 shapes");
+        }
+        const AABB rhs = m_bounds.back();
+        m_bounds.pop_back();
+        AABB &lhs = m_bounds.back();
+        if (type == Node::Union) {
+            lhs.cover(rhs.min);
+            lhs.cover(rhs.max);
+        } else if (type == Node::Intersection) {
+            lhs.min = glm::max(lhs.min, rhs.min);
+            // Disjoint shapes leave an empty box, keep it valid though.
+            lhs.max = glm::max(lhs.min, glm::min(lhs.max, rhs.max));
+        }
+        // Difference can't get any bigger than the shape subtracted from.
+        break;
+    }
+    default:
+        throw invalid_argument("Unknown composite brush node "
+                               + to_string(node[0]));
+    }
+    m_program.insert(m_program.end(), node, node + NODE_SIZE);
+}
+
+void BrushComposite::push(Node primitive,
+                          const vec3 &origin,
+                          const vec3 &scale,
+                          const mat3 &rotation) {
+    if (primitive != Node::Ball && primitive != Node::Cube) {
+        throw invalid_argument("Not a composite brush primitive");
+    }
+    const vec3 half_scale = 0.5f * scale;
+    // Rotation is stored by rows, as the kernels multiply by it.
+    const float node[NODE_SIZE] = {
+        float(primitive), origin.x,       origin.y,       origin.z,
+        half_scale.x,     half_scale.y,   half_scale.z,   rotation[0][0],
+        rotation[1][0],   rotation[2][0], rotation[0][1], rotation[1][1],
+        rotation[2][1],   rotation[0][2], rotation[1][2], rotation[2][2]
+    };
+    append(node);
+}
+
+void BrushComposite::combine(Node operation) {
+    if (operation != Node::Union && operation != Node::Intersection
+        && operation != Node::Difference) {
+        throw invalid_argument("Not a composite brush operation");
+    }
+    float node[NODE_SIZE] = {};
+    node[0] = float(operation);
+    append(node);
+}
+
+void BrushComposite::set_program(const vector<float> &program) {
+    if (program.size() % NODE_SIZE) {
+        throw invalid_argument("Composite brush program of invalid size");
+    }
+    BrushComposite parsed;
+    for (size_t i = 0; i < program.size(); i += NODE_SIZE) {
+        parsed.append(&program[i]);
+    }
+    m_program = move(parsed.m_program);
+    m_bounds = move(parsed.m_bounds);
+}
+
+AABB BrushComposite::get_aabb() const {
+    if (!is_complete()) {
+        throw logic_error("Composite brush program is incomplete");
+    }
+    const AABB local(m_bounds.back().min * get_scale(),
+                     m_bounds.back().max * get_scale());
+    // The rotation maps world to brush space, hence the inverse.
+    const AABB aabb = local.transform(transpose(get_rotation()));
+    return AABB(aabb.min + get_origin(), aabb.max + get_origin());
+}
+
+} // namespace vm
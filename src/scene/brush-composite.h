@@ -0,0 +1,94 @@
+#ifndef VM_SCENE_BRUSH_COMPOSITE_H
+#define VM_SCENE_BRUSH_COMPOSITE_H
+#include "scene/brush.h"
+
+#include <vector>
+
+namespace vm {
+
+/**
+ * A brush made of primitives combined with CSG operations, sampled all at
+ * once in a single pass over the volume.
+ *
+ * The shape is a postfix program: primitives push their distance onto a
+ * stack, and operations replace the two topmost distances with their
+ * combination. Primitives are placed in the brush space, which is then
+ * transformed by the origin, rotation and scale of the brush itself, so that
+ * a primitive of scale 1 at the origin fills the whole brush.
+ */
+class BrushComposite : public Brush {
+public:
+    enum class Node {
+        Ball = 0,
+        Cube = 1,
+        Union = 2,
+        Intersection = 3,
+        Difference = 4
+    };
+
+    /**
+     * Number of floats each node takes in the program: type, origin, half of
+     * the scale and rows of the rotation. Operations use just the type.
+     */
+    static const constexpr size_t NODE_SIZE = 16;
+    static const constexpr size_t MAX_NODES = 64;
+    /* Maximal number of distances on the stack at once */
+    static const constexpr size_t MAX_DEPTH = 8;
+
+    BrushComposite();
+
+    /**
+     * Pushes the @p primitive (Node::Ball or Node::Cube) placed in the brush
+     * space at @p origin, with @p scale and @p rotation (mapping the brush
+     * space to the primitive's).
+     */
+    void push(Node primitive,
+              const glm::vec3 &origin,
+              const glm::vec3 &scale = glm::vec3(1.0f),
+              const glm::mat3 &rotation = glm::mat3(1.0f));
+
+    /**
+     * Combines the two topmost shapes with the @p operation (Node::Union,
+     * Node::Intersection or Node::Difference, which subtracts the topmost one
+     * from the one below it).
+     */
+    void combine(Node operation);
+
+    /** @returns true if the program evaluates to a single shape */
+    inline bool is_complete() const {
+        return m_bounds.size() == 1;
+    }
+
+    /** @returns program of NODE_SIZE floats per node */
+    inline const std::vector<float> &get_program() const {
+        return m_program;
+    }
+
+    inline size_t num_nodes() const {
+        return m_program.size() / NODE_SIZE;
+    }
+
+    /** Replaces the program with @p program, e.g. to restore the brush */
+    void set_program(const std::vector<float> &program);
+
+    virtual AABB get_aabb() const;
+
+    virtual std::unique_ptr<Brush> clone() const {
+        return std::make_unique<BrushComposite>(*this);
+    }
+
+    virtual int id() const {
+        return Brush::Id::Composite;
+    }
+
+private:
+    std::vector<float> m_program;
+    /* Brush space bounds of each shape on the stack */
+    std::vector<AABB> m_bounds;
+
+    void append(const float *node);
+};
+
+} // namespace vm
+
+#endif /* VM_SCENE_BRUSH_COMPOSITE_H */
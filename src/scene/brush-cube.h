@@ -10,10 +10,16 @@ public:
         using namespace glm;
         const vec3 min = -0.5f * get_scale();
         const vec3 max = +0.5f * get_scale();
-        const AABB aabb = AABB(min, max).transform(get_rotation());
+        // The rotation maps world to brush space, hence the inverse.
+        const AABB aabb = AABB(min, max).transform(
+                glm::transpose(get_rotation()));
         return AABB(aabb.min + get_origin(), aabb.max + get_origin());
     }
 
+    virtual std::unique_ptr<Brush> clone() const {
+        return std::make_unique<BrushCube>(*this);
+    }
+
     virtual int id() const {
         return Brush::Id::Cube;
     }
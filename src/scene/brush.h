@@ -4,6 +4,8 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <memory>
+
 #include "math/aabb.h"
 
 namespace vm {
@@ -14,7 +16,7 @@ namespace vm {
  */
 class Brush {
 public:
-    enum Id { Cube, Ball };
+    enum Id { Cube, Ball, Composite };
 
     Brush() : m_origin(), m_rotation(1.0f), m_scale(1, 1, 1), m_material(0) {}
 
@@ -26,6 +28,9 @@ public:
      */
     virtual AABB get_aabb() const = 0;
 
+    /** @returns a copy of the brush, e.g. to apply it asynchronously */
+    virtual std::unique_ptr<Brush> clone() const = 0;
+
     /** @returns the origin of the brush */
     inline const glm::vec3 &get_origin() const {
         return m_origin;
@@ -54,6 +59,11 @@ public:
         m_rotation = mat3_cast(rotx * roty * rotz);
     }
 
+    /** @brief sets the rotation matrix directly, e.g. when restoring a brush */
+    inline void set_rotation_matrix(const glm::mat3 &rotation) {
+        m_rotation = rotation;
+    }
+
     /** @brief sets the scale in each dimension (xyz). By default the scale is 1
      */
     inline void set_scale(const glm::vec3 &scale) {
@@ -0,0 +1,252 @@
+#ifndef VM_SCENE_CHUNK_INDEX_H
+#define VM_SCENE_CHUNK_INDEX_H
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+namespace vm {
+
+/**
+ * Spatial index of chunks keyed by their integer coordinates.
+ *
+ * Each coordinate is packed into a 64-bit Morton key (21 bits per axis, so
+ * coordinates within [-2^20, 2^20) are supported without any aliasing), and
+ * entries are kept in an open-addressing table with linear probing. Since the
+ * Morton order preserves locality, chunks that are close in space tend to land
+ * close in the table too, and a lookup is a single probe sequence over a flat
+ * array.
+ */
+template <typename T>
+class ChunkIndex {
+    static const constexpr uint64_t EMPTY_KEY = ~uint64_t(0);
+    static const constexpr int COORD_BITS = 21;
+    static const constexpr int COORD_BIAS = 1 << (COORD_BITS - 1);
+    static const constexpr size_t MIN_CAPACITY = 64;
+
+    struct Slot {
+        uint64_t key;
+        glm::ivec3 coord;
+        T value;
+
+        Slot() : key(EMPTY_KEY), coord(), value() {}
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_size;
+
+    static uint64_t spread_bits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x001f00000000ffffull;
+        v = (v | v << 16) & 0x001f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    size_t mask() const {
+        return m_slots.size() - 1;
+    }
+
+    size_t home_slot(uint64_t key) const {
+        // Fibonacci hashing - Morton keys of neighbouring chunks differ only in
+        // the lowest bits, so spread them over the whole table.
+        return static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> 32)
+               & mask();
+    }
+
+    /** @returns slot holding @p key, or the empty slot it would go into */
+    size_t probe(uint64_t key) const {
+        size_t index = home_slot(key);
+        while (m_slots[index].key != EMPTY_KEY && m_slots[index].key != key) {
+            index = (index + 1) & mask();
+        }
+        return index;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> slots(capacity);
+        std::swap(slots, m_slots);
+        for (Slot &slot : slots) {
+            if (slot.key != EMPTY_KEY) {
+                m_slots[probe(slot.key)] = std::move(slot);
+            }
+        }
+    }
+
+public:
+    ChunkIndex() : m_slots(MIN_CAPACITY), m_size(0) {}
+
+    /** @returns true if @p coord can be represented by the index */
+    static bool in_range(const glm::ivec3 &coord) {
+        return glm::all(glm::greaterThanEqual(coord, glm::ivec3(-COORD_BIAS)))
+               && glm::all(glm::lessThan(coord, glm::ivec3(COORD_BIAS)));
+    }
+
+    /**
+     * @returns Morton key of the chunk at @p coord
+     * @throws std::out_of_range if the index can't represent @p coord, as its
+     * key would alias another chunk's
+     */
+    static uint64_t key(const glm::ivec3 &coord) {
+        if (!in_range(coord)) {
+            throw std::out_of_range("Chunk coordinates ("
+                                    + std::to_string(coord.x) + ", "
+                                    + std::to_string(coord.y) + ", "
+                                    + std::to_string(coord.z)
+                                    + ") are out of the index range");
+        }
+        return spread_bits(uint64_t(coord.x + COORD_BIAS))
+               | spread_bits(uint64_t(coord.y + COORD_BIAS)) << 1
+               | spread_bits(uint64_t(coord.z + COORD_BIAS)) << 2;
+    }
+
+    inline size_t size() const {
+        return m_size;
+    }
+
+    inline bool empty() const {
+        return m_size == 0;
+    }
+
+    void clear() {
+        m_slots.assign(MIN_CAPACITY, Slot());
+        m_size = 0;
+    }
+
+    /** @returns pointer to the value stored at @p coord or nullptr */
+    T *find(const glm::ivec3 &coord) {
+        if (!in_range(coord)) {
+            return nullptr;
+        }
+        Slot &slot = m_slots[probe(key(coord))];
+        return slot.key == EMPTY_KEY ? nullptr : &slot.value;
+    }
+
+    const T *find(const glm::ivec3 &coord) const {
+        if (!in_range(coord)) {
+            return nullptr;
+        }
+        const Slot &slot = m_slots[probe(key(coord))];
+        return slot.key == EMPTY_KEY ? nullptr : &slot.value;
+    }
+
+    /**
+     * Gets the value stored at @p coord, or stores the result of @p factory()
+     * there if there is none. NOTE: the returned reference is invalidated by
+     * any subsequent insertion or removal.
+     *
+     * @throws std::out_of_range if @p coord is out of the index range
+     */
+    template <typename Factory>
+    T &get_or_create(const glm::ivec3 &coord, Factory &&factory) {
+        const uint64_t k = key(coord);
+        size_t index = probe(k);
+        if (m_slots[index].key == k) {
+            return m_slots[index].value;
+        }
+        // Keep the load factor under 1/2, so that probe sequences stay short.
+        if (2 * (m_size + 1) > m_slots.size()) {
+            rehash(2 * m_slots.size());
+            index = probe(k);
+        }
+        m_slots[index].value = factory();
+        m_slots[index].coord = coord;
+        m_slots[index].key = k;
+        ++m_size;
+        return m_slots[index].value;
+    }
+
+    /** Removes the value stored at @p coord. @returns true if there was one */
+    bool erase(const glm::ivec3 &coord) {
+        if (!in_range(coord)) {
+            return false;
+        }
+        size_t hole = probe(key(coord));
+        if (m_slots[hole].key == EMPTY_KEY) {
+            return false;
+        }
+        // Backward-shift deletion: move every following entry of the cluster
+        // that would not be reachable anymore into the hole.
+        size_t index = hole;
+        while (true) {
+            index = (index + 1) & mask();
+            if (m_slots[index].key == EMPTY_KEY) {
+                break;
+            }
+            const size_t home = home_slot(m_slots[index].key);
+            if (((index - home) & mask()) >= ((index - hole) & mask())) {
+                m_slots[hole] = std::move(m_slots[index]);
+                hole = index;
+            }
+        }
+        m_slots[hole] = Slot();
+        --m_size;
+        return true;
+    }
+
+    /** Calls @p visitor(coord, value) for every stored value */
+    template <typename Visitor>
+    void for_each(Visitor &&visitor) const {
+        for (const Slot &slot : m_slots) {
+            if (slot.key != EMPTY_KEY) {
+                visitor(slot.coord, slot.value);
+            }
+        }
+    }
+
+    /**
+     * Calls @p visitor(coord, value) for every stored value whose coordinate
+     * lies within the inclusive box [@p min, @p max].
+     */
+    template <typename Visitor>
+    void for_each_in_region(const glm::ivec3 &min,
+                            const glm::ivec3 &max,
+                            Visitor &&visitor) const {
+        if (glm::any(glm::lessThan(max, min))) {
+            return;
+        }
+        const int64_t volume = (int64_t(max.x) - min.x + 1)
+                               * (int64_t(max.y) - min.y + 1)
+                               * (int64_t(max.z) - min.z + 1);
+        if (volume > int64_t(m_size)) {
+            // Region is sparse in comparison to the index, walk the table.
+            for_each([&](const glm::ivec3 &coord, const T &value) {
+                if (glm::all(glm::greaterThanEqual(coord, min))
+                    && glm::all(glm::lessThanEqual(coord, max))) {
+                    visitor(coord, value);
+                }
+            });
+            return;
+        }
+        for (int z = min.z; z <= max.z; ++z) {
+            for (int y = min.y; y <= max.y; ++y) {
+                for (int x = min.x; x <= max.x; ++x) {
+                    const glm::ivec3 coord{ x, y, z };
+                    if (const T *value = find(coord)) {
+                        visitor(coord, *value);
+                    }
+                }
+            }
+        }
+    }
+
+    /** Calls @p visitor(coord, value) for each of 26 neighbours of @p coord */
+    template <typename Visitor>
+    void for_each_neighbour(const glm::ivec3 &coord, Visitor &&visitor) const {
+        for_each_in_region(coord - 1, coord + 1, [&](const glm::ivec3 &other,
+                                                     const T &value) {
+            if (other != coord) {
+                visitor(other, value);
+            }
+        });
+    }
+};
+
+} // namespace vm
+
+#endif /* VM_SCENE_CHUNK_INDEX_H */
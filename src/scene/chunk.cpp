@@ -3,25 +3,147 @@
 #include "chunk.h"
 #include "scene.h"
 
+#include "compute/utils.h"
+
 using namespace glm;
 namespace vm {
 
-static const size_t N = VM_CHUNK_SIZE;
-
-Chunk::Chunk(const ivec3 &coord, const compute::context &context, int lod)
-        : samples(context, N + 3, N + 3, N + 3, Scene::samples_format())
-        , edges_x(context, N + 2, N + 3, N + 3, Scene::edges_format())
-        , edges_y(context, N + 3, N + 2, N + 3, Scene::edges_format())
-        , edges_z(context, N + 3, N + 3, N + 2, Scene::edges_format())
+ChunkMesh::ChunkMesh()
 #warning "TODO: this vbo and cl_vbo are rather ugly"
-        , vbo()
+        : vbo()
         , num_vertices(0)
         , cl_vbo()
         , ibo()
         , cl_ibo()
+        , num_indices(0)
+        , index_type(GL_UNSIGNED_INT)
+        , staged_vbo()
+        , staged_ibo()
+        , num_staged_vertices(0)
+        , num_staged_indices(0)
+        , staged_index_type(GL_UNSIGNED_INT)
+        , pending(false)
+        , uploaded() {
+}
+
+void ChunkMesh::clear() {
+    staged_vbo = compute::buffer();
+    staged_ibo = compute::buffer();
+    num_staged_vertices = 0;
+    num_staged_indices = 0;
+    pending = true;
+}
+
+Chunk::Chunk(const ivec3 &coord, const VolumeParams &params, int lod)
+        : size(params.chunk_size)
+        , samples()
+        , edges_x()
+        , edges_y()
+        , edges_z()
+        , materials()
+        , meshes()
+        , uniform(true)
+        , uniform_sample(params.outside_sample())
+        , uniform_material(0)
+        , dirty_bricks(num_bricks())
+        , edit_sequence(0)
         , mutex()
+        , archive_mutex()
+        , archived_records(0)
         , coord(coord)
         , lod(lod) {
 }
 
+void Chunk::alloc_volume(const compute::context &context) {
+    compute::image3d *images[] = { &samples, &edges_x, &edges_y, &edges_z,
+                                   &materials };
+    for (size_t i = 0; i < NUM_VOLUME_IMAGES; ++i) {
+        const compute::extents<3> dims = volume_image_size(i);
+        *images[i] = compute::image3d(
+                context, dims[0], dims[1], dims[2], volume_image_format(i));
+    }
+    uniform = false;
+}
+
+void Chunk::make_uniform(int16_t sample, uint8_t material) {
+    free_volume();
+    for (ChunkMesh &mesh : meshes) {
+        mesh.clear();
+    }
+    uniform = true;
+    uniform_sample = sample;
+    uniform_material = material;
+    // Whatever was persisted of the volume is stale now.
+    dirty_bricks.set();
+}
+
+void Chunk::mark_dirty(const ivec3 &min, const ivec3 &max) {
+    const int n = int(bricks_per_axis());
+    const ivec3 last(n - 1);
+    const ivec3 brick_min = clamp(min / VM_BRICK_SIZE, ivec3(0), last);
+    const ivec3 brick_max = clamp(max / VM_BRICK_SIZE, ivec3(0), last);
+    for (int z = brick_min.z; z <= brick_max.z; ++z) {
+        for (int y = brick_min.y; y <= brick_max.y; ++y) {
+            for (int x = brick_min.x; x <= brick_max.x; ++x) {
+                dirty_bricks.set(x + n * (y + n * z));
+            }
+        }
+    }
+}
+
+void Chunk::free_volume() {
+    samples = compute::image3d();
+    edges_x = compute::image3d();
+    edges_y = compute::image3d();
+    edges_z = compute::image3d();
+    materials = compute::image3d();
+}
+
+size_t Chunk::volume_bytes() const {
+    const size_t N = size;
+    const size_t num_samples = (N + 3) * (N + 3) * (N + 3);
+    const size_t num_edges = 3 * (N + 2) * (N + 3) * (N + 3);
+    return (image_format_size(Scene::samples_format())
+            + image_format_size(Scene::materials_format()))
+                   * num_samples
+           + image_format_size(Scene::edges_format()) * num_edges;
+}
+
+compute::extents<3> Chunk::volume_image_size(size_t image) const {
+    const size_t N = size;
+    compute::extents<3> dims = compute::dim(N + 3, N + 3, N + 3);
+    if (image > 0 && image < 4) {
+        // Edges along an axis are one less than samples along it.
+        dims[image - 1] = N + 2;
+    }
+    return dims;
+}
+
+compute::image_format Chunk::volume_image_format(size_t image) {
+    switch (image) {
+    case 0: return Scene::samples_format();
+    case 4: return Scene::materials_format();
+    default: return Scene::edges_format();
+    }
+}
+
+size_t Chunk::volume_image_element_size(size_t image) {
+    return image_format_size(volume_image_format(image));
+}
+
+void Chunk::get_brick_region(size_t brick,
+                             size_t image,
+                             compute::extents<3> &origin,
+                             compute::extents<3> &region) const {
+    const compute::extents<3> dims = volume_image_size(image);
+    for (size_t axis = 0; axis < 3; ++axis) {
+        const size_t index = brick % bricks_per_axis();
+        brick /= bricks_per_axis();
+        origin[axis] = index * VM_BRICK_SIZE;
+        region[axis] = index + 1 == bricks_per_axis()
+                               ? dims[axis] - origin[axis]
+                               : VM_BRICK_SIZE;
+    }
+}
+
 } // namespace vm
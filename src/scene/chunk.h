@@ -1,19 +1,28 @@
 #ifndef VM_SCENE_CHUNK_H
 #define VM_SCENE_CHUNK_H
+#include <config.h>
+
+#include <array>
 #include <glm/glm.hpp>
 #include <mutex>
 
+#include <boost/dynamic_bitset.hpp>
+
 #include "compute/context.h"
 
 #include "gfx/buffer.h"
 
+#include "scene/volume-params.h"
+
 namespace vm {
 
-struct Chunk {
-    compute::image3d samples;
-    compute::image3d edges_x;
-    compute::image3d edges_y;
-    compute::image3d edges_z;
+/** Mesh of a chunk at a single level of detail */
+struct ChunkMesh {
+    /**
+     * Bytes per vertex, its world position followed by the material of the
+     * surface around it (a float holding the integer id).
+     */
+    static const constexpr size_t VERTEX_BYTES = sizeof(glm::vec4);
 
     Buffer vbo;
     size_t num_vertices;
@@ -22,18 +31,155 @@ struct Chunk {
     Buffer ibo;
     compute::opengl_buffer cl_ibo;
     size_t num_indices;
+    /**
+     * Type of the indices in ibo, GL_UNSIGNED_SHORT for meshes small enough,
+     * GL_UNSIGNED_INT otherwise.
+     */
+    GLenum index_type;
+
+    /**
+     * Mesh produced by the dc::Mesher, which is yet to be uploaded to the vbo
+     * and ibo above by the thread owning the GL context.
+     */
+    compute::buffer staged_vbo;
+    compute::buffer staged_ibo;
+    size_t num_staged_vertices;
+    size_t num_staged_indices;
+    GLenum staged_index_type;
+    bool pending;
+    /* Completes once the staged mesh is copied, freeing staging buffers */
+    compute::event uploaded;
+
+    ChunkMesh();
+
+    /** @returns size (in bytes) of a single index of @p type */
+    static inline size_t index_size(GLenum type) {
+        return type == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+    }
+
+    /** Drops the staged mesh, so that the uploaded one is released as well */
+    void clear();
+};
+
+struct Chunk {
+    /* Number of device images making up the volume */
+    static const constexpr size_t NUM_VOLUME_IMAGES = 5;
+
+    /* Number of voxels along each axis (see VolumeParams::chunk_size) */
+    const size_t size;
+
+    compute::image3d samples;
+    compute::image3d edges_x;
+    compute::image3d edges_y;
+    compute::image3d edges_z;
+    /* Material of each sample, as set by the last brush adding it */
+    compute::image3d materials;
+
+    /* Meshes at each level of detail, the 0th one is at full resolution */
+    std::array<ChunkMesh, VM_LOD_LEVELS> meshes;
+
+    /**
+     * Chunks whose samples are all equivalent (i.e. entirely outside or inside
+     * the volume) keep no device images at all, just the sample value.
+     */
+    bool uniform;
+    int16_t uniform_sample;
+    uint8_t uniform_material;
+
+    /**
+     * Bricks modified since the chunk was last persisted. Each brick spans
+     * VM_BRICK_SIZE^3 samples and edges of the volume images, with the bricks
+     * at the far end of each axis spanning the chunk's border as well.
+     */
+    boost::dynamic_bitset<> dirty_bricks;
+    /**
+     * Sequence number of the last journaled edit (see EditJournal) applied to
+     * the chunk, which is persisted along with the volume, 0 - none.
+     */
+    uint64_t edit_sequence;
 
     std::mutex mutex;
+    /* Serializes reads / writes of this chunk's archive file */
+    std::mutex archive_mutex;
+    /**
+     * Number of brick records in the chunk's archive file, 0 if the file has
+     * to be written as a whole. Guarded by the archive_mutex.
+     */
+    size_t archived_records;
     glm::ivec3 coord;
+    /* Level of detail the chunk is rendered at */
     int lod;
 
     /**
-     * Constructs an empty chunk of the scene, with no volumetric data
-     * associated - it may be loaded later on.
+     * Constructs an empty chunk of the scene with the volume @p params, with
+     * no volumetric data associated - it may be loaded later on. Until then it
+     * is uniformly outside of the volume.
+     */
+    Chunk(const glm::ivec3 &coord, const VolumeParams &params, int lod = 0);
+
+    /** Allocates device images for the volumetric data (contents undefined) */
+    void alloc_volume(const compute::context &context);
+
+    /** Releases device images of the volumetric data, keeping the mesh */
+    void free_volume();
+
+    /**
+     * Drops volume and staged meshes, and marks all samples to be @p sample
+     * of the @p material. The uploaded meshes are released with the next
+     * upload.
+     */
+    void make_uniform(int16_t sample, uint8_t material = 0);
+
+    /**
+     * Marks bricks overlapping the inclusive box [@p min, @p max] of image
+     * coordinates as dirty.
+     */
+    void mark_dirty(const glm::ivec3 &min, const glm::ivec3 &max);
+
+    /** @returns true if the volumetric data resides on the device */
+    inline bool has_volume() const {
+        return samples.get() != nullptr;
+    }
+
+    /** @returns true if the volume was evicted from the device */
+    inline bool is_evicted() const {
+        return !uniform && !has_volume();
+    }
+
+    /** @returns number of bricks along each axis of the chunk */
+    inline size_t bricks_per_axis() const {
+        return size / VM_BRICK_SIZE;
+    }
+
+    inline size_t num_bricks() const {
+        return bricks_per_axis() * bricks_per_axis() * bricks_per_axis();
+    }
+
+    /** @returns number of device bytes taken by the volumetric data */
+    size_t volume_bytes() const;
+
+    /**
+     * @returns dimensions of the samples (0), edges_x/y/z (1-3) and materials
+     * (4) images
+     */
+    compute::extents<3> volume_image_size(size_t image) const;
+
+    /** @returns format of the volume @p image */
+    static compute::image_format volume_image_format(size_t image);
+
+    /** @returns size of a single element of the volume @p image */
+    static size_t volume_image_element_size(size_t image);
+
+    /**
+     * Computes the box of the volume @p image covered by the @p brick.
+     *
+     * @param origin first element of the box
+     * @param region size of the box
      */
-    Chunk(const glm::ivec3 &coord,
-          const compute::context &context,
-          int lod = 0);
+    void get_brick_region(size_t brick,
+                          size_t image,
+                          compute::extents<3> &origin,
+                          compute::extents<3> &region) const;
 };
 
 } // namespace vm
@@ -0,0 +1,283 @@
+#include "edit-journal.h"
+
+#include "scene/brush-ball.h"
+#include "scene/brush-composite.h"
+#include "scene/brush-cube.h"
+
+#include "utils/file-sync.h"
+#include "utils/log.h"
+#include "utils/persistence.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace glm;
+namespace fs = boost::filesystem;
+namespace vm {
+
+namespace {
+const uint32_t JOURNAL_MAGIC = 0x4a4d56; // "VMJ"
+const uint16_t JOURNAL_VERSION = 3;
+/* Version 2 journals are still read, their edits are numbered from 1 */
+const uint16_t MIN_JOURNAL_VERSION = 2;
+/* Magic and version, followed by the base sequence number since version 3 */
+const size_t MIN_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint16_t);
+const size_t HEADER_SIZE = MIN_HEADER_SIZE + sizeof(uint64_t);
+/**
+ * Each record starts with the operation, brush id, origin, rotation, scale,
+ * material and the size of the brush program. Then come the program (empty
+ * unless the brush is composite) and the checksum of the whole record.
+ */
+const size_t RECORD_PREFIX_SIZE = sizeof(uint8_t) + sizeof(int32_t)
+                                  + sizeof(vec3) + sizeof(mat3) + sizeof(vec3)
+                                  + sizeof(int32_t) + sizeof(uint32_t);
+const size_t MAX_PROGRAM_SIZE =
+        BrushComposite::MAX_NODES * BrushComposite::NODE_SIZE;
+
+size_t header_size(uint16_t version) {
+    return version < 3 ? MIN_HEADER_SIZE : HEADER_SIZE;
+}
+
+runtime_error system_error(const string &what, const string &path) {
+    return runtime_error(boost::str(boost::format("%1% %2%: %3%") % what % path
+                                    % strerror(errno)));
+}
+
+void write_all(int fd, const string &data, const string &path) {
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t n =
+                ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw system_error("Cannot write", path);
+        }
+        written += static_cast<size_t>(n);
+    }
+}
+
+unique_ptr<Brush> make_brush(int id, const vector<float> &program) {
+    switch (id) {
+    case Brush::Id::Cube: return make_unique<BrushCube>();
+    case Brush::Id::Ball: return make_unique<BrushBall>();
+    case Brush::Id::Composite: {
+        auto brush = make_unique<BrushComposite>();
+        brush->set_program(program);
+        return move(brush);
+    }
+    }
+    throw runtime_error("Unknown brush id: " + to_string(id));
+}
+
+uint32_t checksum(const char *data, size_t size) {
+    return static_cast<uint32_t>(
+            crc32(0, reinterpret_cast<const Bytef *>(data), size));
+}
+} // namespace
+
+EditJournal::EditJournal(const string &path)
+        : m_path(path)
+        , m_fd(-1)
+        , m_version(JOURNAL_VERSION)
+        , m_base_sequence(0)
+        , m_num_records(0) {
+    // Journals are written whole before they are renamed into place, so one
+    // without even the magic and version is a leftover of an old build.
+    if (!fs::exists(path) || fs::file_size(path) < MIN_HEADER_SIZE) {
+        reset(0);
+        return;
+    }
+    m_fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+    if (m_fd < 0) {
+        throw system_error("Cannot open", path);
+    }
+    try {
+        open_records();
+    } catch (...) {
+        ::close(m_fd);
+        throw;
+    }
+}
+
+void EditJournal::reset(uint64_t base_sequence) {
+    // Written aside, so that a crash leaves either the old journal or the
+    // new one, and never loses the sequence numbers of the edits.
+    const string temporary = m_path + ".tmp";
+    const int fd = ::open(temporary.c_str(),
+                          O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                          0644);
+    if (fd < 0) {
+        throw system_error("Cannot open", temporary);
+    }
+    try {
+        ostringstream header;
+        header <= JOURNAL_MAGIC <= JOURNAL_VERSION <= base_sequence;
+        write_all(fd, header.str(), temporary);
+        replace_file(temporary, m_path);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+    m_fd = fd;
+    m_version = JOURNAL_VERSION;
+    m_base_sequence = base_sequence;
+    m_num_records = 0;
+}
+
+void EditJournal::open_records() {
+    struct stat info;
+    if (fstat(m_fd, &info) < 0) {
+        throw system_error("Cannot stat", m_path);
+    }
+    string data(MIN_HEADER_SIZE, '\0');
+    if (pread(m_fd, &data[0], MIN_HEADER_SIZE, 0)
+        != ssize_t(MIN_HEADER_SIZE)) {
+        throw system_error("Cannot read", m_path);
+    }
+    uint32_t magic;
+    istringstream header(data);
+    header >= magic >= m_version;
+    if (magic != JOURNAL_MAGIC || m_version < MIN_JOURNAL_VERSION
+        || m_version > JOURNAL_VERSION) {
+        throw runtime_error(boost::str(
+                boost::format("%1% is not a journal of version %2% to %3%")
+                % m_path % MIN_JOURNAL_VERSION % JOURNAL_VERSION));
+    }
+    if (has_sequence()) {
+        data.resize(sizeof(m_base_sequence));
+        if (pread(m_fd, &data[0], data.size(), MIN_HEADER_SIZE)
+            != ssize_t(data.size())) {
+            throw system_error("Cannot read", m_path);
+        }
+        memcpy(&m_base_sequence, data.data(), data.size());
+    }
+
+    // A record torn by a crash in the middle of append() is discarded, so
+    // that new records don't end up behind it.
+    off_t offset = header_size(m_version);
+    while (read_record(offset, data)) {
+        offset += data.size();
+        ++m_num_records;
+    }
+    if (offset != info.st_size) {
+        LOG(info) << "Discarding torn record of " << m_path;
+        if (ftruncate(m_fd, offset) < 0) {
+            throw system_error("Cannot truncate", m_path);
+        }
+    }
+}
+
+bool EditJournal::read_record(off_t offset, string &record) const {
+    record.resize(RECORD_PREFIX_SIZE);
+    if (pread(m_fd, &record[0], RECORD_PREFIX_SIZE, offset)
+        != ssize_t(RECORD_PREFIX_SIZE)) {
+        return false;
+    }
+    uint32_t program_size;
+    memcpy(&program_size,
+           &record[RECORD_PREFIX_SIZE - sizeof(uint32_t)],
+           sizeof(uint32_t));
+    if (program_size > MAX_PROGRAM_SIZE) {
+        return false;
+    }
+    const size_t rest = sizeof(float) * program_size + sizeof(uint32_t);
+    record.resize(RECORD_PREFIX_SIZE + rest);
+    if (pread(m_fd, &record[RECORD_PREFIX_SIZE], rest,
+              offset + RECORD_PREFIX_SIZE) != ssize_t(rest)) {
+        return false;
+    }
+    uint32_t stored_checksum;
+    memcpy(&stored_checksum,
+           &record[record.size() - sizeof(uint32_t)],
+           sizeof(uint32_t));
+    return stored_checksum
+           == checksum(record.data(), record.size() - sizeof(uint32_t));
+}
+
+EditJournal::~EditJournal() {
+    ::close(m_fd);
+}
+
+uint64_t EditJournal::append(const Brush &brush,
+                             dc::Sampler::Operation operation) {
+    vector<float> program;
+    if (brush.id() == Brush::Id::Composite) {
+        program = static_cast<const BrushComposite &>(brush).get_program();
+    }
+    ostringstream record;
+    record <= static_cast<uint8_t>(operation)
+           <= static_cast<int32_t>(brush.id())
+           <= brush.get_origin()
+           <= brush.get_rotation()
+           <= brush.get_scale()
+           <= static_cast<int32_t>(brush.material())
+           <= static_cast<uint32_t>(program.size());
+    record.write(reinterpret_cast<const char *>(program.data()),
+                 sizeof(float) * program.size());
+    const string data = record.str();
+    record <= checksum(data.data(), data.size());
+
+    write_all(m_fd, record.str(), m_path);
+    if (fdatasync(m_fd) < 0) {
+        throw system_error("Cannot sync", m_path);
+    }
+    return m_base_sequence + ++m_num_records;
+}
+
+void EditJournal::replay(const Visitor &visitor) {
+    size_t num_records = 0;
+    string data;
+    off_t offset = header_size(m_version);
+    while (read_record(offset, data)) {
+        uint8_t operation;
+        int32_t brush_id;
+        vec3 origin;
+        mat3 rotation;
+        vec3 scale;
+        int32_t material;
+        uint32_t program_size;
+        istringstream record(data);
+        record >= operation >= brush_id >= origin >= rotation >= scale
+                >= material >= program_size;
+        vector<float> program(program_size);
+        record.read(reinterpret_cast<char *>(program.data()),
+                    sizeof(float) * program.size());
+
+        unique_ptr<Brush> brush = make_brush(brush_id, program);
+        brush->set_origin(origin);
+        brush->set_rotation_matrix(rotation);
+        brush->set_scale(scale);
+        brush->set_material(material);
+        offset += data.size();
+        ++num_records;
+        visitor(*brush,
+                static_cast<dc::Sampler::Operation>(operation),
+                m_base_sequence + num_records);
+    }
+    LOG(info) << "Replayed " << num_records << " edits from " << m_path;
+}
+
+void EditJournal::truncate() {
+    if (m_num_records) {
+        reset(m_base_sequence + m_num_records);
+    }
+}
+
+} // namespace vm
@@ -0,0 +1,97 @@
+#ifndef VM_SCENE_EDIT_JOURNAL_H
+#define VM_SCENE_EDIT_JOURNAL_H
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+#include "dc/sampler.h"
+#include "scene/brush.h"
+
+namespace vm {
+
+/**
+ * Append-only log of brush operations applied to the scene.
+ *
+ * Each edit is appended as a small, checksummed record and synced to the disk
+ * before it is applied, so that chunk files only need to be rewritten at
+ * checkpoints. Edits are numbered in the order they are appended, across
+ * truncations as well, so that chunks persisted with some of the edits may
+ * skip them when the journal is replayed. Blended edits, unlike the sharp
+ * ones, would change the chunks again.
+ */
+class EditJournal {
+    std::string m_path;
+    int m_fd;
+    /* Version of the journal file, older ones may be appended to as well */
+    uint16_t m_version;
+    /* Sequence number of the last edit before the first record */
+    uint64_t m_base_sequence;
+    size_t m_num_records;
+
+    /** Checks the header and counts the records */
+    void open_records();
+    /**
+     * Atomically replaces the journal with an empty one, whose first edit
+     * follows the @p base_sequence, and opens it.
+     */
+    void reset(uint64_t base_sequence);
+    /**
+     * Reads the record at @p offset into @p record.
+     *
+     * @returns false if there is no complete, valid record there
+     */
+    bool read_record(off_t offset, std::string &record) const;
+
+public:
+    typedef std::function<void(
+            const Brush &, dc::Sampler::Operation, uint64_t sequence)>
+            Visitor;
+
+    EditJournal(const EditJournal &) = delete;
+    EditJournal &operator=(const EditJournal &) = delete;
+
+    /** Opens the journal at @p path, creating an empty one if there is none */
+    explicit EditJournal(const std::string &path);
+    ~EditJournal();
+
+    /** @returns number of records in the journal */
+    inline size_t size() const {
+        return m_num_records;
+    }
+
+    /**
+     * @returns false for journals written before edits were numbered across
+     * truncations, whose edits may be older than those of the chunks
+     */
+    inline bool has_sequence() const {
+        return m_version >= 3;
+    }
+
+    /**
+     * Durably appends an edit of the @p brush with the @p operation.
+     *
+     * @returns sequence number of the edit, greater than that of any edit
+     * appended before
+     */
+    uint64_t append(const Brush &brush, dc::Sampler::Operation operation);
+
+    /**
+     * Calls @p visitor for every edit in the journal, in order, along with its
+     * sequence number. An incomplete record at the end (e.g. after a crash in
+     * the middle of append()) is discarded when the journal is opened.
+     */
+    void replay(const Visitor &visitor);
+
+    /**
+     * Removes all records, once their edits are persisted elsewhere. Edits
+     * appended later keep being numbered after them.
+     */
+    void truncate();
+};
+
+} // namespace vm
+
+#endif /* VM_SCENE_EDIT_JOURNAL_H */
@@ -0,0 +1,58 @@
+#include "residency.h"
+
+#include "scene/chunk.h"
+
+#include <algorithm>
+
+using namespace std;
+namespace vm {
+
+ResidencyManager::ResidencyManager(size_t budget)
+        : m_budget(budget), m_resident_bytes(0), m_lru(), m_entries() {}
+
+void ResidencyManager::set_budget(size_t budget) {
+    m_budget = budget;
+}
+
+void ResidencyManager::touch(const shared_ptr<Chunk> &chunk) {
+    auto it = m_entries.find(chunk.get());
+    if (it != m_entries.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return;
+    }
+    m_lru.push_front(chunk);
+    m_entries.emplace(chunk.get(), m_lru.begin());
+    m_resident_bytes += chunk->volume_bytes();
+}
+
+void ResidencyManager::forget(const shared_ptr<Chunk> &chunk) {
+    auto it = m_entries.find(chunk.get());
+    if (it == m_entries.end()) {
+        return;
+    }
+    m_lru.erase(it->second);
+    m_entries.erase(it);
+    m_resident_bytes -= chunk->volume_bytes();
+}
+
+vector<shared_ptr<Chunk>>
+ResidencyManager::select_victims(const vector<shared_ptr<Chunk>> &pinned) {
+    vector<shared_ptr<Chunk>> victims;
+    if (!m_budget) {
+        return victims;
+    }
+    auto it = m_lru.end();
+    while (m_resident_bytes > m_budget && it != m_lru.begin()) {
+        --it;
+        if (find(pinned.begin(), pinned.end(), *it) != pinned.end()) {
+            continue;
+        }
+        victims.push_back(*it);
+        m_entries.erase(it->get());
+        it = m_lru.erase(it);
+        m_resident_bytes -= victims.back()->volume_bytes();
+    }
+    return victims;
+}
+
+} // namespace vm
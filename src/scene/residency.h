@@ -0,0 +1,62 @@
+#ifndef VM_SCENE_RESIDENCY_H
+#define VM_SCENE_RESIDENCY_H
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace vm {
+struct Chunk;
+
+/**
+ * Keeps track of chunks whose volumetric data resides on the device, in the
+ * least-recently-used order, and decides which of them have to go once the
+ * configured memory budget is exceeded.
+ *
+ * NOTE: Only volumes (samples and edges) are accounted for. Meshes are much
+ * smaller and stay resident, so that evicted chunks can still be rendered.
+ */
+class ResidencyManager {
+    typedef std::list<std::shared_ptr<Chunk>> LruList;
+
+    size_t m_budget;
+    size_t m_resident_bytes;
+    /* Most recently used chunks are at the front */
+    LruList m_lru;
+    std::unordered_map<const Chunk *, LruList::iterator> m_entries;
+
+public:
+    ResidencyManager(const ResidencyManager &) = delete;
+    ResidencyManager &operator=(const ResidencyManager &) = delete;
+
+    /** @param budget   Number of device bytes volumes may take (0 - no limit) */
+    ResidencyManager(size_t budget);
+
+    inline size_t budget() const {
+        return m_budget;
+    }
+
+    inline size_t resident_bytes() const {
+        return m_resident_bytes;
+    }
+
+    void set_budget(size_t budget);
+
+    /** Marks volume of @p chunk as resident and most recently used */
+    void touch(const std::shared_ptr<Chunk> &chunk);
+
+    /** Stops tracking @p chunk (e.g. because it is being destroyed) */
+    void forget(const std::shared_ptr<Chunk> &chunk);
+
+    /**
+     * Picks least recently used chunks that have to be evicted to fit within
+     * the budget and stops tracking them. Chunks in @p pinned are never
+     * selected.
+     */
+    std::vector<std::shared_ptr<Chunk>>
+    select_victims(const std::vector<std::shared_ptr<Chunk>> &pinned);
+};
+
+} // namespace vm
+
+#endif /* VM_SCENE_RESIDENCY_H */
@@ -2,6 +2,7 @@
 
 #include "scene-archive.h"
 #include "scene.h"
+#include "utils/file-sync.h"
 #include "utils/log.h"
 #include "utils/persistence.h"
 
@@ -9,56 +10,105 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/read.hpp>
-#include <boost/iostreams/write.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
 
+#include <condition_variable>
+#include <cstring>
+
 using namespace std;
 using namespace glm;
 namespace fs = boost::filesystem;
 
 namespace vm {
 
-static const uint16_t ARCHIVE_VERSION = 3;
+static const uint16_t ARCHIVE_VERSION = 7;
+/*
+ * Oldest version still read. Archives up to version 4 keep whole volumes
+ * rather than bricks, version 3 ones have no uniform chunks, version 5 ones
+ * predate materials, and version 6 ones have no commit records.
+ */
+static const uint16_t MIN_ARCHIVE_VERSION = 3;
+static const uint16_t PARAMS_VERSION = 2;
+/*
+ * Brick index of the record ending each batch of records written at once,
+ * whose contents is the edit sequence number of the chunk (see Chunk).
+ */
+static const uint16_t COMMIT_RECORD = UINT16_MAX;
 
 struct ArchiveHeader {
     uint16_t version;
     uint16_t chunk_size;
+    uint16_t brick_size;
     uint16_t chunk_border;
     double voxel_size;
     uint16_t edge_size;
     uint16_t sample_size;
+    /* Uniform chunks store no volume, just the value of all their samples */
+    uint8_t uniform;
+    int16_t uniform_sample;
+    uint8_t uniform_material;
 };
 
 namespace detail {
 
-static void validate_header(fstream &file) {
+/**
+ * @returns number of volume images archives of the @p version store, which
+ * are the leading ones of the chunk.
+ */
+static size_t num_archived_images(uint16_t version) {
+    return version < 6 ? Chunk::NUM_VOLUME_IMAGES - 1
+                       : Chunk::NUM_VOLUME_IMAGES;
+}
+
+static ArchiveHeader read_header(fstream &file, const VolumeParams &params) {
     ArchiveHeader header{};
     file >= header.version;
+    if (header.version < MIN_ARCHIVE_VERSION
+        || header.version > ARCHIVE_VERSION) {
+        throw runtime_error(boost::str(
+                boost::format("Expected version %1% to %2%, got: %3%")
+                % MIN_ARCHIVE_VERSION % ARCHIVE_VERSION % header.version));
+    }
     file >= header.chunk_size;
+    // Volumes of older archives are not divided into bricks.
+    header.brick_size = VM_BRICK_SIZE;
+    if (header.version >= 5) {
+        file >= header.brick_size;
+    }
     file >= header.voxel_size;
     file >= header.edge_size;
     file >= header.sample_size;
-
-    if (header.version != ARCHIVE_VERSION) {
-        throw runtime_error(
-                boost::str(boost::format("Expected version %1%, got: %2%")
-                           % ARCHIVE_VERSION
-                           % header.version));
+    // Chunks of archives without uniform ones all have a volume.
+    if (header.version >= 4) {
+        file >= header.uniform;
+        file >= header.uniform_sample;
     }
-    if (header.chunk_size != VM_CHUNK_SIZE) {
+    // Chunks of archives without materials are all of the default one.
+    if (header.version >= 6) {
+        file >= header.uniform_material;
+    }
+
+    if (header.chunk_size != params.chunk_size) {
         throw runtime_error(
                 boost::str(boost::format("Expected chunk size %1%, got: %2%")
-                           % VM_CHUNK_SIZE
+                           % params.chunk_size
                            % header.chunk_size));
     }
-    if (header.voxel_size != VM_VOXEL_SIZE) {
+    if (header.brick_size != VM_BRICK_SIZE) {
+        throw runtime_error(
+                boost::str(boost::format("Expected brick size %1%, got: %2%")
+                           % VM_BRICK_SIZE
+                           % header.brick_size));
+    }
+    if (header.voxel_size != params.voxel_size) {
         throw runtime_error(
                 boost::str(boost::format("Expected voxel size %1%, got: %2%")
-                           % VM_VOXEL_SIZE
+                           % params.voxel_size
                            % header.voxel_size));
     }
     if (header.edge_size != image_format_size(Scene::edges_format())) {
@@ -73,18 +123,113 @@ static void validate_header(fstream &file) {
                            % image_format_size(Scene::samples_format())
                            % header.sample_size));
     }
+    return header;
 }
 
-static void write_header(ofstream &file) {
+static void write_header(ofstream &file,
+                         const VolumeParams &params,
+                         bool uniform,
+                         int16_t uniform_sample,
+                         uint8_t uniform_material) {
     // clang-format off
     file <= static_cast<uint16_t>(ARCHIVE_VERSION)
-         <= static_cast<uint16_t>(VM_CHUNK_SIZE)
-         <= static_cast<double>(VM_VOXEL_SIZE)
+         <= static_cast<uint16_t>(params.chunk_size)
+         <= static_cast<uint16_t>(VM_BRICK_SIZE)
+         <= static_cast<double>(params.voxel_size)
          <= static_cast<uint16_t>(image_format_size(Scene::edges_format()))
-         <= static_cast<uint16_t>(image_format_size(Scene::samples_format()));
+         <= static_cast<uint16_t>(image_format_size(Scene::samples_format()))
+         <= static_cast<uint8_t>(uniform)
+         <= static_cast<int16_t>(uniform_sample)
+         <= static_cast<uint8_t>(uniform_material);
     // clang-format on
 }
 
+/** @returns number of bytes of the first @p num_images the @p brick spans */
+static size_t brick_bytes(const Chunk &chunk,
+                          size_t brick,
+                          size_t num_images = Chunk::NUM_VOLUME_IMAGES) {
+    size_t bytes = 0;
+    for (size_t image = 0; image < num_images; ++image) {
+        compute::extents<3> origin;
+        compute::extents<3> region;
+        chunk.get_brick_region(brick, image, origin, region);
+        bytes += Chunk::volume_image_element_size(image) * region[0]
+                 * region[1] * region[2];
+    }
+    return bytes;
+}
+
+/**
+ * Copies the packed @p brick of the first @p num_images into the whole
+ * @p images of the volume
+ */
+static void unpack_brick(const Chunk &chunk,
+                         size_t brick,
+                         const vector<uint8_t> &packed,
+                         vector<uint8_t> *const images[],
+                         size_t num_images) {
+    const uint8_t *src = packed.data();
+    for (size_t image = 0; image < num_images; ++image) {
+        compute::extents<3> origin;
+        compute::extents<3> region;
+        chunk.get_brick_region(brick, image, origin, region);
+        const compute::extents<3> size = chunk.volume_image_size(image);
+        const size_t element_size = Chunk::volume_image_element_size(image);
+        const size_t row_bytes = element_size * region[0];
+        for (size_t z = origin[2]; z < origin[2] + region[2]; ++z) {
+            for (size_t y = origin[1]; y < origin[1] + region[1]; ++y) {
+                const size_t offset = origin[0] + size[0] * (y + size[1] * z);
+                memcpy(&(*images[image])[element_size * offset],
+                       src,
+                       row_bytes);
+                src += row_bytes;
+            }
+        }
+    }
+}
+
+static string deflate_brick(const vector<uint8_t> &data) {
+    using namespace boost::iostreams;
+    string compressed;
+    filtering_ostream out;
+    out.push(zlib_compressor());
+    out.push(boost::iostreams::back_inserter(compressed));
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    out.reset();
+    return compressed;
+}
+
+static void inflate_brick(const string &compressed, vector<uint8_t> &data) {
+    using namespace boost::iostreams;
+    filtering_istream in;
+    in.push(zlib_decompressor());
+    in.push(array_source(compressed.data(), compressed.size()));
+    in.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (size_t(in.gcount()) != data.size()) {
+        throw runtime_error("Brick record is too short");
+    }
+}
+
+/**
+ * Inflates the first @p num_images of the whole volume, which archives older
+ * than version 5 store as a single stream following the header of the @p file
+ */
+static void inflate_volume(fstream &file,
+                           vector<uint8_t> *const images[],
+                           size_t num_images) {
+    using namespace boost::iostreams;
+    filtering_istream in;
+    in.push(zlib_decompressor());
+    in.push(file);
+    for (size_t image = 0; image < num_images; ++image) {
+        vector<uint8_t> &data = *images[image];
+        in.read(reinterpret_cast<char *>(data.data()), data.size());
+        if (size_t(in.gcount()) != data.size()) {
+            throw runtime_error("Volume is too short");
+        }
+    }
+}
+
 static string name_for_coord(const ivec3 &coord) {
     return boost::str(boost::format("chunk_%1%_%2%_%3%.gz") % coord.x % coord.y
                       % coord.z);
@@ -93,6 +238,7 @@ static string name_for_coord(const ivec3 &coord) {
 } // namespace detail
 
 void SceneArchive::discover_chunk_coords() {
+    lock_guard<mutex> coords_lock(m_coords_mutex);
     m_chunk_coords.clear();
     for (const auto &entry : fs::directory_iterator(m_workdir)) {
         if (!fs::is_regular_file(entry)) {
@@ -110,6 +256,61 @@ void SceneArchive::discover_chunk_coords() {
     }
 }
 
+string SceneArchive::prepare_workdir(const string &directory) {
+    if (!fs::exists(directory)) {
+        fs::create_directory(directory);
+    } else if (!fs::is_directory(directory)) {
+        throw invalid_argument(directory + " is not a directory");
+    }
+    return directory;
+}
+
+void SceneArchive::init_params(const VolumeParams &params) {
+    const string filename = (fs::path(m_workdir) / "volume.bin").string();
+    if (fs::exists(filename)) {
+        fstream file;
+        file.exceptions(fstream::failbit | fstream::badbit);
+        file.open(filename, fstream::in | fstream::binary);
+        uint16_t version;
+        uint16_t chunk_size;
+        double voxel_size;
+        uint8_t distance_samples = 0;
+        double blend_radius = 0;
+        file >= version >= chunk_size >= voxel_size;
+        // The 1st version had sign samples only.
+        if (version == PARAMS_VERSION) {
+            file >= distance_samples >= blend_radius;
+        } else if (version != 1) {
+            throw runtime_error(
+                    boost::str(boost::format("Expected version %1%, got: %2%")
+                               % PARAMS_VERSION
+                               % version));
+        }
+        m_params = VolumeParams(
+                chunk_size, voxel_size, distance_samples, blend_radius);
+        m_params.validate();
+        if (m_params != params) {
+            LOG(info) << "Keeping chunk size " << m_params.chunk_size
+                      << ", voxel size " << m_params.voxel_size
+                      << (m_params.distance_samples ? " and distance samples"
+                                                    : " and sign samples")
+                      << " of the existing scene";
+        }
+        return;
+    }
+    // Archives predating the file (of versions 3 to 5) were all written with
+    // the defaults, i.e. sign samples and sharp edits.
+    m_params = m_chunk_coords.empty() ? params : VolumeParams();
+    m_params.validate();
+    ofstream file;
+    file.exceptions(ofstream::failbit | ofstream::badbit);
+    file.open(filename, ofstream::out | ofstream::binary);
+    file <= PARAMS_VERSION <= static_cast<uint16_t>(m_params.chunk_size)
+         <= static_cast<double>(m_params.voxel_size)
+         <= static_cast<uint8_t>(m_params.distance_samples)
+         <= static_cast<double>(m_params.blend_radius);
+}
+
 string SceneArchive::chunk_filename(const shared_ptr<Chunk> &chunk) const {
     return (fs::path(m_workdir) /=
             fs::path(detail::name_for_coord(chunk->coord)))
@@ -117,131 +318,385 @@ string SceneArchive::chunk_filename(const shared_ptr<Chunk> &chunk) const {
 }
 
 SceneArchive::SceneArchive(const string &directory,
-                           const shared_ptr<ComputeContext> &compute_ctx)
-        : m_workdir(directory)
-        , m_jobs_mutex()
-        , m_jobs()
+                           const shared_ptr<ComputeContext> &compute_ctx,
+                           const VolumeParams &params)
+        : m_workdir(prepare_workdir(directory))
+        , m_params(params)
+        , m_dirty_mutex()
+        , m_dirty()
         , m_thread_pool(2)
+        , m_journal((fs::path(m_workdir) / "journal.bin").string())
+        , m_coords_mutex()
+        , m_chunk_coords()
+        , m_unreadable_coords()
         , m_copy_queue(compute_ctx->make_out_of_order_queue())
         , m_queue_mutex() {
-    if (!fs::exists(m_workdir)) {
-        fs::create_directory(m_workdir);
-    } else if (!fs::is_directory(m_workdir)) {
-        throw invalid_argument(directory + " is not a directory");
-    }
     discover_chunk_coords();
+    init_params(params);
+    // Chunks persisted with some of the journaled edits can't tell them apart
+    // from the others, and blended ones can't be applied twice.
+    if (m_params.blend_radius && m_journal.size()
+        && !m_journal.has_sequence()) {
+        throw runtime_error(boost::str(
+                boost::format("Journal of %1% has %2% edits, which can't be "
+                              "replayed exactly over a blended volume")
+                % m_workdir % m_journal.size()));
+    }
 }
 
 SceneArchive::~SceneArchive() {
     m_thread_pool.terminate();
 }
 
-const CoordSet &SceneArchive::get_chunk_coords() const {
+CoordSet SceneArchive::get_chunk_coords() const {
+    lock_guard<mutex> coords_lock(m_coords_mutex);
     return m_chunk_coords;
 }
 
-void SceneArchive::persist_later(shared_ptr<Chunk> chunk) {
-    lock_guard<mutex> jobs_lock(m_jobs_mutex);
-    if (m_jobs.find(chunk) != m_jobs.end()) {
-        m_thread_pool.cancel(m_jobs.at(chunk));
-    }
-
-    m_jobs[chunk] = m_thread_pool.enqueue([
-        =,
-        &jobs_mutex = m_jobs_mutex,
-        &queue_mutex = m_queue_mutex
-    ]() {
-        const size_t N = VM_CHUNK_SIZE;
-
-        vector<uint8_t> samples(image_format_size(Scene::samples_format())
-                                * (N + 3) * (N + 3) * (N + 3));
-        vector<uint8_t> edges_x(image_format_size(Scene::edges_format())
-                                * (N + 2) * (N + 3) * (N + 3));
-        vector<uint8_t> edges_y(image_format_size(Scene::edges_format())
-                                * (N + 3) * (N + 2) * (N + 3));
-        vector<uint8_t> edges_z(image_format_size(Scene::edges_format())
-                                * (N + 3) * (N + 3) * (N + 2));
-        {
-            lock_guard<mutex> queue_lock(queue_mutex);
-            lock_guard<mutex> chunk_lock(chunk->mutex);
-            enqueue_read_image3d_async(
-                    m_copy_queue, chunk->samples, samples.data());
-            enqueue_read_image3d_async(
-                    m_copy_queue, chunk->edges_x, edges_x.data());
-            enqueue_read_image3d_async(
-                    m_copy_queue, chunk->edges_y, edges_y.data());
-            enqueue_read_image3d_async(
-                    m_copy_queue, chunk->edges_z, edges_z.data());
+bool SceneArchive::contains(const ivec3 &coord) const {
+    lock_guard<mutex> coords_lock(m_coords_mutex);
+    return m_chunk_coords.count(coord) != 0;
+}
+
+bool SceneArchive::is_readable(const ivec3 &coord) const {
+    lock_guard<mutex> coords_lock(m_coords_mutex);
+    return m_unreadable_coords.count(coord) == 0;
+}
+
+void SceneArchive::persist(const shared_ptr<Chunk> &chunk) {
+    lock_guard<mutex> archive_lock(chunk->archive_mutex);
+    if (!is_readable(chunk->coord)) {
+        // Whatever the chunk holds, it is not what the file has.
+        LOG(warning) << "Not overwriting unreadable " << chunk_filename(chunk);
+        return;
+    }
+
+    bool uniform;
+    int16_t uniform_sample;
+    uint8_t uniform_material;
+    uint64_t edit_sequence;
+    bool append;
+    vector<size_t> bricks;
+    vector<vector<uint8_t>> brick_data;
+    {
+        lock_guard<mutex> queue_lock(m_queue_mutex);
+        lock_guard<mutex> chunk_lock(chunk->mutex);
+        if (chunk->is_evicted()) {
+            // Evicted in the meantime, which flushed it to the archive.
+            return;
+        }
+        uniform = chunk->uniform;
+        uniform_sample = chunk->uniform_sample;
+        uniform_material = chunk->uniform_material;
+        edit_sequence = chunk->edit_sequence;
+        // Modified bricks are appended to the file, unless the superseded
+        // records would take more space than the live ones.
+        append = !uniform && chunk->archived_records
+                 && chunk->archived_records + chunk->dirty_bricks.count()
+                            <= 2 * chunk->num_bricks();
+        if (!uniform) {
+            for (size_t brick = 0; brick < chunk->num_bricks(); ++brick) {
+                if (!append || chunk->dirty_bricks[brick]) {
+                    bricks.push_back(brick);
+                }
+            }
+            const compute::image3d *images[] = {
+                &chunk->samples, &chunk->edges_x, &chunk->edges_y,
+                &chunk->edges_z, &chunk->materials
+            };
+            brick_data.resize(bricks.size());
+            for (size_t i = 0; i < bricks.size(); ++i) {
+                brick_data[i].resize(detail::brick_bytes(*chunk, bricks[i]));
+                size_t offset = 0;
+                for (size_t image = 0; image < Chunk::NUM_VOLUME_IMAGES;
+                     ++image) {
+                    compute::extents<3> origin;
+                    compute::extents<3> region;
+                    chunk->get_brick_region(bricks[i], image, origin, region);
+                    enqueue_read_image3d_async(m_copy_queue,
+                                               *images[image],
+                                               origin,
+                                               region,
+                                               &brick_data[i][offset]);
+                    offset += Chunk::volume_image_element_size(image)
+                              * region[0] * region[1] * region[2];
+                }
+            }
             m_copy_queue.finish();
         }
+        chunk->dirty_bricks.reset();
+    }
+
+    // Should anything below fail, the file has to be rewritten as a whole.
+    const size_t archived_records = append ? chunk->archived_records : 0;
+    chunk->archived_records = 0;
 
-        using namespace boost::iostreams;
-        ofstream file;
-        file.exceptions(ofstream::failbit | ofstream::badbit);
-        file.open(chunk_filename(chunk), ofstream::out | ofstream::binary);
-        detail::write_header(file);
-        filtering_streambuf<output> out;
-        out.push(zlib_compressor());
-        out.push(file);
-        boost::iostreams::write(out,
-                                reinterpret_cast<const char *>(samples.data()),
-                                samples.size());
-        boost::iostreams::write(out,
-                                reinterpret_cast<const char *>(edges_x.data()),
-                                edges_x.size());
-        boost::iostreams::write(out,
-                                reinterpret_cast<const char *>(edges_y.data()),
-                                edges_y.size());
-        boost::iostreams::write(out,
-                                reinterpret_cast<const char *>(edges_z.data()),
-                                edges_z.size());
-
-        lock_guard<mutex> jobs_lock(jobs_mutex);
-        m_jobs.erase(chunk);
-
-        LOG(trace) << "Persisted " << chunk_filename(chunk);
-    });
-    (void) chunk;
+    // The journal is truncated once chunks are persisted, so they have to be
+    // on the disk by then. A file rewritten as a whole is written aside and
+    // renamed over the old one, so that a crash leaves one of them intact.
+    const string filename = chunk_filename(chunk);
+    const string written = append ? filename : filename + ".tmp";
+    ofstream file;
+    file.exceptions(ofstream::failbit | ofstream::badbit);
+    if (append) {
+        file.open(written, ofstream::out | ofstream::binary | ofstream::app);
+    } else {
+        file.open(written, ofstream::out | ofstream::binary);
+        detail::write_header(
+                file, m_params, uniform, uniform_sample, uniform_material);
+    }
+    for (size_t i = 0; i < bricks.size(); ++i) {
+        const string compressed = detail::deflate_brick(brick_data[i]);
+        file <= static_cast<uint16_t>(bricks[i])
+             <= static_cast<uint32_t>(compressed.size());
+        file.write(compressed.data(), compressed.size());
+    }
+    // Bricks read back count only once the commit record follows them, so
+    // appended ones have to be on the disk before it is.
+    if (append) {
+        file.flush();
+        sync_file(filename);
+    }
+    file <= COMMIT_RECORD <= static_cast<uint32_t>(sizeof(edit_sequence))
+         <= edit_sequence;
+    file.close();
+    if (append) {
+        sync_file(filename);
+    } else {
+        replace_file(written, filename);
+        lock_guard<mutex> coords_lock(m_coords_mutex);
+        m_chunk_coords.insert(chunk->coord);
+    }
+    chunk->archived_records = archived_records + bricks.size();
+
+    LOG(trace) << "Persisted " << bricks.size() << " bricks of "
+               << (uniform ? "uniform " : "") << chunk_filename(chunk);
 }
 
-void SceneArchive::restore(shared_ptr<Chunk> chunk) {
-    using namespace boost::iostreams;
+void SceneArchive::mark_dirty(const shared_ptr<Chunk> &chunk) {
+    lock_guard<mutex> dirty_lock(m_dirty_mutex);
+    m_dirty.insert(chunk);
+}
+
+void SceneArchive::flush(const shared_ptr<Chunk> &chunk) {
+    {
+        lock_guard<mutex> dirty_lock(m_dirty_mutex);
+        if (!m_dirty.erase(chunk)) {
+            return;
+        }
+    }
+    try {
+        persist(chunk);
+    } catch (...) {
+        // Keep it dirty, the journal still covers its edits.
+        mark_dirty(chunk);
+        throw;
+    }
+}
+
+void SceneArchive::checkpoint() {
+    set<shared_ptr<Chunk>> dirty;
+    {
+        lock_guard<mutex> dirty_lock(m_dirty_mutex);
+        swap(dirty, m_dirty);
+    }
+    mutex done_mutex;
+    condition_variable done_cv;
+    size_t remaining = dirty.size();
+    bool succeeded = true;
+    for (const auto &chunk : dirty) {
+        m_thread_pool.enqueue([&, chunk]() {
+            bool persisted = true;
+            try {
+                persist(chunk);
+            } catch (const exception &e) {
+                LOG(error) << "Cannot persist " << chunk_filename(chunk)
+                           << ": " << e.what();
+                // Keep it dirty, the journal still covers its edits.
+                mark_dirty(chunk);
+                persisted = false;
+            }
+            lock_guard<mutex> done_lock(done_mutex);
+            succeeded = succeeded && persisted;
+            if (--remaining == 0) {
+                done_cv.notify_all();
+            }
+        });
+    }
+    unique_lock<mutex> done_lock(done_mutex);
+    done_cv.wait(done_lock, [&]() { return remaining == 0; });
+    if (!succeeded) {
+        LOG(error) << "Keeping the journal, as not all chunks are persisted";
+        return;
+    }
+    m_journal.truncate();
+    LOG(trace) << "Checkpointed " << dirty.size() << " chunks";
+}
+
+ChunkData SceneArchive::read(const shared_ptr<Chunk> &chunk) {
+    try {
+        return read_file(chunk);
+    } catch (...) {
+        lock_guard<mutex> coords_lock(m_coords_mutex);
+        m_unreadable_coords.insert(chunk->coord);
+        throw;
+    }
+}
+
+ChunkData SceneArchive::read_file(const shared_ptr<Chunk> &chunk) {
     fstream file;
     file.exceptions(fstream::failbit | fstream::badbit);
     file.open(chunk_filename(chunk), fstream::in | fstream::binary);
-    detail::validate_header(file);
-    filtering_streambuf<input> in;
-    in.push(zlib_decompressor());
-    in.push(file);
+    const ArchiveHeader header = detail::read_header(file, m_params);
+
+    ChunkData data{};
+    data.uniform = header.uniform;
+    data.uniform_sample = header.uniform_sample;
+    data.uniform_material = header.uniform_material;
+    chunk->archived_records = 0;
+    if (data.uniform && header.version < 7) {
+        return data;
+    }
+    vector<uint8_t> *const images[] = { &data.samples, &data.edges_x,
+                                        &data.edges_y, &data.edges_z,
+                                        &data.materials };
+    // Images the archive doesn't store are left zeroed.
+    for (size_t image = 0; image < Chunk::NUM_VOLUME_IMAGES && !data.uniform;
+         ++image) {
+        const compute::extents<3> size = chunk->volume_image_size(image);
+        images[image]->resize(Chunk::volume_image_element_size(image)
+                              * size[0] * size[1] * size[2]);
+    }
+    const size_t num_images = detail::num_archived_images(header.version);
+    if (header.version < 5) {
+        // Such a file is rewritten as a whole once the chunk is modified.
+        detail::inflate_volume(file, images, num_images);
+        return data;
+    }
 
-    const size_t N = VM_CHUNK_SIZE;
-    vector<uint8_t> samples(image_format_size(Scene::samples_format()) * (N + 3)
-                            * (N + 3) * (N + 3));
-    vector<uint8_t> edges_x(image_format_size(Scene::edges_format()) * (N + 2)
-                            * (N + 3) * (N + 3));
-    vector<uint8_t> edges_y(image_format_size(Scene::edges_format()) * (N + 3)
-                            * (N + 2) * (N + 3));
-    vector<uint8_t> edges_z(image_format_size(Scene::edges_format()) * (N + 3)
-                            * (N + 3) * (N + 2));
-
-    boost::iostreams::read(
-            in, reinterpret_cast<char *>(&samples[0]), samples.size());
-    boost::iostreams::read(
-            in, reinterpret_cast<char *>(&edges_x[0]), edges_x.size());
-    boost::iostreams::read(
-            in, reinterpret_cast<char *>(&edges_y[0]), edges_y.size());
-    boost::iostreams::read(
-            in, reinterpret_cast<char *>(&edges_z[0]), edges_z.size());
+    // Records are read in order, so later ones supersede the earlier ones of
+    // the same brick. Since version 7 they count only once the commit record
+    // of their batch follows, so that the chunk is either as it was before
+    // the batch or after it, as is the sequence number of its last edit. A
+    // record torn by a crash ends the file, its edits are still in the
+    // journal.
+    file.exceptions(fstream::badbit);
+    const bool committed = header.version >= 7;
+    boost::dynamic_bitset<> restored(chunk->num_bricks());
+    size_t num_records = 0;
+    bool torn = false;
+    vector<pair<uint16_t, string>> batch;
+    vector<uint8_t> brick_data;
+    const auto restore_brick = [&](uint16_t brick, const string &compressed) {
+        brick_data.resize(detail::brick_bytes(*chunk, brick, num_images));
+        detail::inflate_brick(compressed, brick_data);
+        detail::unpack_brick(*chunk, brick, brick_data, images, num_images);
+        restored.set(brick);
+        ++num_records;
+    };
+    while (file.peek() != fstream::traits_type::eof()) {
+        uint16_t brick = 0;
+        uint32_t size = 0;
+        file >= brick >= size;
+        if (committed && brick == COMMIT_RECORD) {
+            uint64_t edit_sequence = 0;
+            file >= edit_sequence;
+            if (!file || size != sizeof(edit_sequence)) {
+                LOG(error) << "Discarding torn record of "
+                           << chunk_filename(chunk);
+                torn = true;
+                break;
+            }
+            // The batch was synced before its commit record was written.
+            for (const auto &record : batch) {
+                restore_brick(record.first, record.second);
+            }
+            batch.clear();
+            data.edit_sequence = edit_sequence;
+            continue;
+        }
+        string compressed(size, '\0');
+        file.read(&compressed[0], size);
+        if (!file || brick >= chunk->num_bricks() || data.uniform) {
+            LOG(error) << "Discarding torn record of " << chunk_filename(chunk);
+            torn = true;
+            break;
+        }
+        if (committed) {
+            batch.emplace_back(brick, move(compressed));
+            continue;
+        }
+        try {
+            restore_brick(brick, compressed);
+        } catch (const exception &) {
+            // Appended in place, the last record may be complete in size,
+            // but not in contents. Anything before it is synced though.
+            if (file.peek() != fstream::traits_type::eof()) {
+                throw;
+            }
+            LOG(error) << "Discarding torn record of " << chunk_filename(chunk);
+            torn = true;
+            break;
+        }
+    }
+    if (!batch.empty()) {
+        LOG(error) << "Discarding " << batch.size()
+                   << " uncommitted records of " << chunk_filename(chunk);
+        torn = true;
+    }
+    if (!data.uniform && !restored.all()) {
+        throw runtime_error(chunk_filename(chunk) + " misses some bricks");
+    }
+    // Nothing can be appended after a torn record, nor to an older archive,
+    // which is rewritten in the current version instead.
+    chunk->archived_records =
+            torn || header.version != ARCHIVE_VERSION ? 0 : num_records;
+    return data;
+}
 
+compute::wait_list SceneArchive::upload(const shared_ptr<Chunk> &chunk,
+                                        const ChunkData &data) {
+    compute::wait_list events;
+    if (data.uniform) {
+        lock_guard<mutex> chunk_lock(chunk->mutex);
+        chunk->make_uniform(data.uniform_sample, data.uniform_material);
+        chunk->dirty_bricks.reset();
+        chunk->edit_sequence = data.edit_sequence;
+        LOG(trace) << "Restored uniform " << chunk_filename(chunk);
+        return events;
+    }
     lock_guard<mutex> queue_lock(m_queue_mutex);
     lock_guard<mutex> chunk_lock(chunk->mutex);
-    enqueue_write_image3d(m_copy_queue, chunk->samples, samples.data());
-    enqueue_write_image3d(m_copy_queue, chunk->edges_x, edges_x.data());
-    enqueue_write_image3d(m_copy_queue, chunk->edges_y, edges_y.data());
-    enqueue_write_image3d(m_copy_queue, chunk->edges_z, edges_z.data());
-    m_copy_queue.finish();
+    if (!chunk->has_volume()) {
+        chunk->alloc_volume(m_copy_queue.get_context());
+    }
+    chunk->dirty_bricks.reset();
+    chunk->edit_sequence = data.edit_sequence;
+    events.insert(enqueue_write_image3d_async(
+            m_copy_queue, chunk->samples, data.samples.data()));
+    events.insert(enqueue_write_image3d_async(
+            m_copy_queue, chunk->edges_x, data.edges_x.data()));
+    events.insert(enqueue_write_image3d_async(
+            m_copy_queue, chunk->edges_y, data.edges_y.data()));
+    events.insert(enqueue_write_image3d_async(
+            m_copy_queue, chunk->edges_z, data.edges_z.data()));
+    events.insert(enqueue_write_image3d_async(
+            m_copy_queue, chunk->materials, data.materials.data()));
+    m_copy_queue.flush();
 
     LOG(trace) << "Restored " << chunk_filename(chunk);
+    return events;
+}
+
+ChunkData SceneArchive::load(const shared_ptr<Chunk> &chunk) {
+    lock_guard<mutex> archive_lock(chunk->archive_mutex);
+    return read(chunk);
+}
+
+void SceneArchive::restore(shared_ptr<Chunk> chunk) {
+    lock_guard<mutex> archive_lock(chunk->archive_mutex);
+    const ChunkData data = read(chunk);
+    upload(chunk, data).wait();
 }
 
 } // namespace vm
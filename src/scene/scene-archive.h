@@ -6,9 +6,12 @@
 #include <set>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include "compute/context.h"
 #include "scene/chunk.h"
+#include "scene/edit-journal.h"
+#include "scene/volume-params.h"
 #include "utils/thread-pool.h"
 
 #include <glm/glm.hpp>
@@ -25,30 +28,121 @@ struct ivec3_comparator {
 
 typedef std::set<glm::ivec3, detail::ivec3_comparator> CoordSet;
 
+/** Contents of a chunk file, inflated */
+struct ChunkData {
+    bool uniform;
+    int16_t uniform_sample;
+    uint8_t uniform_material;
+    /* Sequence number of the last edit the chunk was persisted with */
+    uint64_t edit_sequence;
+    std::vector<uint8_t> samples;
+    std::vector<uint8_t> edges_x;
+    std::vector<uint8_t> edges_y;
+    std::vector<uint8_t> edges_z;
+    std::vector<uint8_t> materials;
+};
+
 class SceneArchive {
     std::string m_workdir;
-    std::mutex m_jobs_mutex;
-    std::map<std::shared_ptr<Chunk>, Job> m_jobs;
+    VolumeParams m_params;
+    /* Chunks modified since they were last written to the archive */
+    std::mutex m_dirty_mutex;
+    std::set<std::shared_ptr<Chunk>> m_dirty;
     ThreadPool m_thread_pool;
-    mutable CoordSet m_chunk_coords;
+    EditJournal m_journal;
+    mutable std::mutex m_coords_mutex;
+    CoordSet m_chunk_coords;
+    /* Chunks whose files failed to be read, which are never overwritten */
+    CoordSet m_unreadable_coords;
 
     compute::command_queue m_copy_queue;
     std::mutex m_queue_mutex;
 
+    /** Creates @p directory if needed. @returns the @p directory */
+    static std::string prepare_workdir(const std::string &directory);
     void discover_chunk_coords();
+    /**
+     * Reads parameters of the volume the archive was created with, or records
+     * the @p params if it is a new one.
+     */
+    void init_params(const VolumeParams &params);
     std::string chunk_filename(const std::shared_ptr<Chunk> &chunk) const;
+    /** Reads back the chunk's volume and writes it out synchronously */
+    void persist(const std::shared_ptr<Chunk> &chunk);
+
+    /**
+     * Reads the chunk's file, with its archive_mutex already locked. A file
+     * that fails to be read is marked unreadable.
+     */
+    ChunkData read(const std::shared_ptr<Chunk> &chunk);
+    ChunkData read_file(const std::shared_ptr<Chunk> &chunk);
 
 public:
     SceneArchive(const SceneArchive &) = delete;
     SceneArchive &operator=(const SceneArchive &) = delete;
 
-    /** Creates / opens an archive at the specified directory */
+    /**
+     * Creates / opens an archive at the specified directory. The @p params
+     * apply to a new archive only, an existing one keeps those it was created
+     * with.
+     */
     SceneArchive(const std::string &directory,
-                 const std::shared_ptr<ComputeContext> &compute_ctx);
+                 const std::shared_ptr<ComputeContext> &compute_ctx,
+                 const VolumeParams &params);
     ~SceneArchive();
+    /** @returns parameters of the archived volume */
+    inline const VolumeParams &params() const {
+        return m_params;
+    }
     /** Gets the set of chunks available in the archive */
-    const CoordSet &get_chunk_coords() const;
-    void persist_later(std::shared_ptr<Chunk> chunk);
+    CoordSet get_chunk_coords() const;
+    /** @returns true if the chunk at @p coord is available in the archive */
+    bool contains(const glm::ivec3 &coord) const;
+    /**
+     * @returns false if the file of the chunk at @p coord failed to be read.
+     * Such a chunk must not be edited, as the archive keeps its file intact
+     * rather than persisting the chunk over it.
+     */
+    bool is_readable(const glm::ivec3 &coord) const;
+    /** @returns journal of edits that are not checkpointed yet */
+    inline EditJournal &journal() {
+        return m_journal;
+    }
+    /**
+     * Marks @p chunk as modified. Its file is rewritten only on the next
+     * checkpoint() or flush(), until then the edit journal is what makes the
+     * modification durable.
+     */
+    void mark_dirty(const std::shared_ptr<Chunk> &chunk);
+    /**
+     * Synchronously persists @p chunk if it is dirty, so that the archive is up
+     * to date once this returns.
+     */
+    void flush(const std::shared_ptr<Chunk> &chunk);
+    /**
+     * Persists all dirty chunks (in parallel), and truncates the journal once
+     * all of them are written.
+     */
+    void checkpoint();
+    /**
+     * Reads and inflates the file of the @p chunk. Involves no device work, so
+     * many chunks may be loaded concurrently.
+     */
+    ChunkData load(const std::shared_ptr<Chunk> &chunk);
+
+    /**
+     * Enqueues writes of the @p data into the @p chunk's volume, allocating it
+     * when needed, or makes the chunk uniform if that's how it was stored.
+     * NOTE: both the @p data and the chunk's volume must not be touched until
+     * the returned events complete.
+     */
+    compute::wait_list upload(const std::shared_ptr<Chunk> &chunk,
+                              const ChunkData &data);
+
+    /**
+     * Loads @p chunk from the archive, allocating its volume when needed, or
+     * making it uniform if that's how it was stored.
+     */
     void restore(std::shared_ptr<Chunk> chunk);
 };
 
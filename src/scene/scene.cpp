@@ -4,6 +4,10 @@
 
 #include "compute/interop.h"
 
+#include "math/frustum.h"
+
+#include "scene/brush-composite.h"
+
 #include "utils/log.h"
 #include "utils/persistence.h"
 
@@ -11,6 +15,10 @@
 #include <glm/gtx/norm.hpp>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 
 #include <cstring>
 
@@ -18,42 +26,294 @@ using namespace std;
 using namespace glm;
 namespace vm {
 
-#define CHUNK_WORLD_SIZE (VM_CHUNK_SIZE * VM_VOXEL_SIZE)
+/* Chunks further than that (in chunks) are rendered at coarser detail */
+#define LOD_DISTANCE 4
+/* Each cell of the coarse culling grid spans 2^CELL_SHIFT chunks per axis */
+#define CELL_SHIFT 3
+/* Number of journaled edits after which dirty chunks are written out */
+#define JOURNAL_CHECKPOINT_SIZE 256
 
-namespace {
-size_t coord_hash(const ivec3 &coord) {
-    enum { HASH_COEFF = 1024 };
-    return coord.x + HASH_COEFF * (coord.y + HASH_COEFF * coord.z);
+void Scene::init_persisted_chunks() {
+    const ivec3 center = get_chunk_coord(m_camera->get_origin());
+    vector<ivec3> coords;
+    for (const ivec3 &coord : m_archive.get_chunk_coords()) {
+        if (!m_chunks.find(coord) && m_archive.is_readable(coord)) {
+            coords.push_back(coord);
+        }
+    }
+    sort(coords.begin(), coords.end(), [&](const ivec3 &lhs, const ivec3 &rhs) {
+        return length2(vec3(lhs - center)) < length2(vec3(rhs - center));
+    });
+    load_chunks(coords);
+}
+
+void Scene::load_chunks(const vector<ivec3> &coords) {
+    const auto start = chrono::steady_clock::now();
+    vector<shared_ptr<Chunk>> chunks;
+    for (const ivec3 &coord : coords) {
+        chunks.push_back(get_or_create_chunk(coord, false));
+    }
+
+    // Files are read and inflated by the load pool, in the order of chunks,
+    // but at most a few at a time per thread so that memory stays bounded.
+    struct Loaded {
+        shared_ptr<Chunk> chunk;
+        /* Empty if loading failed */
+        shared_ptr<ChunkData> data;
+    };
+    mutex loaded_mutex;
+    condition_variable loaded_cv;
+    deque<Loaded> loaded;
+    const size_t max_in_flight = 2 * m_load_pool_size;
+    size_t num_submitted = 0;
+    size_t num_in_flight = 0;
+    auto submit = [&]() {
+        while (num_submitted < chunks.size() && num_in_flight < max_in_flight) {
+            auto chunk = chunks[num_submitted++];
+            ++num_in_flight;
+            m_load_pool.enqueue([&, chunk]() {
+                shared_ptr<ChunkData> data;
+                try {
+                    data = make_shared<ChunkData>(m_archive.load(chunk));
+                } catch (exception &e) {
+                    LOG(error) << "Cannot load chunk (" << chunk->coord.x
+                               << ',' << chunk->coord.y << ','
+                               << chunk->coord.z << "): " << e.what();
+                }
+                lock_guard<mutex> loaded_lock(loaded_mutex);
+                loaded.push_back(Loaded{ chunk, data });
+                loaded_cv.notify_one();
+            });
+        }
+    };
+
+    // Meanwhile, each loaded chunk is uploaded on the archive's copy queue,
+    // while the previously uploaded one is being meshed.
+    Loaded uploading;
+    compute::wait_list upload_events;
+    size_t num_failed = 0;
+    try {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            Loaded next;
+            {
+                unique_lock<mutex> loaded_lock(loaded_mutex);
+                submit();
+                loaded_cv.wait(loaded_lock, [&]() { return !loaded.empty(); });
+                next = move(loaded.front());
+                loaded.pop_front();
+                --num_in_flight;
+            }
+            if (!next.data) {
+                // Rather than keeping an empty chunk in its place, which
+                // would look as if the archived volume was gone.
+                drop_chunk(next.chunk);
+                ++num_failed;
+                continue;
+            }
+            compute::wait_list next_events = m_archive.upload(next.chunk,
+                                                              *next.data);
+            if (uploading.chunk) {
+                upload_events.wait();
+                mesh_loaded_chunk(uploading.chunk);
+                enforce_memory_budget({ uploading.chunk });
+            }
+            uploading = move(next);
+            upload_events = move(next_events);
+        }
+        if (uploading.chunk) {
+            upload_events.wait();
+            mesh_loaded_chunk(uploading.chunk);
+            enforce_memory_budget({ uploading.chunk });
+        }
+    } catch (...) {
+        // Pending jobs refer to the locals above, let them finish first.
+        unique_lock<mutex> loaded_lock(loaded_mutex);
+        loaded_cv.wait(loaded_lock,
+                       [&]() { return loaded.size() == num_in_flight; });
+        throw;
+    }
+    if (num_failed) {
+        LOG(error) << num_failed << " chunks could not be loaded, their files "
+                   << "are left intact and they can't be edited";
+    }
+    LOG(info) << "Loaded " << chunks.size() - num_failed << " chunks in "
+              << chrono::duration_cast<chrono::milliseconds>(
+                         chrono::steady_clock::now() - start)
+                         .count()
+              << "ms";
 }
 
-size_t chunk_hash(const shared_ptr<Chunk> &chunk) {
-    return coord_hash(chunk->coord);
+ivec3 Scene::get_cell_coord(const ivec3 &chunk_coord) {
+    // Arithmetic shift, so that it rounds towards negative infinity.
+    return chunk_coord >> CELL_SHIFT;
 }
-} // namespace
 
-void Scene::init_persisted_chunks() {
-    for (const ivec3 &coord : m_archive.get_chunk_coords()) {
-        auto chunk = make_shared<Chunk>(coord, m_compute_ctx->context);
-        m_chunks.emplace(chunk_hash(chunk), chunk);
-        m_archive.restore(chunk);
+AABB Scene::get_chunk_aabb(const ivec3 &coord) const {
+    // Samples (and so vertices) extend a bit beyond the chunk itself.
+    const VolumeParams &params = m_archive.params();
+    const vec3 half_size(0.5 * (params.chunk_size + 3) * params.voxel_size);
+    const vec3 origin = get_chunk_origin(coord);
+    return AABB(origin - half_size, origin + half_size);
+}
+
+int Scene::select_lod(const Chunk &chunk) const {
+    // Every next level of detail starts twice as far as the previous one.
+    const float distance = glm::distance(m_camera->get_origin(),
+                                         get_chunk_origin(chunk.coord));
+    int lod = 0;
+    float lod_distance = LOD_DISTANCE * m_archive.params().chunk_world_size();
+    while (lod < VM_LOD_LEVELS - 1 && distance > lod_distance) {
+        lod_distance *= 2;
+        ++lod;
+    }
+    return lod;
+}
+
+ivec3 Scene::get_chunk_coord(const vec3 &position) const {
+    // Chunk origin lies in its center.
+    return ivec3(
+            round(position / float(m_archive.params().chunk_world_size())));
+}
+
+shared_ptr<Chunk> Scene::get_or_create_chunk(const ivec3 &coord,
+                                             bool restore) {
+    bool created = false;
+    shared_ptr<Chunk> chunk;
+    {
+        lock_guard<mutex> chunks_lock(m_chunks_mutex);
+        chunk = m_chunks.get_or_create(coord, [&]() {
+            created = true;
+            return make_shared<Chunk>(coord, m_archive.params());
+        });
+        if (created) {
+            m_cells.get_or_create(get_cell_coord(coord), []() {
+                       return vector<Chunk *>();
+                   }).push_back(chunk.get());
+            ++m_chunks_generation;
+            LOG(trace) << "Created chunk (" << coord.x << ',' << coord.y << ','
+                       << coord.z << "), number of chunks: " << m_chunks.size();
+        }
+    }
+    if (created && restore && m_archive.contains(coord)) {
+        try {
+            m_archive.restore(chunk);
+        } catch (...) {
+            // Left empty, it would look as if the archived volume was gone.
+            drop_chunk(chunk);
+            throw;
+        }
+        mesh_loaded_chunk(chunk);
+    }
+    return chunk;
+}
+
+void Scene::mesh_loaded_chunk(const shared_ptr<Chunk> &chunk) {
+    if (chunk->uniform) {
+        return;
+    }
+    {
+        // Mesher works on queues of its own.
+        lock_guard<mutex> chunk_lock(chunk->mutex);
         m_mesher.contour(*chunk);
     }
+    queue_uploads({ chunk });
+    m_residency.touch(chunk);
+}
+
+void Scene::unload_chunk(const shared_ptr<Chunk> &chunk) {
+    // Make sure the archive has the latest data before dropping it.
+    m_archive.flush(chunk);
+    drop_chunk(chunk);
+    LOG(trace) << "Unloaded chunk (" << chunk->coord.x << ','
+               << chunk->coord.y << ',' << chunk->coord.z << ')';
+}
+
+void Scene::drop_chunk(const shared_ptr<Chunk> &chunk) {
+    m_residency.forget(chunk);
+    {
+        lock_guard<mutex> chunks_lock(m_chunks_mutex);
+        m_chunks.erase(chunk->coord);
+        const ivec3 cell_coord = get_cell_coord(chunk->coord);
+        vector<Chunk *> &cell = *m_cells.find(cell_coord);
+        cell.erase(find(cell.begin(), cell.end(), chunk.get()));
+        if (cell.empty()) {
+            m_cells.erase(cell_coord);
+        }
+        ++m_chunks_generation;
+    }
+    // GL buffers of the chunk must be released by the thread owning GL
+    // context, and the renderer may still refer to the chunk.
+    lock_guard<mutex> retired_lock(m_retired_mutex);
+    m_retired_chunks.push_back(chunk);
+}
+
+void Scene::stream(const ivec3 &center, int radius) {
+    if (!radius) {
+        init_persisted_chunks();
+        return;
+    }
+    // Unload first, so that there is more room for the loaded ones.
+    const float unload_distance = radius + 1.0f;
+    vector<shared_ptr<Chunk>> far_chunks;
+    m_chunks.for_each([&](const ivec3 &coord, const shared_ptr<Chunk> &chunk) {
+        if (length(vec3(coord - center)) > unload_distance) {
+            far_chunks.push_back(chunk);
+        }
+    });
+    for (const auto &chunk : far_chunks) {
+        unload_chunk(chunk);
+    }
+
+    vector<ivec3> near_coords;
+    for (int z = center.z - radius; z <= center.z + radius; ++z) {
+        for (int y = center.y - radius; y <= center.y + radius; ++y) {
+            for (int x = center.x - radius; x <= center.x + radius; ++x) {
+                const ivec3 coord{ x, y, z };
+                if (length(vec3(coord - center)) <= radius
+                    && !m_chunks.find(coord) && m_archive.contains(coord)
+                    && m_archive.is_readable(coord)) {
+                    near_coords.push_back(coord);
+                }
+            }
+        }
+    }
+    sort(near_coords.begin(),
+         near_coords.end(),
+         [&](const ivec3 &lhs, const ivec3 &rhs) {
+             return length2(vec3(lhs - center)) < length2(vec3(rhs - center));
+         });
+    load_chunks(near_coords);
+    LOG(trace) << "Streamed around (" << center.x << ',' << center.y << ','
+               << center.z << "): loaded " << near_coords.size()
+               << ", unloaded " << far_chunks.size() << " chunks";
+}
+
+void Scene::queue_uploads(const vector<shared_ptr<Chunk>> &chunks) {
+    if (!m_compute_ctx->gl_shared) {
+        // Headless, there are no GL buffers to upload to.
+        return;
+    }
+    lock_guard<mutex> lock(m_uploads_mutex);
+    m_pending_uploads.insert(
+            m_pending_uploads.end(), chunks.begin(), chunks.end());
 }
 
 void Scene::get_covered_region(const AABB &aabb,
                                ivec3 &out_min,
                                ivec3 &out_max) {
+    const double chunk_world_size = m_archive.params().chunk_world_size();
+    const double margin = m_archive.params().brush_margin();
     // Not 0.5, due to lack of precision and artifacts caused by it.
-    const vec3 min = aabb.min + float(0.45 * CHUNK_WORLD_SIZE);
-    const vec3 max = aabb.max - float(0.45 * CHUNK_WORLD_SIZE);
+    const vec3 min = aabb.min - float(margin) + float(0.45 * chunk_world_size);
+    const vec3 max = aabb.max + float(margin) - float(0.45 * chunk_world_size);
     out_min = ivec3(INT_MAX, INT_MAX, INT_MAX);
     out_max = ivec3(INT_MIN, INT_MIN, INT_MIN);
 
     for (size_t i = 0; i < 3; ++i) {
         out_min[i] =
-                std::min(out_min[i], (int) floor(min[i] / CHUNK_WORLD_SIZE));
+                std::min(out_min[i], (int) floor(min[i] / chunk_world_size));
         out_max[i] =
-                std::max(out_max[i], (int) ceil(max[i] / CHUNK_WORLD_SIZE));
+                std::max(out_max[i], (int) ceil(max[i] / chunk_world_size));
     }
 }
 
@@ -63,102 +323,433 @@ compute::image_format Scene::samples_format() {
 }
 
 compute::image_format Scene::edges_format() {
+#if defined(WITH_COMPACT_EDGES)
+    // Packed normal and crossing, see encode_edge() in media/kernels/utils.h.
+    return compute::image_format(compute::image_format::r,
+                                 compute::image_format::unsigned_int32);
+#else
     return compute::image_format(compute::image_format::rgba,
                                  compute::image_format::float16);
+#endif
+}
+
+compute::image_format Scene::materials_format() {
+    return compute::image_format(compute::image_format::r,
+                                 compute::image_format::unsigned_int8);
 }
 
 Scene::Scene(const shared_ptr<ComputeContext> &compute_ctx,
              const shared_ptr<Camera> &camera,
-             const string &scene_directory)
+             const string &scene_directory,
+             const VolumeParams &params)
         : m_compute_ctx(compute_ctx)
         , m_camera(camera)
+        , m_chunks_mutex()
         , m_chunks()
-        , m_archive(scene_directory, compute_ctx)
-        , m_sampler(compute_ctx)
-        , m_mesher(compute_ctx)
-        , m_last_sampling_point(NAN, NAN, NAN) {
-    init_persisted_chunks();
+        , m_cells()
+        , m_chunks_generation(0)
+        , m_render_list()
+        , m_render_view_proj(NAN)
+        , m_render_generation(0)
+        , m_archive(scene_directory, compute_ctx, params)
+        , m_residency(size_t(VM_GPU_MEMORY_BUDGET) << 20)
+        , m_sampler(compute_ctx, m_archive.params())
+        , m_mesher(compute_ctx, m_archive.params())
+        , m_last_brush()
+        , m_last_operation(dc::Sampler::Operation::Add)
+        , m_uploads_mutex()
+        , m_pending_uploads()
+        , m_retired_mutex()
+        , m_retired_chunks()
+        , m_streaming_radius(VM_STREAMING_RADIUS)
+        , m_streamed_radius(-1)
+        , m_streamed_center()
+        , m_streaming(false)
+        , m_load_pool_size(std::max(1u, thread::hardware_concurrency()))
+        , m_load_pool(m_load_pool_size)
+        , m_edit_thread(1) {
+    if (!m_residency.budget()) {
+        m_residency.set_budget(
+                compute_ctx->context.get_device().global_memory_size() / 2);
+    }
+    LOG(info) << "Chunk volumes memory budget (MB): "
+              << (m_residency.budget() / double(1 << 20));
+    if (!m_streaming_radius) {
+        init_persisted_chunks();
+        m_streamed_radius = 0;
+    }
+    replay_journal();
+}
+
+Scene::~Scene() {
+    m_edit_thread.terminate();
+    try {
+        m_archive.checkpoint();
+    } catch (const exception &e) {
+        LOG(error) << "Cannot checkpoint the scene: " << e.what();
+    }
+}
+
+void Scene::replay_journal() {
+    if (!m_archive.journal().size()) {
+        return;
+    }
+    // Chunks persisted since the last checkpoint have some of the edits
+    // already, which must not be applied to them again: blended ones would
+    // blend twice.
+    m_archive.journal().replay([this](const Brush &brush,
+                                      dc::Sampler::Operation operation,
+                                      uint64_t sequence) {
+        apply_edit(brush, operation, sequence);
+    });
+    m_archive.checkpoint();
 }
 
-vec3 Scene::get_chunk_origin(const ivec3 &coord) {
-    return vec3(CHUNK_WORLD_SIZE * dvec3(coord));
+vec3 Scene::get_chunk_origin(const ivec3 &coord) const {
+    return m_archive.params().chunk_origin(coord);
 }
 
 void Scene::init_chunk(const shared_ptr<Chunk> &chunk) {
+    lock_guard<mutex> chunk_lock(chunk->mutex);
     lock_guard<mutex> queue_lock(m_compute_ctx->queue_mutex);
-    const compute::short4_ fill_color(2, 2, 2, 2);
+    const int16_t value = chunk->uniform_sample;
+    const cl_uint material = chunk->uniform_material;
+    chunk->alloc_volume(m_compute_ctx->context);
+    const compute::short4_ fill_color(value, value, value, value);
     m_compute_ctx->queue.enqueue_fill_image<3>(chunk->samples,
                                                &fill_color,
                                                compute::dim(0, 0, 0),
                                                chunk->samples.size());
+    const compute::uint4_ fill_material(material, material, material, material);
+    m_compute_ctx->queue.enqueue_fill_image<3>(chunk->materials,
+                                               &fill_material,
+                                               compute::dim(0, 0, 0),
+                                               chunk->materials.size());
+}
+
+void Scene::make_resident(const shared_ptr<Chunk> &chunk) {
+    if (chunk->uniform) {
+        init_chunk(chunk);
+        LOG(trace) << "Promoted uniform chunk (" << chunk->coord.x << ','
+                   << chunk->coord.y << ',' << chunk->coord.z << ')';
+    } else if (chunk->is_evicted()) {
+        m_archive.restore(chunk);
+        LOG(trace) << "Restored evicted chunk (" << chunk->coord.x << ','
+                   << chunk->coord.y << ',' << chunk->coord.z << ')';
+    }
+    m_residency.touch(chunk);
+}
+
+void Scene::enforce_memory_budget(const vector<shared_ptr<Chunk>> &pinned) {
+    for (const auto &victim : m_residency.select_victims(pinned)) {
+        // Make sure the archive has the latest data before dropping it.
+        m_archive.flush(victim);
+        lock_guard<mutex> chunk_lock(victim->mutex);
+        victim->free_volume();
+        LOG(trace) << "Evicted chunk (" << victim->coord.x << ','
+                   << victim->coord.y << ',' << victim->coord.z << ')';
+    }
+}
+
+void Scene::set_memory_budget(size_t bytes) {
+    m_edit_thread.enqueue([this, bytes]() {
+        m_residency.set_budget(bytes);
+        enforce_memory_budget();
+    });
+}
+
+namespace {
+/* @returns true if @p operation can't change a chunk uniformly at @p sample */
+bool is_noop(int16_t sample, dc::Sampler::Operation operation) {
+    switch (operation) {
+    case dc::Sampler::Operation::Add: return sample < 0;
+    case dc::Sampler::Operation::Sub: return sample > 0;
+    }
+    return false;
 }
 
+bool is_same_edit(const Brush &lhs,
+                  dc::Sampler::Operation lhs_operation,
+                  const Brush &rhs,
+                  dc::Sampler::Operation rhs_operation) {
+    return lhs_operation == rhs_operation && lhs.id() == rhs.id()
+           && lhs.get_origin() == rhs.get_origin()
+           && lhs.get_rotation() == rhs.get_rotation()
+           && lhs.get_scale() == rhs.get_scale()
+           && lhs.material() == rhs.material()
+           && (lhs.id() != Brush::Id::Composite
+               || static_cast<const BrushComposite &>(lhs).get_program()
+                          == static_cast<const BrushComposite &>(rhs)
+                                     .get_program());
+}
+} // namespace
+
 void Scene::sample(const Brush &brush, dc::Sampler::Operation operation) {
-    if (m_last_sampling_point == brush.get_origin()) {
+    // Holding a brush still repeats the same edit, which changes nothing.
+    if (m_last_brush
+        && is_same_edit(*m_last_brush, m_last_operation, brush, operation)) {
         return;
-    } else {
-        m_last_sampling_point = brush.get_origin();
     }
+    m_last_brush = brush.clone();
+    m_last_operation = operation;
+    // Make the edit durable before applying it, chunk files are only updated
+    // at checkpoints.
+    const uint64_t sequence = m_archive.journal().append(brush, operation);
+    apply_edit(brush, operation, sequence);
+    if (m_archive.journal().size() >= JOURNAL_CHECKPOINT_SIZE) {
+        m_archive.checkpoint();
+    }
+}
 
+void Scene::apply_edit(const Brush &brush,
+                       dc::Sampler::Operation operation,
+                       uint64_t sequence) {
     ivec3 region_min;
     ivec3 region_max;
     get_covered_region(brush.get_aabb(), region_min, region_max);
+    vector<shared_ptr<Chunk>> touched;
 
     for (int z = region_min.z; z <= region_max.z; ++z) {
         for (int y = region_min.y; y <= region_max.y; ++y) {
             for (int x = region_min.x; x <= region_max.x; ++x) {
-                const ivec3 coord{ x, y, z };
-                if (m_chunks.find(coord_hash(coord)) == m_chunks.end()) {
-                    auto chunk =
-                            make_shared<Chunk>(coord, m_compute_ctx->context);
-                    m_chunks.emplace(chunk_hash(chunk), chunk);
-                    init_chunk(chunk);
-                    LOG(trace) << "Created chunk (" << x << ',' << y << ',' << z
-                               << "), number of chunks: " << m_chunks.size();
+                if (!m_archive.is_readable({ x, y, z })) {
+                    continue;
+                }
+                shared_ptr<Chunk> chunk;
+                try {
+                    chunk = get_or_create_chunk({ x, y, z });
+                } catch (const exception &e) {
+                    LOG(error) << "Not editing chunk (" << x << ',' << y
+                               << ',' << z << "): " << e.what();
+                    continue;
+                }
+                // Persisted with the edit before the journal was replayed.
+                if (chunk->edit_sequence >= sequence) {
+                    continue;
                 }
-                auto chunk = m_chunks[coord_hash(coord)];
-                {
-                    lock_guard<mutex> chunk_lock(chunk->mutex);
-                    lock_guard<mutex> queue_lock(m_compute_ctx->queue_mutex);
-                    m_sampler.sample(*chunk, brush, operation);
-                    m_mesher.contour(*chunk);
+                if (chunk->uniform
+                    && is_noop(chunk->uniform_sample, operation)) {
+                    continue;
                 }
+                make_resident(chunk);
+                touched.push_back(chunk);
+            }
+        }
+    }
+    if (touched.empty()) {
+        return;
+    }
 
-                // Queue this modified chunk to be persisted on the next
-                // occassion
-                m_archive.persist_later(chunk);
+    // Whole batch is sampled with just a single synchronization point, and
+    // classified with a single read back.
+    vector<unique_lock<mutex>> chunk_locks;
+    vector<Chunk *> batch;
+    for (const auto &chunk : touched) {
+        chunk_locks.emplace_back(chunk->mutex);
+        batch.push_back(chunk.get());
+    }
+    vector<boost::optional<dc::Sampler::Uniform>> uniform_values;
+    vector<Chunk *> to_mesh;
+    {
+        lock_guard<mutex> queue_lock(m_compute_ctx->queue_mutex);
+        m_sampler.sample(batch, brush, operation);
+        uniform_values = m_sampler.uniform_values(batch);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->edit_sequence = sequence;
+            if (uniform_values[i]) {
+                batch[i]->make_uniform(uniform_values[i]->sample,
+                                       uniform_values[i]->material);
+            } else {
+                to_mesh.push_back(batch[i]);
             }
         }
+        m_compute_ctx->queue.finish();
     }
-    lock_guard<mutex> queue_lock(m_compute_ctx->queue_mutex);
-    m_compute_ctx->queue.finish();
+    // Meshing doesn't need the shared queue, so the chunks are meshed
+    // concurrently while other work goes on.
+    if (!to_mesh.empty()) {
+        m_mesher.contour(to_mesh);
+    }
+    chunk_locks.clear();
+
+    for (size_t i = 0; i < touched.size(); ++i) {
+        if (uniform_values[i]) {
+            m_residency.forget(touched[i]);
+        }
+        m_archive.mark_dirty(touched[i]);
+    }
+    queue_uploads(touched);
+    enforce_memory_budget(touched);
+}
+
+future<void> Scene::sample_async(const Brush &brush,
+                                 dc::Sampler::Operation operation) {
+    // Brush is shared, since std::function needs a copyable callable.
+    shared_ptr<const Brush> copy(brush.clone());
+    auto task = make_shared<packaged_task<void()>>(
+            [this, copy, operation]() { sample(*copy, operation); });
+    future<void> result = task->get_future();
+    m_edit_thread.enqueue([task]() { (*task)(); });
+    return result;
 }
 
 void Scene::add(const Brush &brush) {
-    sample(brush, dc::Sampler::Operation::Add);
+    add_async(brush).get();
+    update();
 }
 
 void Scene::sub(const Brush &brush) {
-    sample(brush, dc::Sampler::Operation::Sub);
+    sub_async(brush).get();
+    update();
+}
+
+future<void> Scene::add_async(const Brush &brush) {
+    return sample_async(brush, dc::Sampler::Operation::Add);
+}
+
+future<void> Scene::sub_async(const Brush &brush) {
+    return sample_async(brush, dc::Sampler::Operation::Sub);
+}
+
+void Scene::read_meshes(int lod, const MeshVisitor &visitor) {
+    if (lod < 0 || lod >= VM_LOD_LEVELS) {
+        throw invalid_argument("No level of detail " + to_string(lod));
+    }
+    packaged_task<void()> task([this, lod, &visitor]() {
+        vector<shared_ptr<Chunk>> chunks;
+        {
+            lock_guard<mutex> chunks_lock(m_chunks_mutex);
+            m_chunks.for_each(
+                    [&](const ivec3 &, const shared_ptr<Chunk> &chunk) {
+                        chunks.push_back(chunk);
+                    });
+        }
+        sort(chunks.begin(),
+             chunks.end(),
+             [](const shared_ptr<Chunk> &lhs, const shared_ptr<Chunk> &rhs) {
+                 return detail::ivec3_comparator()(lhs->coord, rhs->coord);
+             });
+
+        vector<vec3> vertices;
+        vector<uint32_t> indices;
+        for (const auto &chunk : chunks) {
+            {
+                lock_guard<mutex> chunk_lock(chunk->mutex);
+                lock_guard<mutex> queue_lock(m_compute_ctx->queue_mutex);
+                m_mesher.download(chunk->meshes[lod], vertices, indices);
+            }
+            if (!indices.empty()) {
+                visitor(chunk->coord, vertices, indices);
+            }
+        }
+    });
+    future<void> result = task.get_future();
+    // The task outlives the job, since the result is waited for right below.
+    m_edit_thread.enqueue([&task]() { task(); });
+    result.get();
+}
+
+void Scene::update() {
+    vector<shared_ptr<Chunk>> pending;
+    {
+        lock_guard<mutex> lock(m_uploads_mutex);
+        swap(pending, m_pending_uploads);
+    }
+    vector<shared_ptr<Chunk>> busy;
+    for (const auto &chunk : pending) {
+        // Don't stall the frame on a chunk which is being edited right now,
+        // its mesh is going to change anyway.
+        unique_lock<mutex> chunk_lock(chunk->mutex, try_to_lock);
+        if (!chunk_lock.owns_lock()) {
+            busy.push_back(chunk);
+            continue;
+        }
+        m_mesher.upload(*chunk);
+        ++m_chunks_generation;
+    }
+    if (!busy.empty()) {
+        queue_uploads(busy);
+    }
+    pending.clear();
+
+    {
+        // Chunks still referenced elsewhere (e.g. by a finishing persist job)
+        // are left for the next call.
+        lock_guard<mutex> retired_lock(m_retired_mutex);
+        m_retired_chunks.erase(
+                remove_if(m_retired_chunks.begin(),
+                          m_retired_chunks.end(),
+                          [](const shared_ptr<Chunk> &chunk) {
+                              return chunk.use_count() == 1;
+                          }),
+                m_retired_chunks.end());
+    }
+
+    const ivec3 center = get_chunk_coord(m_camera->get_origin());
+    const bool moved = m_streaming_radius && center != m_streamed_center;
+    if ((moved || m_streaming_radius != m_streamed_radius)
+        && !m_streaming.exchange(true)) {
+        const int radius = m_streaming_radius;
+        m_streamed_center = center;
+        m_streamed_radius = radius;
+        m_edit_thread.enqueue([this, center, radius]() {
+            try {
+                stream(center, radius);
+            } catch (...) {
+                m_streaming = false;
+                throw;
+            }
+            m_streaming = false;
+        });
+    }
 }
 
-vector<const Chunk *> Scene::get_chunks_to_render() const {
-    vector<const Chunk *> chunks(m_chunks.size());
-    size_t index = 0;
-    for (const auto &chunk : m_chunks) {
-        chunks[index++] = chunk.second.get();
+void Scene::set_streaming_radius(int radius) {
+    m_streaming_radius = std::max(0, radius);
+}
+
+const vector<const Chunk *> &Scene::get_chunks_to_render() const {
+    const mat4 view_proj = m_camera->get_proj() * m_camera->get_view();
+    const uint64_t generation = m_chunks_generation.load();
+    if (view_proj == m_render_view_proj && generation == m_render_generation) {
+        return m_render_list;
     }
+    m_render_view_proj = view_proj;
+    m_render_generation = generation;
+    m_render_list.clear();
 
-    vec3 camera_origin = m_camera->get_origin();
-    auto chunk_comparator = [camera_origin](const Chunk *&lhs,
-                                            const Chunk *&rhs) {
+    const Frustum frustum(view_proj);
+    {
+        lock_guard<mutex> chunks_lock(m_chunks_mutex);
+        m_cells.for_each([&](const ivec3 &cell,
+                             const vector<Chunk *> &chunks) {
+            const ivec3 first = cell * (1 << CELL_SHIFT);
+            const ivec3 last = first + ((1 << CELL_SHIFT) - 1);
+            if (!frustum.intersects(AABB(get_chunk_aabb(first).min,
+                                         get_chunk_aabb(last).max))) {
+                return;
+            }
+            for (Chunk *chunk : chunks) {
+                if (!frustum.intersects(get_chunk_aabb(chunk->coord))) {
+                    continue;
+                }
+                chunk->lod = select_lod(*chunk);
+                if (chunk->meshes[chunk->lod].num_indices) {
+                    m_render_list.push_back(chunk);
+                }
+            }
+        });
+    }
+
+    // Front to back, to make the most of the early depth test.
+    const vec3 camera_origin = m_camera->get_origin();
+    auto chunk_comparator = [this, camera_origin](const Chunk *lhs,
+                                                  const Chunk *rhs) {
         return distance2(camera_origin, get_chunk_origin(lhs->coord))
                < distance2(camera_origin, get_chunk_origin(rhs->coord));
     };
-
-    sort(chunks.begin(), chunks.end(), chunk_comparator);
-    /* TODO: frustum culling */
-    return chunks;
+    sort(m_render_list.begin(), m_render_list.end(), chunk_comparator);
+    return m_render_list;
 }
 
 } // namespace vm
@@ -1,15 +1,20 @@
 #ifndef VM_SCENE_SCENE_H
 #define VM_SCENE_SCENE_H
 #include <array>
+#include <atomic>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
 #include <vector>
 
 #include "scene/brush.h"
 #include "scene/camera.h"
 #include "scene/chunk.h"
+#include "scene/chunk-index.h"
+#include "scene/residency.h"
 #include "scene/scene-archive.h"
 
 #include "compute/context.h"
@@ -29,54 +34,216 @@ class Scene {
 
     std::shared_ptr<ComputeContext> m_compute_ctx;
     std::shared_ptr<Camera> m_camera;
-    std::unordered_map<size_t, std::shared_ptr<Chunk>> m_chunks;
+    /* Modified only by the edit thread, guarded against the renderer */
+    mutable std::mutex m_chunks_mutex;
+    ChunkIndex<std::shared_ptr<Chunk>> m_chunks;
+    /* Coarse grid of chunks (see get_cell_coord()), used for culling */
+    ChunkIndex<std::vector<Chunk *>> m_cells;
+    /* Bumped whenever a chunk is created or its mesh changes */
+    std::atomic<uint64_t> m_chunks_generation;
+
+    /* Render list built for the view-projection / chunks generation below */
+    mutable std::vector<const Chunk *> m_render_list;
+    mutable glm::mat4 m_render_view_proj;
+    mutable uint64_t m_render_generation;
 
     SceneArchive m_archive;
+    ResidencyManager m_residency;
     /* Dual Contouring related classes */
     dc::Sampler m_sampler;
     dc::Mesher m_mesher;
-    /* Used to avoid sampling same point multiple times */
-    glm::vec3 m_last_sampling_point;
-
+    /* Used to avoid sampling the same edit multiple times */
+    std::unique_ptr<Brush> m_last_brush;
+    dc::Sampler::Operation m_last_operation;
+
+    /* Chunks whose meshes are waiting to be uploaded by update() */
+    std::mutex m_uploads_mutex;
+    std::vector<std::shared_ptr<Chunk>> m_pending_uploads;
+    /* Chunks dropped by the edit thread, released by update() */
+    std::mutex m_retired_mutex;
+    std::vector<std::shared_ptr<Chunk>> m_retired_chunks;
+
+    /* Radius (in chunks) chunks are loaded within, 0 - the whole scene */
+    int m_streaming_radius;
+    /* Parameters of the last streaming pass */
+    int m_streamed_radius;
+    glm::ivec3 m_streamed_center;
+    /* Set while a streaming pass is enqueued or running */
+    std::atomic<bool> m_streaming;
+
+    /* Reads and inflates chunk files while loading many of them */
+    size_t m_load_pool_size;
+    ThreadPool m_load_pool;
+    /* All edits are serialized on this thread, away from the render loop */
+    ThreadPool m_edit_thread;
+
+    /** Loads all archived chunks, nearest to the camera first */
     void init_persisted_chunks();
 
+    /** @returns coordinate of the coarse grid cell containing @p chunk_coord */
+    static glm::ivec3 get_cell_coord(const glm::ivec3 &chunk_coord);
+    /** @returns bounding box of the chunk at @p coord, in world space */
+    AABB get_chunk_aabb(const glm::ivec3 &coord) const;
+    /** @returns level of detail the @p chunk should be rendered at */
+    int select_lod(const Chunk &chunk) const;
+    /** @returns coordinate of the chunk containing @p position */
+    glm::ivec3 get_chunk_coord(const glm::vec3 &position) const;
+    /**
+     * Gets the chunk at @p coord creating it if it does not exist yet. Newly
+     * created chunks are restored from the archive if they are available
+     * there, unless @p restore is false.
+     */
+    std::shared_ptr<Chunk> get_or_create_chunk(const glm::ivec3 &coord,
+                                               bool restore = true);
+    /** Meshes the chunk which has just been restored from the archive */
+    void mesh_loaded_chunk(const std::shared_ptr<Chunk> &chunk);
+    /**
+     * Creates and loads chunks at @p coords from the archive, in the given
+     * order. Files are read in parallel, and uploading a chunk overlaps with
+     * meshing the previous one.
+     */
+    void load_chunks(const std::vector<glm::ivec3> &coords);
+    /** Persists and drops the @p chunk, to be loaded again when needed */
+    void unload_chunk(const std::shared_ptr<Chunk> &chunk);
+    /** Removes the @p chunk from the scene, without persisting it */
+    void drop_chunk(const std::shared_ptr<Chunk> &chunk);
+    /**
+     * Loads archived chunks within @p radius (in chunks) of the @p center
+     * chunk, nearest first, and unloads ones that got further away. Radius 0
+     * loads the whole archive.
+     */
+    void stream(const glm::ivec3 &center, int radius);
+
     /** Gets the region (in chunk coordinates) covered by the specified aabb */
     void get_covered_region(const AABB &region_aabb,
                             glm::ivec3 &region_min,
                             glm::ivec3 &region_max);
-    /** Initializes the chunk's volumetric data */
+    /** Initializes the chunk's volumetric data from its uniform sample */
     void init_chunk(const std::shared_ptr<Chunk> &chunk);
-    /** Performs sampling of the brush */
+    /**
+     * Ensures the chunk has dense volumetric data on the device (promoting
+     * uniform chunks and restoring evicted ones), and marks it as used.
+     */
+    void make_resident(const std::shared_ptr<Chunk> &chunk);
+    /** Evicts least recently used volumes until they fit in the budget */
+    void enforce_memory_budget(
+            const std::vector<std::shared_ptr<Chunk>> &pinned = {});
+    /** Applies edits left in the journal by the previous session */
+    void replay_journal();
+    /** Journals the edit of the brush, and applies it */
     void sample(const Brush &brush, dc::Sampler::Operation operation);
+    /**
+     * Performs sampling of the brush, as the edit of @p sequence number (see
+     * EditJournal), on the chunks that don't have it yet
+     */
+    void apply_edit(const Brush &brush,
+                    dc::Sampler::Operation operation,
+                    uint64_t sequence);
+    /** Enqueues sampling of the copy of @p brush on the edit thread */
+    std::future<void> sample_async(const Brush &brush,
+                                   dc::Sampler::Operation operation);
+    /** Schedules upload of the @p chunks meshes on the next update() */
+    void queue_uploads(const std::vector<std::shared_ptr<Chunk>> &chunks);
 
 public:
+    typedef std::function<void(const glm::ivec3 &coord,
+                               const std::vector<glm::vec3> &vertices,
+                               const std::vector<uint32_t> &indices)>
+            MeshVisitor;
+
     /** Returns world position of the chunk */
-    static glm::vec3 get_chunk_origin(const glm::ivec3 &coord);
+    glm::vec3 get_chunk_origin(const glm::ivec3 &coord) const;
 
     static compute::image_format samples_format();
     static compute::image_format edges_format();
+    static compute::image_format materials_format();
 
+    /**
+     * Opens the scene persisted in @p scene_directory, or creates a new one
+     * there. The volume @p params apply to a new scene only, an existing one
+     * keeps those it was created with (see params()).
+     */
     Scene(const std::shared_ptr<ComputeContext> &compute_ctx,
           const std::shared_ptr<Camera> &camera,
-          const std::string &scene_directory);
+          const std::string &scene_directory,
+          const VolumeParams &params = VolumeParams());
+
+    /** Waits for all pending edits to complete, and checkpoints them */
+    ~Scene();
 
     /**
-     * Samples @p brush over the scene adding its volume to it.
+     * Samples @p brush over the scene adding its volume to it, and uploads
+     * the resulting meshes. Must be called from the thread owning GL context.
      */
     void add(const Brush &brush);
 
     /**
-     * Samples @p brush over the scene subtracting its volume from it.
+     * Samples @p brush over the scene subtracting its volume from it, and
+     * uploads the resulting meshes. Must be called from the thread owning GL
+     * context.
      */
     void sub(const Brush &brush);
 
+    /**
+     * Enqueues adding the volume of @p brush to the scene. The brush is
+     * copied, so it may be modified right after the call. Resulting meshes
+     * become visible after the edit completes and update() is called.
+     *
+     * @returns future which is ready once the edit completes
+     */
+    std::future<void> add_async(const Brush &brush);
+
+    /** Same as add_async(), but subtracts the volume of @p brush */
+    std::future<void> sub_async(const Brush &brush);
+
+    /**
+     * Reads back meshes of all loaded chunks at the @p lod level of detail,
+     * after all previously enqueued edits, and calls @p visitor (from the
+     * edit thread) for each non-empty one, ordered by the chunk coordinates.
+     * Needs no GL, unlike rendering.
+     */
+    void read_meshes(int lod, const MeshVisitor &visitor);
+
+    /**
+     * Uploads meshes of the chunks modified by completed edits, and starts
+     * loading / unloading chunks if the camera has moved to another chunk.
+     * Must be called from the thread owning GL context, typically once per
+     * frame. Chunks being modified at the moment are left for the next call.
+     * Without GL sharing compute context meshes are never uploaded, but stay
+     * available to read_meshes().
+     */
+    void update();
+
+    /**
+     * Sets the radius (in chunks) around the camera within which chunks are
+     * kept loaded, 0 loads the whole scene. Takes effect on the next update().
+     */
+    void set_streaming_radius(int radius);
+
+    /**
+     * Sets the amount of device memory (in bytes) chunk volumes may occupy.
+     * Volumes above it are evicted to the archive, least recently used first.
+     * Takes effect after all previously enqueued edits.
+     */
+    void set_memory_budget(size_t bytes);
+
+    /** @returns parameters of the scene's volume */
+    inline const VolumeParams &params() const {
+        return m_archive.params();
+    }
+
     /** @returns the current camera. */
     inline const std::shared_ptr<Camera> get_camera() const {
         return m_camera;
     }
 
-    /** @returns chunks to be rendered */
-    std::vector<const Chunk *> get_chunks_to_render() const;
+    /**
+     * @returns non-empty chunks visible by the camera, nearest first, with
+     * their level of detail (Chunk::lod) selected by the distance. The list
+     * is rebuilt only if the camera or any chunk has changed since the
+     * previous call, and remains valid until the next one.
+     */
+    const std::vector<const Chunk *> &get_chunks_to_render() const;
 };
 
 } // namespace vm
@@ -0,0 +1,76 @@
+#include "volume-params.h"
+
+#include <boost/format.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std;
+using namespace glm;
+namespace vm {
+
+VolumeParams::VolumeParams() : VolumeParams(VM_CHUNK_SIZE, VM_VOXEL_SIZE) {}
+
+VolumeParams::VolumeParams(size_t chunk_size,
+                           double voxel_size,
+                           bool distance_samples,
+                           double blend_radius)
+        : chunk_size(chunk_size)
+        , voxel_size(voxel_size)
+        , distance_samples(distance_samples)
+        , blend_radius(blend_radius) {}
+
+void VolumeParams::validate() const {
+    static_assert(VM_LOD_LEVELS > 0, "at least one level of detail needed");
+    if (!chunk_size || chunk_size % VM_BRICK_SIZE) {
+        throw invalid_argument(
+                boost::str(boost::format("Chunk size %1% is not a multiple "
+                                         "of the brick size %2%")
+                           % chunk_size % VM_BRICK_SIZE));
+    }
+    if (chunk_size % (1 << (VM_LOD_LEVELS - 1))) {
+        throw invalid_argument(
+                boost::str(boost::format("Chunk size %1% is not divisible by "
+                                         "the coarsest voxel size %2%")
+                           % chunk_size % (1 << (VM_LOD_LEVELS - 1))));
+    }
+    const size_t bricks_per_axis = chunk_size / VM_BRICK_SIZE;
+    // Archived brick records index bricks with 16 bits.
+    if (bricks_per_axis * bricks_per_axis * bricks_per_axis > UINT16_MAX) {
+        throw invalid_argument(
+                boost::str(boost::format("Chunk size %1% is too big")
+                           % chunk_size));
+    }
+    if (!isfinite(voxel_size) || voxel_size <= 0) {
+        throw invalid_argument(
+                boost::str(boost::format("Invalid voxel size %1%")
+                           % voxel_size));
+    }
+    if (!isfinite(blend_radius) || blend_radius < 0
+        || (blend_radius > 0 && !distance_samples)) {
+        throw invalid_argument(
+                boost::str(boost::format("Invalid blend radius %1%, it "
+                                         "needs distance samples")
+                           % blend_radius));
+    }
+}
+
+vec3 VolumeParams::chunk_origin(const ivec3 &coord) const {
+    return vec3(chunk_world_size() * dvec3(coord));
+}
+
+string VolumeParams::build_options() const {
+    // Enough digits for the kernels to get exactly the same voxel size.
+    string options =
+            boost::str(boost::format("-DVM_CHUNK_SIZE=%d -DVM_VOXEL_SIZE=%.17g")
+                       % chunk_size % voxel_size);
+    if (distance_samples) {
+        options += boost::str(boost::format(" -DVM_DISTANCE_SAMPLES"
+                                            " -DVM_BLEND_RADIUS=%.17g")
+                              % blend_radius);
+    }
+    return options;
+}
+
+} // namespace vm
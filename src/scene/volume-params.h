@@ -0,0 +1,102 @@
+#ifndef VM_SCENE_VOLUME_PARAMS_H
+#define VM_SCENE_VOLUME_PARAMS_H
+#include <config.h>
+
+#include <cstdint>
+#include <string>
+
+#include <glm/glm.hpp>
+
+namespace vm {
+
+/**
+ * Resolution and format of the volume of a scene, chosen when the scene is
+ * created.
+ *
+ * Kernels get these as build options (see build_options()), which override
+ * the defaults VM_CHUNK_SIZE and VM_VOXEL_SIZE configured at build time.
+ */
+struct VolumeParams {
+    /* Distance samples per voxel size, when they are stored */
+    static const constexpr int SAMPLES_PER_VOXEL = 256;
+    /* Distance samples are clamped to [-MAX_SAMPLE, MAX_SAMPLE] */
+    static const constexpr int16_t MAX_SAMPLE = INT16_MAX;
+
+    /* Number of voxels along each axis of a chunk */
+    size_t chunk_size;
+    /* Distance (in world units) between two neighbouring samples */
+    double voxel_size;
+    /**
+     * If set, samples keep signed distances to the surface, quantized to
+     * SAMPLES_PER_VOXEL per voxel, rather than just their signs. Edges are
+     * then interpolated between the samples instead of searched for.
+     */
+    bool distance_samples;
+    /**
+     * Distance (in world units) over which brushes blend smoothly with the
+     * volume, 0 - sharp edits. Needs distance samples.
+     */
+    double blend_radius;
+
+    /** Uses the defaults configured at build time */
+    VolumeParams();
+
+    VolumeParams(size_t chunk_size,
+                 double voxel_size,
+                 bool distance_samples = false,
+                 double blend_radius = 0);
+
+    /**
+     * Checks that chunks of this size can be meshed at all levels of detail
+     * and divided into bricks, and that the blending is possible.
+     *
+     * @throws std::invalid_argument if they can't
+     */
+    void validate() const;
+
+    /** @returns sample of unset and entirely outside chunks */
+    inline int16_t outside_sample() const {
+        return distance_samples ? MAX_SAMPLE : 2;
+    }
+
+    /** @returns sample of entirely inside chunks */
+    inline int16_t inside_sample() const {
+        return distance_samples ? -MAX_SAMPLE : -1;
+    }
+
+    /**
+     * @returns distance (in world units) beyond the box of a brush within
+     * which it changes samples as well
+     */
+    inline double brush_margin() const {
+        // Distances of the samples next to the surface have to be exact for
+        // the interpolation, the farther ones may stay overestimated.
+        return distance_samples ? blend_radius + 2 * voxel_size : 0;
+    }
+
+    /** @returns length of the chunk's edge, in world units */
+    inline double chunk_world_size() const {
+        return chunk_size * voxel_size;
+    }
+
+    /** @returns world position of the chunk at @p coord (i.e. its center) */
+    glm::vec3 chunk_origin(const glm::ivec3 &coord) const;
+
+    /** @returns options defining these parameters for kernel builds */
+    std::string build_options() const;
+
+    inline bool operator==(const VolumeParams &other) const {
+        return chunk_size == other.chunk_size
+               && voxel_size == other.voxel_size
+               && distance_samples == other.distance_samples
+               && blend_radius == other.blend_radius;
+    }
+
+    inline bool operator!=(const VolumeParams &other) const {
+        return !(*this == other);
+    }
+};
+
+} // namespace vm
+
+#endif /* VM_SCENE_VOLUME_PARAMS_H */
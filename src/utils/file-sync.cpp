@@ -0,0 +1,61 @@
+#include "file-sync.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace vm {
+
+namespace {
+runtime_error system_error(const string &what, const string &path) {
+    return runtime_error(boost::str(boost::format("%1% %2%: %3%") % what % path
+                                    % strerror(errno)));
+}
+
+void sync_path(const string &path, int flags) {
+    const int fd = ::open(path.c_str(), flags);
+    if (fd < 0) {
+        throw system_error("Cannot open", path);
+    }
+    if (fsync(fd) < 0) {
+        const runtime_error error = system_error("Cannot sync", path);
+        ::close(fd);
+        throw error;
+    }
+    ::close(fd);
+}
+} // namespace
+
+void sync_file(const string &path) {
+    sync_path(path, O_RDONLY);
+}
+
+void sync_directory(const string &path) {
+    sync_path(path, O_RDONLY | O_DIRECTORY);
+}
+
+void replace_file(const string &temporary, const string &path) {
+    try {
+        sync_file(temporary);
+        if (::rename(temporary.c_str(), path.c_str()) < 0) {
+            throw system_error("Cannot rename " + temporary + " to", path);
+        }
+    } catch (...) {
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    const fs::path directory = fs::path(path).parent_path();
+    sync_directory(directory.empty() ? "." : directory.string());
+}
+
+} // namespace vm
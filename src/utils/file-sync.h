@@ -0,0 +1,33 @@
+#ifndef VM_UTILS_FILE_SYNC_H
+#define VM_UTILS_FILE_SYNC_H
+#include <string>
+
+namespace vm {
+
+/**
+ * Flushes contents of the file at @p path to the disk.
+ *
+ * @throws std::runtime_error if it fails
+ */
+void sync_file(const std::string &path);
+
+/**
+ * Flushes the directory at @p path to the disk, so that files created in it
+ * or renamed into it survive a crash.
+ *
+ * @throws std::runtime_error if it fails
+ */
+void sync_directory(const std::string &path);
+
+/**
+ * Durably replaces the file at @p path with the one at @p temporary (in the
+ * same directory), so that after a crash there is either the old or the new
+ * file, never a part of it.
+ *
+ * @throws std::runtime_error if it fails, leaving the file at @p path as it is
+ */
+void replace_file(const std::string &temporary, const std::string &path);
+
+} // namespace vm
+
+#endif /* VM_UTILS_FILE_SYNC_H */
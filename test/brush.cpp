@@ -0,0 +1,59 @@
+#include "gtest/gtest.h"
+
+#include "scene/brush-ball.h"
+#include "scene/brush-cube.h"
+
+#include <cmath>
+
+namespace {
+/**
+ * Checks that the AABB of the @p brush encloses the point at @p q in brush
+ * space, which kernels map to from world space with the brush rotation.
+ */
+void expect_covered(const vm::Brush &brush, const glm::vec3 &q) {
+    const vm::AABB aabb = brush.get_aabb();
+    const glm::vec3 p =
+            glm::transpose(brush.get_rotation()) * q + brush.get_origin();
+    const float eps = 1e-5f;
+    for (int axis = 0; axis < 3; ++axis) {
+        EXPECT_GE(p[axis], aabb.min[axis] - eps);
+        EXPECT_LE(p[axis], aabb.max[axis] + eps);
+    }
+}
+} // namespace
+
+TEST(brush, rotated_ellipsoid_footprint) {
+    // Rotations about a single axis have the same footprint as their inverse,
+    // so it is rotated about two of them.
+    vm::BrushBall ball;
+    ball.set_origin({ 0.1f, -0.2f, 0.3f });
+    ball.set_scale({ 1.0f, 0.1f, 0.2f });
+    ball.set_rotation({ 0.5f, 0.0f, 0.8f });
+
+    const glm::vec3 radii = 0.5f * ball.get_scale();
+    const int steps = 32;
+    for (int i = 0; i <= steps; ++i) {
+        const float theta = float(M_PI) * i / steps;
+        for (int j = 0; j < 2 * steps; ++j) {
+            const float phi = float(M_PI) * j / steps;
+            const glm::vec3 u(std::sin(theta) * std::cos(phi),
+                              std::sin(theta) * std::sin(phi),
+                              std::cos(theta));
+            expect_covered(ball, radii * u);
+        }
+    }
+}
+
+TEST(brush, rotated_cube_footprint) {
+    vm::BrushCube cube;
+    cube.set_scale({ 1.0f, 0.1f, 0.2f });
+    cube.set_rotation({ 0.5f, 0.0f, 0.8f });
+
+    const glm::vec3 half = 0.5f * cube.get_scale();
+    for (int corner = 0; corner < 8; ++corner) {
+        expect_covered(cube,
+                       half * glm::vec3(corner & 1 ? 1 : -1,
+                                        corner & 2 ? 1 : -1,
+                                        corner & 4 ? 1 : -1));
+    }
+}
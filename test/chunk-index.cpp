@@ -0,0 +1,118 @@
+#include "gtest/gtest.h"
+
+#include "scene/chunk-index.h"
+
+#include <cstdlib>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+typedef std::tuple<int, int, int> Key;
+
+Key as_key(const glm::ivec3 &coord) {
+    return std::make_tuple(coord.x, coord.y, coord.z);
+}
+} // namespace
+
+TEST(chunk_index, no_aliasing) {
+    // These used to collide with the old coord.x + 1024 * (...) hash.
+    const glm::ivec3 coords[] = { { 1024, 0, 0 },    { 0, 1, 0 },
+                                  { -1, 0, 0 },      { 1023, -1, 0 },
+                                  { 0, 0, 1 },       { 0, 1024, 0 },
+                                  { -5000, 7000, 3 }, { 5000, -7000, -3 } };
+    vm::ChunkIndex<int> index;
+    int value = 0;
+    for (const auto &coord : coords) {
+        index.get_or_create(coord, [&]() { return value; });
+        ++value;
+    }
+    ASSERT_EQ(index.size(), sizeof(coords) / sizeof(coords[0]));
+
+    value = 0;
+    for (const auto &coord : coords) {
+        const int *stored = index.find(coord);
+        ASSERT_NE(stored, nullptr);
+        ASSERT_EQ(*stored, value);
+        ++value;
+    }
+}
+
+TEST(chunk_index, matches_reference_map) {
+    vm::ChunkIndex<int> index;
+    std::map<Key, int> reference;
+    srand(0);
+
+    for (int i = 0; i < 100000; ++i) {
+        const glm::ivec3 coord(
+                rand() % 64 - 32, rand() % 64 - 32, rand() % 64 - 32);
+        switch (rand() % 3) {
+        case 0:
+            index.get_or_create(coord, [&]() { return i; });
+            reference.emplace(as_key(coord), i);
+            break;
+        case 1:
+            ASSERT_EQ(index.erase(coord), !!reference.erase(as_key(coord)));
+            break;
+        case 2: {
+            const int *stored = index.find(coord);
+            auto it = reference.find(as_key(coord));
+            ASSERT_EQ(stored != nullptr, it != reference.end());
+            if (stored) {
+                ASSERT_EQ(*stored, it->second);
+            }
+            break;
+        }
+        }
+    }
+    ASSERT_EQ(index.size(), reference.size());
+}
+
+TEST(chunk_index, region_and_neighbours) {
+    vm::ChunkIndex<int> index;
+    for (int z = -4; z < 4; ++z) {
+        for (int y = -4; y < 4; ++y) {
+            for (int x = -4; x < 4; ++x) {
+                index.get_or_create({ x, y, z }, [&]() { return x + y + z; });
+            }
+        }
+    }
+
+    size_t visited = 0;
+    index.for_each_in_region(
+            { -1, -1, -1 },
+            { 1, 1, 1 },
+            [&](const glm::ivec3 &coord, const int &value) {
+                ASSERT_EQ(value, coord.x + coord.y + coord.z);
+                ++visited;
+            });
+    ASSERT_EQ(visited, 27u);
+
+    // Region much larger than the number of chunks walks the table instead.
+    visited = 0;
+    index.for_each_in_region({ -100, -100, -100 },
+                             { 100, 100, 0 },
+                             [&](const glm::ivec3 &, const int &) {
+                                 ++visited;
+                             });
+    ASSERT_EQ(visited, 8u * 8u * 5u);
+
+    visited = 0;
+    index.for_each_neighbour({ -4, -4, -4 },
+                             [&](const glm::ivec3 &, const int &) {
+                                 ++visited;
+                             });
+    ASSERT_EQ(visited, 7u);
+}
+
+TEST(chunk_index, out_of_range) {
+    vm::ChunkIndex<int> index;
+    const glm::ivec3 outside{ 1 << 20, 0, 0 };
+    ASSERT_THROW(index.get_or_create(outside, []() { return 1; }),
+                 std::out_of_range);
+    // Same key as the one above would have, if it wasn't rejected.
+    index.get_or_create({ -(1 << 20), 0, 0 }, []() { return 2; });
+    ASSERT_EQ(index.find(outside), nullptr);
+    ASSERT_FALSE(index.erase(outside));
+    ASSERT_EQ(index.size(), 1u);
+}
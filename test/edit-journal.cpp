@@ -0,0 +1,128 @@
+#include "gtest/gtest.h"
+
+#include "scene/brush-ball.h"
+#include "scene/brush-cube.h"
+#include "scene/edit-journal.h"
+
+#include <boost/filesystem.hpp>
+
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+namespace {
+struct Edit {
+    int id;
+    glm::vec3 origin;
+    glm::vec3 scale;
+    int material;
+    vm::dc::Sampler::Operation operation;
+    uint64_t sequence;
+};
+
+struct TempJournal {
+    fs::path path;
+
+    TempJournal()
+            : path(fs::temp_directory_path()
+                   / fs::unique_path("vm-journal-%%%%-%%%%.bin")) {}
+
+    ~TempJournal() {
+        fs::remove(path);
+    }
+};
+
+std::vector<Edit> replay(vm::EditJournal &journal) {
+    std::vector<Edit> edits;
+    journal.replay([&](const vm::Brush &brush,
+                       vm::dc::Sampler::Operation operation,
+                       uint64_t sequence) {
+        edits.push_back(Edit{ brush.id(),
+                              brush.get_origin(),
+                              brush.get_scale(),
+                              brush.material(),
+                              operation,
+                              sequence });
+    });
+    return edits;
+}
+
+void append_edits(vm::EditJournal &journal) {
+    vm::BrushBall ball;
+    ball.set_origin({ 1, 2, 3 });
+    ball.set_scale({ 0.5f, 0.5f, 0.5f });
+    ball.set_material(2);
+    journal.append(ball, vm::dc::Sampler::Operation::Add);
+
+    vm::BrushCube cube;
+    cube.set_origin({ -1, 0, 4 });
+    cube.set_rotation({ 0.3f, 0.0f, 1.0f });
+    journal.append(cube, vm::dc::Sampler::Operation::Sub);
+}
+} // namespace
+
+TEST(edit_journal, round_trip) {
+    TempJournal temp;
+    {
+        vm::EditJournal journal(temp.path.string());
+        append_edits(journal);
+        ASSERT_EQ(journal.size(), 2u);
+    }
+    vm::EditJournal journal(temp.path.string());
+    ASSERT_EQ(journal.size(), 2u);
+    const std::vector<Edit> edits = replay(journal);
+    ASSERT_EQ(edits.size(), 2u);
+    ASSERT_EQ(edits[0].id, vm::Brush::Id::Ball);
+    ASSERT_EQ(edits[0].origin, glm::vec3(1, 2, 3));
+    ASSERT_EQ(edits[0].scale, glm::vec3(0.5f));
+    ASSERT_EQ(edits[0].material, 2);
+    ASSERT_EQ(edits[0].operation, vm::dc::Sampler::Operation::Add);
+    ASSERT_EQ(edits[1].id, vm::Brush::Id::Cube);
+    ASSERT_EQ(edits[1].origin, glm::vec3(-1, 0, 4));
+    ASSERT_EQ(edits[1].operation, vm::dc::Sampler::Operation::Sub);
+
+    journal.truncate();
+    ASSERT_EQ(journal.size(), 0u);
+    ASSERT_TRUE(replay(journal).empty());
+}
+
+TEST(edit_journal, torn_tail_is_discarded) {
+    TempJournal temp;
+    {
+        vm::EditJournal journal(temp.path.string());
+        append_edits(journal);
+    }
+    // Simulate a crash in the middle of appending the second record.
+    fs::resize_file(temp.path, fs::file_size(temp.path) - 7);
+
+    vm::EditJournal journal(temp.path.string());
+    ASSERT_EQ(replay(journal).size(), 1u);
+    ASSERT_EQ(journal.size(), 1u);
+
+    // Appending after the recovery must not leave garbage in between.
+    vm::BrushBall ball;
+    journal.append(ball, vm::dc::Sampler::Operation::Add);
+    ASSERT_EQ(replay(journal).size(), 2u);
+}
+
+TEST(edit_journal, sequence_survives_truncation) {
+    TempJournal temp;
+    {
+        vm::EditJournal journal(temp.path.string());
+        ASSERT_TRUE(journal.has_sequence());
+        append_edits(journal);
+        std::vector<Edit> edits = replay(journal);
+        ASSERT_EQ(edits.size(), 2u);
+        ASSERT_EQ(edits[0].sequence, 1u);
+        ASSERT_EQ(edits[1].sequence, 2u);
+        journal.truncate();
+    }
+    vm::EditJournal journal(temp.path.string());
+    ASSERT_EQ(journal.size(), 0u);
+    // Chunks persisted with the truncated edits must not skip the new ones.
+    ASSERT_EQ(journal.append(vm::BrushBall(), vm::dc::Sampler::Operation::Add),
+              3u);
+    const std::vector<Edit> edits = replay(journal);
+    ASSERT_EQ(edits.size(), 1u);
+    ASSERT_EQ(edits[0].sequence, 3u);
+}
@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+
+#include "compute/context.h"
+
+#include "dc/mesher.h"
+#include "dc/sampler.h"
+
+#include "scene/brush-ball.h"
+#include "scene/brush-cube.h"
+#include "scene/chunk.h"
+
+#include <memory>
+#include <vector>
+
+namespace {
+struct TestContext {
+    std::shared_ptr<vm::ComputeContext> compute_ctx;
+    vm::VolumeParams params;
+    vm::dc::Sampler sampler;
+    vm::dc::Mesher mesher;
+
+    TestContext(const vm::VolumeParams &params = vm::VolumeParams(32, 0.05))
+            : compute_ctx(vm::make_compute_context())
+            , params(params)
+            , sampler(compute_ctx, params)
+            , mesher(compute_ctx, params) {}
+
+    /** @returns chunk at @p coord, with the @p brush added to empty volume */
+    std::unique_ptr<vm::Chunk> make_chunk(const glm::ivec3 &coord,
+                                          const vm::Brush &brush) {
+        auto chunk = std::make_unique<vm::Chunk>(coord, params);
+        chunk->alloc_volume(compute_ctx->context);
+        const int16_t outside = params.outside_sample();
+        const compute::short4_ fill_color(outside, outside, outside, outside);
+        compute_ctx->queue.enqueue_fill_image<3>(chunk->samples,
+                                                 &fill_color,
+                                                 compute::dim(0, 0, 0),
+                                                 chunk->samples.size());
+        const compute::uint4_ no_material(0, 0, 0, 0);
+        compute_ctx->queue.enqueue_fill_image<3>(chunk->materials,
+                                                 &no_material,
+                                                 compute::dim(0, 0, 0),
+                                                 chunk->materials.size());
+        sampler.sample(*chunk, brush, vm::dc::Sampler::Operation::Add);
+        compute_ctx->queue.finish();
+        return chunk;
+    }
+};
+
+/** Brushes of various shapes, placed within the chunks at @p coords */
+std::vector<std::unique_ptr<vm::Brush>>
+make_brushes(const vm::VolumeParams &params,
+             const std::vector<glm::ivec3> &coords) {
+    std::vector<std::unique_ptr<vm::Brush>> brushes;
+    for (size_t i = 0; i < coords.size(); ++i) {
+        std::unique_ptr<vm::Brush> brush;
+        if (i % 2) {
+            brush = std::make_unique<vm::BrushCube>();
+        } else {
+            brush = std::make_unique<vm::BrushBall>();
+        }
+        brush->set_origin(params.chunk_origin(coords[i])
+                          + glm::vec3(0.02f * i, -0.03f, 0.01f));
+        brush->set_scale(glm::vec3(0.6f + 0.1f * i, 0.8f, 0.7f));
+        brush->set_rotation({ 0.3f * i, 0.2f, 0.0f });
+        brushes.push_back(std::move(brush));
+    }
+    return brushes;
+}
+} // namespace
+
+TEST(mesher, batch_matches_serial_contouring) {
+    TestContext ctx;
+    const std::vector<glm::ivec3> coords = {
+        { 0, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { -1, 0, 2 }, { 0, 1, 1 }
+    };
+    const auto brushes = make_brushes(ctx.params, coords);
+
+    std::vector<std::unique_ptr<vm::Chunk>> batched;
+    std::vector<std::unique_ptr<vm::Chunk>> serial;
+    std::vector<vm::Chunk *> batch;
+    for (size_t i = 0; i < coords.size(); ++i) {
+        batched.push_back(ctx.make_chunk(coords[i], *brushes[i]));
+        serial.push_back(ctx.make_chunk(coords[i], *brushes[i]));
+        batch.push_back(batched.back().get());
+    }
+    ctx.mesher.contour(batch);
+    for (const auto &chunk : serial) {
+        ctx.mesher.contour(*chunk);
+    }
+
+    for (size_t i = 0; i < coords.size(); ++i) {
+        for (size_t lod = 0; lod < VM_LOD_LEVELS; ++lod) {
+            std::vector<glm::vec3> vertices;
+            std::vector<uint32_t> indices;
+            ctx.mesher.download(batched[i]->meshes[lod], vertices, indices);
+            std::vector<glm::vec3> expected_vertices;
+            std::vector<uint32_t> expected_indices;
+            ctx.mesher.download(serial[i]->meshes[lod],
+                                expected_vertices,
+                                expected_indices);
+            if (lod == 0) {
+                ASSERT_FALSE(expected_indices.empty()) << i;
+            }
+            ASSERT_TRUE(vertices == expected_vertices) << i << ": " << lod;
+            ASSERT_EQ(indices, expected_indices) << i << ": " << lod;
+        }
+    }
+}
+
+TEST(mesher, wide_indices_match_short_ones) {
+    TestContext ctx;
+    // Any mesh with a vertex is indexed with 32 bits.
+    vm::dc::Mesher wide_mesher(ctx.compute_ctx, ctx.params, 1, 0);
+    vm::BrushBall ball;
+    ball.set_scale({ 1.2f, 0.9f, 1.0f });
+    auto chunk = ctx.make_chunk({ 0, 0, 0 }, ball);
+    auto wide_chunk = ctx.make_chunk({ 0, 0, 0 }, ball);
+    ctx.mesher.contour(*chunk);
+    wide_mesher.contour(*wide_chunk);
+
+    for (size_t lod = 0; lod < VM_LOD_LEVELS; ++lod) {
+        const vm::ChunkMesh &mesh = chunk->meshes[lod];
+        const vm::ChunkMesh &wide_mesh = wide_chunk->meshes[lod];
+        if (!mesh.num_staged_vertices) {
+            continue;
+        }
+        ASSERT_EQ(mesh.staged_index_type, GLenum(GL_UNSIGNED_SHORT)) << lod;
+        ASSERT_EQ(wide_mesh.staged_index_type, GLenum(GL_UNSIGNED_INT))
+                << lod;
+
+        std::vector<glm::vec3> vertices;
+        std::vector<uint32_t> indices;
+        ctx.mesher.download(mesh, vertices, indices);
+        std::vector<glm::vec3> wide_vertices;
+        std::vector<uint32_t> wide_indices;
+        wide_mesher.download(wide_mesh, wide_vertices, wide_indices);
+        ASSERT_FALSE(indices.empty()) << lod;
+        ASSERT_TRUE(vertices == wide_vertices) << lod;
+        ASSERT_EQ(indices, wide_indices) << lod;
+        for (uint32_t index : wide_indices) {
+            ASSERT_LT(index, wide_vertices.size()) << lod;
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#include "gtest/gtest.h"
+
+#include "compute/context.h"
+#include "compute/program-cache.h"
+
+#include <cstdlib>
+#include <string>
+
+namespace {
+const std::string source = "kernel void noop(global int *out) { *out = 0; }";
+} // namespace
+
+TEST(program_cache, programs_are_kept_per_context) {
+    // Keeps the disk cache out of the way.
+    setenv("VM_PROGRAM_CACHE_DIR", "", 1);
+    compute::context context;
+    {
+        auto ctx = vm::make_compute_context();
+        const compute::program program = vm::build_program(*ctx, source);
+        ASSERT_EQ(vm::build_program(*ctx, source).get(), program.get());
+        ASSERT_NE(vm::build_program(*ctx, source, "-DOTHER").get(),
+                  program.get());
+        ASSERT_EQ(ctx->programs.size(), 2u);
+
+        auto other_ctx = vm::make_compute_context();
+        ASSERT_NE(vm::build_program(*other_ctx, source).get(), program.get());
+        ASSERT_EQ(other_ctx->programs.size(), 1u);
+        context = ctx->context;
+    }
+    // Programs of a released context don't hold on to it anymore.
+    ASSERT_EQ(context.get_info<cl_uint>(CL_CONTEXT_REFERENCE_COUNT), 1u);
+}
@@ -7,42 +7,55 @@
 #include "dc/sampler.h"
 
 #include "scene/brush-ball.h"
+#include "scene/brush-composite.h"
 #include "scene/brush-cube.h"
 #include "scene/chunk.h"
 
 #include <glm/gtc/packing.hpp>
 
+#include <cmath>
+
 namespace {
 struct TestContext {
     std::shared_ptr<vm::ComputeContext> compute_ctx;
+    vm::VolumeParams params;
 
     vm::Chunk chunk;
     std::vector<int16_t> cpu_samples;
     std::vector<int16_t> gpu_samples;
 
-    TestContext()
+    TestContext(const vm::VolumeParams &params = vm::VolumeParams())
             : compute_ctx(vm::make_compute_context())
-            , chunk({ 0, 0, 0 }, compute_ctx->context, 0)
-            , cpu_samples((VM_CHUNK_SIZE + 3) * (VM_CHUNK_SIZE + 3)
-                                  * (VM_CHUNK_SIZE + 3),
+            , params(params)
+            , chunk({ 0, 0, 0 }, params, 0)
+            , cpu_samples((params.chunk_size + 3) * (params.chunk_size + 3)
+                                  * (params.chunk_size + 3),
                           2)
             , gpu_samples(cpu_samples.size(), 0) {
-        const compute::short4_ fill_color(2, 2, 2, 2);
+        chunk.alloc_volume(compute_ctx->context);
+        const int16_t outside = params.outside_sample();
+        const compute::short4_ fill_color(outside, outside, outside, outside);
         compute_ctx->queue.enqueue_fill_image<3>(chunk.samples,
                                                  &fill_color,
                                                  compute::dim(0, 0, 0),
                                                  chunk.samples.size());
+        const compute::uint4_ no_material(0, 0, 0, 0);
+        compute_ctx->queue.enqueue_fill_image<3>(chunk.materials,
+                                                 &no_material,
+                                                 compute::dim(0, 0, 0),
+                                                 chunk.materials.size());
         compute_ctx->queue.flush();
         compute_ctx->queue.finish();
     }
 };
 
-glm::vec3
-vertex_at(int x, int y, int z, const glm::vec3 &origin = { 0, 0, 0 }) {
-    auto half_dim = 0.5f * glm::vec3(VM_CHUNK_SIZE + 3,
-                                     VM_CHUNK_SIZE + 3,
-                                     VM_CHUNK_SIZE + 3);
-    return float(VM_VOXEL_SIZE) * (glm::vec3(x, y, z) - half_dim) + origin;
+glm::vec3 vertex_at(const vm::VolumeParams &params,
+                    int x,
+                    int y,
+                    int z,
+                    const glm::vec3 &origin = { 0, 0, 0 }) {
+    auto half_dim = 0.5f * glm::vec3(params.chunk_size + 3);
+    return float(params.voxel_size) * (glm::vec3(x, y, z) - half_dim) + origin;
 }
 
 int16_t sign(float value) {
@@ -55,27 +68,31 @@ int16_t sign(float value) {
     }
 }
 
+/** @returns sign of a sample, whether it keeps just the sign or a distance */
+int16_t sample_sign(int16_t sample) {
+    return std::max<int16_t>(-1, std::min<int16_t>(sample, 1));
+}
+
 float sdf_cube(const glm::vec3 &q, const glm::vec3 &scale = { 1, 1, 1 }) {
     glm::vec3 p = glm::abs(q);
     return glm::max(p.x - scale.x, glm::max(p.y - scale.y, p.z - scale.z));
 }
 
-} // namespace
-
-TEST(sampler, signs_match) {
-    TestContext ctx{};
+void check_signs_match(const vm::VolumeParams &params) {
+    TestContext ctx(params);
     const vm::BrushCube cube{};
-    vm::dc::Sampler sampler(ctx.compute_ctx);
+    vm::dc::Sampler sampler(ctx.compute_ctx, params);
     sampler.sample(ctx.chunk, cube, vm::dc::Sampler::Operation::Add);
     ctx.compute_ctx->queue.flush();
     ctx.compute_ctx->queue.finish();
 
-    for (size_t i = 0; i < VM_CHUNK_SIZE + 3; ++i) {
-        for (size_t j = 0; j < VM_CHUNK_SIZE + 3; ++j) {
-            for (size_t k = 0; k < VM_CHUNK_SIZE + 3; ++k) {
-                const size_t index =
-                        k + (VM_CHUNK_SIZE + 3) * (j + (VM_CHUNK_SIZE + 3) * i);
-                const glm::vec3 p = vertex_at(k, j, i) - cube.get_origin();
+    const size_t n = params.chunk_size + 3;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t k = 0; k < n; ++k) {
+                const size_t index = k + n * (j + n * i);
+                const glm::vec3 p =
+                        vertex_at(params, k, j, i) - cube.get_origin();
                 ctx.cpu_samples[index] = sign(
                         glm::min(ctx.cpu_samples[index],
                                  sign(sdf_cube(p, 0.5f * cube.get_scale()))));
@@ -85,18 +102,515 @@ TEST(sampler, signs_match) {
     ctx.compute_ctx->queue
             .enqueue_read_image<3>(ctx.chunk.samples,
                                    compute::dim(0, 0, 0),
-                                   compute::dim(VM_CHUNK_SIZE + 3,
-                                                VM_CHUNK_SIZE + 3,
-                                                VM_CHUNK_SIZE + 3),
+                                   compute::dim(n, n, n),
+                                   ctx.gpu_samples.data())
+            .wait();
+
+    for (size_t i = 0; i < ctx.gpu_samples.size(); ++i) {
+        // Unset samples (2) away from the brush are left untouched, which is
+        // equivalent to them being outside (1).
+        ASSERT_EQ(sample_sign(ctx.cpu_samples[i]),
+                  sample_sign(ctx.gpu_samples[i]));
+    }
+}
+
+#if defined(WITH_COMPACT_EDGES)
+/** Same as decode_edge() of media/kernels/utils.h */
+glm::vec4 decode_edge(uint32_t edge) {
+    const float max_normal = (1 << 11) - 1;
+    const float max_crossing = (1 << 10) - 1;
+    const glm::vec2 e = glm::vec2(edge & 0x7ff, (edge >> 11) & 0x7ff)
+                                / max_normal * 2.0f
+                        - 1.0f;
+    glm::vec3 n(e, 1 - std::abs(e.x) - std::abs(e.y));
+    const float fold = std::max(-n.z, 0.0f);
+    n.x += n.x >= 0 ? -fold : fold;
+    n.y += n.y >= 0 ? -fold : fold;
+    return glm::vec4(glm::normalize(n), (edge >> 22) / max_crossing);
+}
+#endif
+
+/** @returns (normal, crossing) of every edge of the @p chunk along @p axis */
+std::vector<glm::vec4> read_edges(TestContext &ctx, size_t axis) {
+    const compute::image3d *images[] = { &ctx.chunk.edges_x,
+                                         &ctx.chunk.edges_y,
+                                         &ctx.chunk.edges_z };
+    const compute::extents<3> size = images[axis]->size();
+    const size_t num_edges = size[0] * size[1] * size[2];
+    std::vector<glm::vec4> edges(num_edges);
+#if defined(WITH_COMPACT_EDGES)
+    std::vector<uint32_t> packed(num_edges);
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(
+                    *images[axis], compute::dim(0, 0, 0), size, packed.data())
+            .wait();
+    for (size_t i = 0; i < num_edges; ++i) {
+        edges[i] = decode_edge(packed[i]);
+    }
+#else
+    std::vector<uint16_t> halves(4 * num_edges);
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(
+                    *images[axis], compute::dim(0, 0, 0), size, halves.data())
+            .wait();
+    for (size_t i = 0; i < num_edges; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            edges[i][j] = glm::unpackHalf1x16(halves[4 * i + j]);
+        }
+    }
+#endif
+    return edges;
+}
+
+/**
+ * Checks that the edges the @p brush crosses are found where (and oriented
+ * the same way as) the bisection finds them.
+ */
+void check_edges_match_bisection(const vm::Brush &brush) {
+    TestContext ctx{};
+    TestContext reference{};
+    vm::dc::Sampler sampler(ctx.compute_ctx, ctx.params);
+    vm::dc::Sampler bisection(reference.compute_ctx,
+                              reference.params,
+                              vm::dc::Sampler::RootFinder::Bisection);
+    sampler.sample(ctx.chunk, brush, vm::dc::Sampler::Operation::Add);
+    bisection.sample(reference.chunk, brush, vm::dc::Sampler::Operation::Add);
+
+    const size_t n = ctx.params.chunk_size + 3;
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   ctx.gpu_samples.data())
+            .wait();
+
+    size_t num_active = 0;
+    size_t mismatches = 0;
+    for (size_t axis = 0; axis < 3; ++axis) {
+        const std::vector<glm::vec4> edges = read_edges(ctx, axis);
+        const std::vector<glm::vec4> expected = read_edges(reference, axis);
+        const compute::extents<3> size = ctx.chunk.volume_image_size(1 + axis);
+        for (size_t z = 0; z < size[2]; ++z) {
+            for (size_t y = 0; y < size[1]; ++y) {
+                for (size_t x = 0; x < size[0]; ++x) {
+                    const glm::uvec3 p0(x, y, z);
+                    glm::uvec3 p1 = p0;
+                    ++p1[axis];
+                    const int16_t s0 =
+                            ctx.gpu_samples[p0.x + n * (p0.y + n * p0.z)];
+                    const int16_t s1 =
+                            ctx.gpu_samples[p1.x + n * (p1.y + n * p1.z)];
+                    if (sample_sign(s0) == sample_sign(s1)) {
+                        continue;
+                    }
+                    const size_t i = x + size[0] * (y + size[1] * z);
+                    const glm::vec4 &edge = edges[i];
+                    const glm::vec4 &expected_edge = expected[i];
+                    ++num_active;
+                    // Half floats keep the crossings to about 1e-3.
+                    mismatches +=
+                            std::abs(edge.w - expected_edge.w) > 2e-3f
+                            || glm::dot(glm::vec3(edge),
+                                        glm::vec3(expected_edge))
+                                       < 0.99f;
+                }
+            }
+        }
+    }
+    ASSERT_GT(num_active, 0u);
+    // Central differences blur the normals right at the cube edges.
+    ASSERT_LE(mismatches, num_active / 100);
+}
+
+/**
+ * Checks that the @p brush leaves the same distance samples as the
+ * @p reference brush, up to their quantization.
+ */
+void check_distances_match(const vm::Brush &brush,
+                           const vm::Brush &reference_brush) {
+    const vm::VolumeParams params(32, 0.05, true);
+    TestContext ctx(params);
+    TestContext reference(params);
+    vm::dc::Sampler sampler(ctx.compute_ctx, params);
+    vm::dc::Sampler reference_sampler(reference.compute_ctx, params);
+    sampler.sample(ctx.chunk, brush, vm::dc::Sampler::Operation::Add);
+    reference_sampler.sample(
+            reference.chunk, reference_brush, vm::dc::Sampler::Operation::Add);
+
+    const size_t n = params.chunk_size + 3;
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   ctx.gpu_samples.data())
+            .wait();
+    reference.compute_ctx->queue
+            .enqueue_read_image<3>(reference.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   reference.gpu_samples.data())
+            .wait();
+    size_t num_inside = 0;
+    for (size_t i = 0; i < ctx.gpu_samples.size(); ++i) {
+        ASSERT_NEAR(ctx.gpu_samples[i], reference.gpu_samples[i], 2) << i;
+        num_inside += reference.gpu_samples[i] < 0;
+    }
+    ASSERT_GT(num_inside, 0u);
+}
+
+} // namespace
+
+TEST(sampler, signs_match) {
+    check_signs_match(vm::VolumeParams());
+}
+
+TEST(sampler, signs_match_at_runtime_chunk_size) {
+    // Other than the defaults the kernels were configured with.
+    check_signs_match(vm::VolumeParams(32, 0.05));
+}
+
+TEST(sampler, signs_match_with_distance_samples) {
+    check_signs_match(vm::VolumeParams(32, 0.05, true));
+}
+
+TEST(sampler, composite_matches_sequential_stamps) {
+    using Node = vm::BrushComposite::Node;
+    TestContext ctx{};
+    TestContext reference{};
+    vm::dc::Sampler sampler(ctx.compute_ctx, ctx.params);
+    vm::dc::Sampler reference_sampler(reference.compute_ctx, reference.params);
+
+    // A box with a ball carved out of its corner, in one pass...
+    vm::BrushComposite composite;
+    composite.set_scale({ 0.8f, 0.6f, 0.7f });
+    composite.push(Node::Cube, { 0, 0, 0 });
+    composite.push(Node::Ball, { 0.5f, 0.5f, 0.5f }, { 0.9f, 0.9f, 0.9f });
+    composite.combine(Node::Difference);
+    sampler.sample(ctx.chunk, composite, vm::dc::Sampler::Operation::Add);
+
+    // ...is the same as adding the box and subtracting the ball.
+    vm::BrushCube cube;
+    cube.set_scale(composite.get_scale());
+    reference_sampler.sample(
+            reference.chunk, cube, vm::dc::Sampler::Operation::Add);
+    vm::BrushBall ball;
+    ball.set_origin(0.5f * composite.get_scale());
+    ball.set_scale(0.9f * composite.get_scale());
+    reference_sampler.sample(
+            reference.chunk, ball, vm::dc::Sampler::Operation::Sub);
+
+    const compute::extents<3> size = ctx.chunk.samples.size();
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   size,
+                                   ctx.gpu_samples.data())
+            .wait();
+    reference.compute_ctx->queue
+            .enqueue_read_image<3>(reference.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   size,
+                                   reference.gpu_samples.data())
+            .wait();
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < ctx.gpu_samples.size(); ++i) {
+        mismatches += std::min<int16_t>(ctx.gpu_samples[i], 1)
+                      != std::min<int16_t>(reference.gpu_samples[i], 1);
+    }
+    // Scaling the ball into the brush space may round a few samples lying
+    // right on its surface differently.
+    ASSERT_LE(mismatches, ctx.gpu_samples.size() / 1000);
+}
+
+TEST(sampler, analytic_ball_edges_match_bisection) {
+    vm::BrushBall ball;
+    ball.set_scale({ 1.2f, 0.8f, 1.0f });
+    ball.set_rotation(glm::radians(glm::vec3(30, 45, 10)));
+    check_edges_match_bisection(ball);
+}
+
+TEST(sampler, analytic_cube_edges_match_bisection) {
+    vm::BrushCube cube;
+    cube.set_origin({ 0.1f, -0.2f, 0.05f });
+    cube.set_rotation(glm::radians(glm::vec3(20, 0, 35)));
+    check_edges_match_bisection(cube);
+}
+
+TEST(sampler, illinois_composite_edges_match_bisection) {
+    using Node = vm::BrushComposite::Node;
+    vm::BrushComposite composite;
+    composite.push(Node::Cube, { 0, 0, 0 });
+    composite.push(Node::Ball, { 0.5f, 0.5f, 0.5f }, { 0.9f, 0.9f, 0.9f });
+    composite.combine(Node::Difference);
+    check_edges_match_bisection(composite);
+}
+
+TEST(sampler, composite_ball_distances_match_ball) {
+    using Node = vm::BrushComposite::Node;
+    vm::BrushComposite composite;
+    composite.push(Node::Ball, { 0, 0, 0 });
+    composite.set_origin({ 0.11f, -0.06f, 0.03f });
+    composite.set_scale({ 0.9f, 0.6f, 0.7f });
+    composite.set_rotation(glm::radians(glm::vec3(25, 40, 15)));
+
+    // Ball brushes scale distances by the smallest component too.
+    vm::BrushBall ball;
+    ball.set_origin(composite.get_origin());
+    ball.set_scale(composite.get_scale());
+    ball.set_rotation_matrix(composite.get_rotation());
+    check_distances_match(composite, ball);
+}
+
+TEST(sampler, composite_cube_distances_match_cube) {
+    using Node = vm::BrushComposite::Node;
+    vm::BrushComposite composite;
+    composite.push(Node::Cube, { 0, 0, 0 });
+    composite.set_origin({ -0.04f, 0.12f, 0.07f });
+    composite.set_scale({ 0.7f, 0.7f, 0.7f });
+    composite.set_rotation(glm::radians(glm::vec3(10, 30, 50)));
+
+    vm::BrushCube cube;
+    cube.set_origin(composite.get_origin());
+    cube.set_scale(composite.get_scale());
+    cube.set_rotation_matrix(composite.get_rotation());
+    check_distances_match(composite, cube);
+}
+
+TEST(sampler, composite_distances_match_analytic_sdf) {
+    using Node = vm::BrushComposite::Node;
+    const vm::VolumeParams params(32, 0.05, true);
+    TestContext ctx(params);
+    vm::BrushComposite composite;
+    composite.set_origin({ 0.05f, -0.03f, 0.02f });
+    composite.set_scale({ 0.8f, 0.8f, 0.8f });
+    composite.push(Node::Cube, { -0.2f, 0, 0 }, { 0.6f, 0.6f, 0.6f });
+    composite.push(Node::Ball, { 0.25f, 0, 0 }, { 0.5f, 0.5f, 0.5f });
+    composite.combine(Node::Union);
+    vm::dc::Sampler sampler(ctx.compute_ctx, params);
+    sampler.sample(ctx.chunk, composite, vm::dc::Sampler::Operation::Add);
+
+    const size_t n = params.chunk_size + 3;
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   ctx.gpu_samples.data())
+            .wait();
+    const float scale = composite.get_scale().x;
+    for (size_t z = 0; z < n; ++z) {
+        for (size_t y = 0; y < n; ++y) {
+            for (size_t x = 0; x < n; ++x) {
+                // Union of the primitives in the brush space, scaled back.
+                const glm::vec3 q = (vertex_at(params, x, y, z)
+                                     - composite.get_origin())
+                                    / scale;
+                const float cube = sdf_cube(q - glm::vec3(-0.2f, 0, 0),
+                                            glm::vec3(0.3f));
+                const float ball =
+                        glm::length(q - glm::vec3(0.25f, 0, 0)) - 0.25f;
+                const float d = scale * std::min(cube, ball);
+
+                const int16_t sample = ctx.gpu_samples[x + n * (y + n * z)];
+                if (sample == params.outside_sample()) {
+                    // Left alone, which only samples away from it may be.
+                    ASSERT_GT(d, params.voxel_size)
+                            << x << " " << y << " " << z;
+                    continue;
+                }
+                const float expected = d / params.voxel_size
+                                       * vm::VolumeParams::SAMPLES_PER_VOXEL;
+                ASSERT_NEAR(sample, expected, 2) << x << " " << y << " " << z;
+            }
+        }
+    }
+}
+
+TEST(sampler, ball_samples_and_edges_match_reference) {
+    // Off the grid, so that neither the box nor the ball line up with the
+    // blocks the kernel evaluates the brush in.
+    const vm::VolumeParams params(32, 0.05);
+    TestContext ctx(params);
+    vm::BrushBall ball;
+    ball.set_origin({ 0.13f, -0.07f, 0.21f });
+    vm::dc::Sampler sampler(ctx.compute_ctx, params);
+    sampler.sample(ctx.chunk, ball, vm::dc::Sampler::Operation::Add);
+
+    const size_t n = params.chunk_size + 3;
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   ctx.gpu_samples.data())
+            .wait();
+    const float radius = 0.5f * ball.get_scale().x;
+    for (size_t z = 0; z < n; ++z) {
+        for (size_t y = 0; y < n; ++y) {
+            for (size_t x = 0; x < n; ++x) {
+                const float d = glm::length(vertex_at(params, x, y, z)
+                                            - ball.get_origin())
+                                - radius;
+                if (std::abs(d) > 1e-5f) {
+                    ASSERT_EQ(d < 0 ? -1 : 1,
+                              sample_sign(ctx.gpu_samples[x + n * (y + n * z)]))
+                            << x << " " << y << " " << z;
+                }
+            }
+        }
+    }
+
+    size_t num_active = 0;
+    for (size_t axis = 0; axis < 3; ++axis) {
+        const std::vector<glm::vec4> edges = read_edges(ctx, axis);
+        const compute::extents<3> size = ctx.chunk.volume_image_size(1 + axis);
+        for (size_t z = 0; z < size[2]; ++z) {
+            for (size_t y = 0; y < size[1]; ++y) {
+                for (size_t x = 0; x < size[0]; ++x) {
+                    glm::uvec3 p1(x, y, z);
+                    ++p1[axis];
+                    const glm::vec3 v0 = vertex_at(params, x, y, z);
+                    const glm::vec3 v1 = vertex_at(params, p1.x, p1.y, p1.z);
+                    // The crossing of |v0 + t * (v1 - v0) - origin| = radius
+                    // within the edge, if there is one.
+                    const glm::vec3 a = v0 - ball.get_origin();
+                    const glm::vec3 dv = v1 - v0;
+                    const float qa = glm::dot(dv, dv);
+                    const float qb = glm::dot(a, dv);
+                    const float qc = glm::dot(a, a) - radius * radius;
+                    const float qd = glm::dot(a + dv, a + dv) - radius * radius;
+                    if ((qc < 0) == (qd < 0) || std::abs(qc) < 1e-5f
+                        || std::abs(qd) < 1e-5f) {
+                        continue;
+                    }
+                    const float root = std::sqrt(qb * qb - qa * qc);
+                    const float t = (qc < 0 ? root - qb : -root - qb) / qa;
+                    const glm::vec3 normal = glm::normalize(a + t * dv);
+
+                    const glm::vec4 &edge =
+                            edges[x + size[0] * (y + size[1] * z)];
+                    ++num_active;
+                    // Half floats keep the crossings to about 1e-3.
+                    ASSERT_NEAR(edge.w, t, 2e-3f)
+                            << axis << ": " << x << " " << y << " " << z;
+                    ASSERT_GT(glm::dot(glm::vec3(edge), normal), 0.99f)
+                            << axis << ": " << x << " " << y << " " << z;
+                }
+            }
+        }
+    }
+    ASSERT_GT(num_active, 0u);
+}
+
+TEST(sampler, blended_edges_follow_blended_samples) {
+    const float blend_radius = 0.15f;
+    const vm::VolumeParams params(32, 0.05, true, blend_radius);
+    TestContext ctx(params);
+    vm::dc::Sampler sampler(ctx.compute_ctx, params);
+    // Two overlapping balls, whose crease the blend fills.
+    vm::BrushBall lhs;
+    lhs.set_origin({ -0.2f, 0.01f, 0.02f });
+    lhs.set_scale({ 0.6f, 0.6f, 0.6f });
+    vm::BrushBall rhs = lhs;
+    rhs.set_origin({ 0.2f, -0.01f, 0.03f });
+    sampler.sample(ctx.chunk, lhs, vm::dc::Sampler::Operation::Add);
+    sampler.sample(ctx.chunk, rhs, vm::dc::Sampler::Operation::Add);
+
+    // Same as smooth_min() of media/kernels/samplers.cl, in world units.
+    const auto distances = [&](const glm::vec3 &p) {
+        return glm::vec2(glm::length(p - lhs.get_origin()) - 0.3f,
+                         glm::length(p - rhs.get_origin()) - 0.3f);
+    };
+    const auto blended = [&](const glm::vec3 &p) {
+        const glm::vec2 d = distances(p);
+        const float h =
+                std::max(blend_radius - std::abs(d.x - d.y), 0.0f)
+                / blend_radius;
+        return std::min(d.x, d.y) - 0.25f * h * h * blend_radius;
+    };
+
+    const size_t n = params.chunk_size + 3;
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.samples,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
                                    ctx.gpu_samples.data())
             .wait();
 
-    for (size_t i = 0; i < VM_CHUNK_SIZE + 3; ++i) {
-        for (size_t j = 0; j < VM_CHUNK_SIZE + 3; ++j) {
-            for (size_t k = 0; k < VM_CHUNK_SIZE + 3; ++k) {
-                const size_t index =
-                        k + (VM_CHUNK_SIZE + 3) * (j + (VM_CHUNK_SIZE + 3) * i);
-                ASSERT_EQ(ctx.cpu_samples[index], ctx.gpu_samples[index]);
+    size_t num_blended = 0;
+    size_t mismatches = 0;
+    for (size_t axis = 0; axis < 3; ++axis) {
+        const std::vector<glm::vec4> edges = read_edges(ctx, axis);
+        const compute::extents<3> size = ctx.chunk.volume_image_size(1 + axis);
+        for (size_t z = 0; z < size[2]; ++z) {
+            for (size_t y = 0; y < size[1]; ++y) {
+                for (size_t x = 0; x < size[0]; ++x) {
+                    glm::uvec3 p1(x, y, z);
+                    ++p1[axis];
+                    const glm::vec3 v0 = vertex_at(params, x, y, z);
+                    const glm::vec3 v1 = vertex_at(params, p1.x, p1.y, p1.z);
+                    const float f0 = blended(v0);
+                    const float f1 = blended(v1);
+                    if ((f0 < 0) == (f1 < 0)) {
+                        continue;
+                    }
+                    const float t = f0 / (f0 - f1);
+                    const glm::vec3 crossing = glm::mix(v0, v1, t);
+                    const glm::vec2 d = distances(crossing);
+                    if (std::abs(d.x - d.y) >= blend_radius) {
+                        continue;
+                    }
+                    glm::vec3 gradient;
+                    for (int i = 0; i < 3; ++i) {
+                        glm::vec3 e(0.0f);
+                        e[i] = 1e-4f;
+                        gradient[i] =
+                                blended(crossing + e) - blended(crossing - e);
+                    }
+                    const glm::vec3 normal = glm::normalize(gradient);
+
+                    const glm::vec4 &edge =
+                            edges[x + size[0] * (y + size[1] * z)];
+                    ++num_blended;
+                    // Samples are quantized to 1/256 of a voxel, and edges to
+                    // half floats.
+                    mismatches += std::abs(edge.w - t) > 1e-2f
+                                  || glm::dot(glm::vec3(edge), normal) < 0.95f;
+                }
+            }
+        }
+    }
+    ASSERT_GT(num_blended, 0u);
+    // Central differences of the samples blur the normals where the blend
+    // curves the most.
+    ASSERT_LE(mismatches, num_blended / 20);
+}
+
+TEST(sampler, added_samples_take_brush_material) {
+    TestContext ctx{};
+    vm::dc::Sampler sampler(ctx.compute_ctx, ctx.params);
+    vm::BrushCube cube;
+    cube.set_material(3);
+    sampler.sample(ctx.chunk, cube, vm::dc::Sampler::Operation::Add);
+    // Removed samples keep their material.
+    vm::BrushBall ball;
+    ball.set_material(5);
+    sampler.sample(ctx.chunk, ball, vm::dc::Sampler::Operation::Sub);
+
+    const size_t n = ctx.params.chunk_size + 3;
+    std::vector<uint8_t> materials(n * n * n);
+    ctx.compute_ctx->queue
+            .enqueue_read_image<3>(ctx.chunk.materials,
+                                   compute::dim(0, 0, 0),
+                                   compute::dim(n, n, n),
+                                   materials.data())
+            .wait();
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t k = 0; k < n; ++k) {
+                const glm::vec3 p = vertex_at(ctx.params, k, j, i);
+                const bool in_cube =
+                        sdf_cube(p, 0.5f * cube.get_scale()) < 0;
+                ASSERT_EQ(in_cube ? 3 : 0, materials[k + n * (j + n * i)]);
             }
         }
     }
@@ -0,0 +1,496 @@
+#include "gtest/gtest.h"
+
+#include "compute/context.h"
+
+#include "scene/brush-ball.h"
+#include "scene/chunk.h"
+#include "scene/scene-archive.h"
+#include "utils/persistence.h"
+
+#include <boost/filesystem.hpp>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+namespace {
+struct TempArchive {
+    fs::path path;
+
+    TempArchive()
+            : path(fs::temp_directory_path()
+                   / fs::unique_path("vm-archive-%%%%-%%%%")) {
+        fs::create_directory(path);
+    }
+
+    ~TempArchive() {
+        fs::remove_all(path);
+    }
+
+    fs::path chunk_path(const glm::ivec3 &coord) const {
+        return path
+               / ("chunk_" + std::to_string(coord.x) + "_"
+                  + std::to_string(coord.y) + "_" + std::to_string(coord.z)
+                  + ".gz");
+    }
+};
+
+std::string read_file(const fs::path &path) {
+    std::ifstream file(path.string(), std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+}
+
+void write_file(const fs::path &path, const std::string &contents) {
+    std::ofstream file(path.string(), std::ios::out | std::ios::binary);
+    file << contents;
+}
+
+/* Size of chunk file headers since version 6, which end with the material */
+const size_t HEADER_SIZE = 22;
+/* Brick index of the commit record ending each batch of brick records */
+const uint16_t COMMIT_RECORD = UINT16_MAX;
+
+/** @returns bytes of the @p image the @p brick of the @p chunk spans */
+size_t brick_image_bytes(const vm::Chunk &chunk, size_t brick, size_t image) {
+    compute::extents<3> origin;
+    compute::extents<3> region;
+    chunk.get_brick_region(brick, image, origin, region);
+    return vm::Chunk::volume_image_element_size(image) * region[0] * region[1]
+           * region[2];
+}
+
+/**
+ * Rewrites the chunk file at @p path as @p version 5 or 6 would have stored
+ * it, i.e. without commit records, and for version 5 without the uniform
+ * material and the materials of the bricks either.
+ */
+void downgrade(const fs::path &path, const vm::Chunk &chunk, uint16_t version) {
+    const std::string contents = read_file(path);
+    const size_t header_size = version < 6 ? HEADER_SIZE - 1 : HEADER_SIZE;
+    std::string downgraded = contents.substr(0, header_size);
+    memcpy(&downgraded[0], &version, sizeof(version));
+
+    const size_t materials = vm::Chunk::NUM_VOLUME_IMAGES - 1;
+    size_t offset = HEADER_SIZE;
+    while (offset < contents.size()) {
+        uint16_t brick;
+        uint32_t size;
+        memcpy(&brick, &contents[offset], sizeof(brick));
+        memcpy(&size, &contents[offset + sizeof(brick)], sizeof(size));
+        const size_t record_offset = offset;
+        offset += sizeof(brick) + sizeof(size) + size;
+        if (brick == COMMIT_RECORD) {
+            continue;
+        }
+        if (version >= 6) {
+            downgraded.append(contents, record_offset, offset - record_offset);
+            continue;
+        }
+
+        uLongf bytes = 0;
+        for (size_t image = 0; image <= materials; ++image) {
+            bytes += brick_image_bytes(chunk, brick, image);
+        }
+        std::vector<Bytef> data(bytes);
+        const size_t data_offset = record_offset + sizeof(brick) + sizeof(size);
+        ASSERT_EQ(uncompress(data.data(), &bytes,
+                             reinterpret_cast<const Bytef *>(
+                                     &contents[data_offset]),
+                             size),
+                  Z_OK);
+        data.resize(bytes - brick_image_bytes(chunk, brick, materials));
+
+        uLongf compressed_size = compressBound(data.size());
+        std::vector<Bytef> compressed(compressed_size);
+        ASSERT_EQ(compress(compressed.data(), &compressed_size, data.data(),
+                           data.size()),
+                  Z_OK);
+        const uint32_t record_size = compressed_size;
+        downgraded.append(reinterpret_cast<const char *>(&brick),
+                          sizeof(brick));
+        downgraded.append(reinterpret_cast<const char *>(&record_size),
+                          sizeof(record_size));
+        downgraded.append(reinterpret_cast<const char *>(compressed.data()),
+                          compressed_size);
+    }
+    write_file(path, downgraded);
+}
+
+/**
+ * Writes the header of a chunk file of @p version 3 or 4, after which
+ * archives older than version 5 store the whole volume of non-uniform chunks.
+ * Version 3 headers have no uniform fields, as there were no uniform chunks.
+ */
+void write_whole_volume_header(std::ofstream &file,
+                               const vm::VolumeParams &params,
+                               uint16_t version,
+                               bool uniform,
+                               int16_t uniform_sample) {
+    using vm::operator<=;
+    file <= version <= static_cast<uint16_t>(params.chunk_size)
+         <= static_cast<double>(params.voxel_size)
+         <= static_cast<uint16_t>(vm::Chunk::volume_image_element_size(1))
+         <= static_cast<uint16_t>(vm::Chunk::volume_image_element_size(0));
+    if (version >= 4) {
+        file <= static_cast<uint8_t>(uniform) <= uniform_sample;
+    }
+}
+
+/**
+ * Writes the chunk file of @p version 3 or 4 at @p path, with the whole volume
+ * of the @p chunk in a single stream, and its images filled with bytes that
+ * differ between them. @returns the volume written
+ */
+vm::ChunkData write_whole_volume(const fs::path &path,
+                                 const vm::Chunk &chunk,
+                                 const vm::VolumeParams &params,
+                                 uint16_t version) {
+    vm::ChunkData data{};
+    std::vector<uint8_t> *const images[] = { &data.samples, &data.edges_x,
+                                             &data.edges_y, &data.edges_z };
+    std::string volume;
+    for (size_t image = 0; image < 4; ++image) {
+        const compute::extents<3> size = chunk.volume_image_size(image);
+        images[image]->resize(vm::Chunk::volume_image_element_size(image)
+                              * size[0] * size[1] * size[2]);
+        for (size_t i = 0; i < images[image]->size(); ++i) {
+            (*images[image])[i] = static_cast<uint8_t>(7 * i + image);
+        }
+        volume.append(reinterpret_cast<const char *>(images[image]->data()),
+                      images[image]->size());
+    }
+    uLongf compressed_size = compressBound(volume.size());
+    std::vector<Bytef> compressed(compressed_size);
+    EXPECT_EQ(compress(compressed.data(), &compressed_size,
+                       reinterpret_cast<const Bytef *>(volume.data()),
+                       volume.size()),
+              Z_OK);
+
+    std::ofstream file(path.string(), std::ios::out | std::ios::binary);
+    write_whole_volume_header(file, params, version, false, 0);
+    file.write(reinterpret_cast<const char *>(compressed.data()),
+               compressed_size);
+    return data;
+}
+} // namespace
+
+TEST(scene_archive, unreadable_chunk_is_not_overwritten) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 1, 0, -1 };
+    const std::string garbage = "definitely not a chunk";
+    write_file(temp.chunk_path(coord), garbage);
+
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    ASSERT_TRUE(archive.contains(coord));
+    ASSERT_TRUE(archive.is_readable(coord));
+    ASSERT_ANY_THROW(archive.load(chunk));
+    ASSERT_FALSE(archive.is_readable(coord));
+
+    // An edit of the (empty) chunk in the scene must not replace the file.
+    chunk->make_uniform(archive.params().inside_sample());
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    ASSERT_EQ(read_file(temp.chunk_path(coord)), garbage);
+}
+
+TEST(scene_archive, checkpoint_replaces_files_and_truncates_journal) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 0, 2, 0 };
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    archive.journal().append(vm::BrushBall(), vm::dc::Sampler::Operation::Add);
+
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->make_uniform(archive.params().inside_sample(), 3);
+    archive.mark_dirty(chunk);
+    archive.checkpoint();
+    ASSERT_EQ(archive.journal().size(), 0u);
+    ASSERT_FALSE(fs::exists(temp.chunk_path(coord).string() + ".tmp"));
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_TRUE(data.uniform);
+    ASSERT_EQ(data.uniform_sample, archive.params().inside_sample());
+    ASSERT_EQ(data.uniform_material, 3);
+}
+
+TEST(scene_archive, journal_is_kept_when_persisting_fails) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 0, 0, 3 };
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    archive.journal().append(vm::BrushBall(), vm::dc::Sampler::Operation::Add);
+
+    // Nothing can be written where the chunk file is first written to.
+    fs::create_directory(temp.chunk_path(coord).string() + ".tmp");
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->make_uniform(archive.params().inside_sample());
+    archive.mark_dirty(chunk);
+    archive.checkpoint();
+    ASSERT_EQ(archive.journal().size(), 1u);
+    ASSERT_FALSE(archive.contains(coord));
+}
+
+TEST(scene_archive, torn_appended_record_is_discarded) {
+    TempArchive temp;
+    const glm::ivec3 coord{ -2, 0, 0 };
+    auto compute_ctx = vm::make_compute_context();
+    vm::SceneArchive archive(
+            temp.path.string(), compute_ctx, vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->alloc_volume(compute_ctx->context);
+    chunk->dirty_bricks.set();
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+
+    // Record of the full size, whose contents never made it to the disk.
+    {
+        std::ofstream file(temp.chunk_path(coord).string(),
+                           std::ios::out | std::ios::binary | std::ios::app);
+        const uint16_t brick = 0;
+        const uint32_t size = 64;
+        file.write(reinterpret_cast<const char *>(&brick), sizeof(brick));
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file << std::string(size, '\0');
+    }
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    // Nothing is appended after the torn record anymore.
+    ASSERT_EQ(chunk->archived_records, 0u);
+    ASSERT_TRUE(archive.is_readable(coord));
+}
+
+TEST(scene_archive, blended_volume_rejects_unnumbered_journal) {
+    TempArchive temp;
+    const vm::VolumeParams params(32, 0.05, true, 0.1);
+    {
+        vm::SceneArchive archive(
+                temp.path.string(), vm::make_compute_context(), params);
+        archive.journal().append(vm::BrushBall(),
+                                 vm::dc::Sampler::Operation::Add);
+    }
+    // Numbered edits are replayed exactly.
+    vm::SceneArchive(
+            temp.path.string(), vm::make_compute_context(), params);
+
+    // Left behind by a build that didn't number the edits yet, i.e. version
+    // 2, which has no base sequence number in the header.
+    const fs::path journal = temp.path / "journal.bin";
+    std::string contents = read_file(journal);
+    const uint16_t version = 2;
+    memcpy(&contents[sizeof(uint32_t)], &version, sizeof(version));
+    contents.erase(sizeof(uint32_t) + sizeof(version), sizeof(uint64_t));
+    write_file(journal, contents);
+    ASSERT_THROW(vm::SceneArchive(temp.path.string(),
+                                  vm::make_compute_context(),
+                                  params),
+                 std::runtime_error);
+}
+
+TEST(scene_archive, chunk_keeps_edit_sequence) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 3, 0, 0 };
+    auto compute_ctx = vm::make_compute_context();
+    vm::SceneArchive archive(
+            temp.path.string(), compute_ctx, vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->alloc_volume(compute_ctx->context);
+    chunk->dirty_bricks.set();
+    chunk->edit_sequence = 5;
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    ASSERT_EQ(archive.load(chunk).edit_sequence, 5u);
+
+    // Appended bricks carry the sequence number of the chunk as well.
+    chunk->dirty_bricks.set(0);
+    chunk->edit_sequence = 8;
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_EQ(data.edit_sequence, 8u);
+    ASSERT_EQ(chunk->archived_records, chunk->num_bricks() + 1);
+
+    chunk->edit_sequence = 0;
+    archive.upload(chunk, data).wait();
+    ASSERT_EQ(chunk->edit_sequence, 8u);
+}
+
+TEST(scene_archive, uncommitted_bricks_are_discarded) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 0, 3, 0 };
+    auto compute_ctx = vm::make_compute_context();
+    vm::SceneArchive archive(
+            temp.path.string(), compute_ctx, vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->alloc_volume(compute_ctx->context);
+    chunk->dirty_bricks.set();
+    chunk->edit_sequence = 5;
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+
+    chunk->dirty_bricks.set(1);
+    chunk->edit_sequence = 6;
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    // Crashed before the commit record of the appended brick was written.
+    const size_t commit_size =
+            sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint64_t);
+    const fs::path path = temp.chunk_path(coord);
+    fs::resize_file(path, fs::file_size(path) - commit_size);
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    // The chunk is as it was before the brick, so its edits get replayed.
+    ASSERT_EQ(data.edit_sequence, 5u);
+    ASSERT_EQ(chunk->archived_records, 0u);
+}
+
+TEST(scene_archive, reads_version_6_chunk_without_commit_records) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 1, 0, 1 };
+    auto compute_ctx = vm::make_compute_context();
+    vm::SceneArchive archive(
+            temp.path.string(), compute_ctx, vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->alloc_volume(compute_ctx->context);
+    chunk->dirty_bricks.set();
+    chunk->edit_sequence = 4;
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    const vm::ChunkData expected = archive.load(chunk);
+    downgrade(temp.chunk_path(coord), *chunk, 6);
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    ASSERT_EQ(data.samples, expected.samples);
+    ASSERT_EQ(data.edges_x, expected.edges_x);
+    ASSERT_EQ(data.edges_y, expected.edges_y);
+    ASSERT_EQ(data.edges_z, expected.edges_z);
+    ASSERT_EQ(data.materials, expected.materials);
+    // Every edit of the journal is replayed over it.
+    ASSERT_EQ(data.edit_sequence, 0u);
+    ASSERT_EQ(chunk->archived_records, 0u);
+}
+
+TEST(scene_archive, reads_version_5_uniform_chunk) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 0, -1, 0 };
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->make_uniform(archive.params().inside_sample(), 4);
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    downgrade(temp.chunk_path(coord), *chunk, 5);
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_TRUE(data.uniform);
+    ASSERT_EQ(data.uniform_sample, archive.params().inside_sample());
+    ASSERT_EQ(data.uniform_material, 0);
+}
+
+TEST(scene_archive, reads_version_5_chunk_without_materials) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 1, 1, 1 };
+    auto compute_ctx = vm::make_compute_context();
+    vm::SceneArchive archive(
+            temp.path.string(), compute_ctx, vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    chunk->alloc_volume(compute_ctx->context);
+    chunk->dirty_bricks.set();
+    archive.mark_dirty(chunk);
+    archive.flush(chunk);
+    const vm::ChunkData expected = archive.load(chunk);
+    downgrade(temp.chunk_path(coord), *chunk, 5);
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    ASSERT_EQ(data.samples, expected.samples);
+    ASSERT_EQ(data.edges_x, expected.edges_x);
+    ASSERT_EQ(data.edges_y, expected.edges_y);
+    ASSERT_EQ(data.edges_z, expected.edges_z);
+    ASSERT_EQ(data.materials.size(), expected.materials.size());
+    ASSERT_TRUE(std::all_of(data.materials.begin(),
+                            data.materials.end(),
+                            [](uint8_t material) { return material == 0; }));
+    // Bricks of the current version are never appended to the old file.
+    ASSERT_EQ(chunk->archived_records, 0u);
+}
+
+TEST(scene_archive, reads_version_4_uniform_chunk) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 0, 0, -2 };
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    {
+        std::ofstream file(temp.chunk_path(coord).string(),
+                           std::ios::out | std::ios::binary);
+        write_whole_volume_header(file, archive.params(), 4, true,
+                                  archive.params().inside_sample());
+    }
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_TRUE(data.uniform);
+    ASSERT_EQ(data.uniform_sample, archive.params().inside_sample());
+    ASSERT_EQ(data.uniform_material, 0);
+}
+
+TEST(scene_archive, reads_version_4_whole_volume) {
+    TempArchive temp;
+    const glm::ivec3 coord{ 2, 0, 1 };
+    vm::SceneArchive archive(
+            temp.path.string(), vm::make_compute_context(), vm::VolumeParams());
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+    const vm::ChunkData expected = write_whole_volume(
+            temp.chunk_path(coord), *chunk, archive.params(), 4);
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    ASSERT_EQ(data.samples, expected.samples);
+    ASSERT_EQ(data.edges_x, expected.edges_x);
+    ASSERT_EQ(data.edges_y, expected.edges_y);
+    ASSERT_EQ(data.edges_z, expected.edges_z);
+    ASSERT_TRUE(std::all_of(data.materials.begin(),
+                            data.materials.end(),
+                            [](uint8_t material) { return material == 0; }));
+    // The file is rewritten in bricks once the chunk is modified.
+    ASSERT_EQ(chunk->archived_records, 0u);
+}
+
+TEST(scene_archive, reads_baseline_archive) {
+    TempArchive temp;
+    const glm::ivec3 coord{ -1, 2, 0 };
+    // Archives of version 3 have no parameters file, nor uniform chunks.
+    const vm::VolumeParams defaults;
+    const vm::ChunkData expected = write_whole_volume(
+            temp.chunk_path(coord), vm::Chunk(coord, defaults), defaults, 3);
+
+    vm::SceneArchive archive(temp.path.string(),
+                             vm::make_compute_context(),
+                             vm::VolumeParams(32, 0.05, true));
+    ASSERT_EQ(archive.params(), defaults);
+    auto chunk = std::make_shared<vm::Chunk>(coord, archive.params());
+
+    const vm::ChunkData data = archive.load(chunk);
+    ASSERT_FALSE(data.uniform);
+    ASSERT_EQ(data.samples, expected.samples);
+    ASSERT_EQ(data.edges_x, expected.edges_x);
+    ASSERT_EQ(data.edges_y, expected.edges_y);
+    ASSERT_EQ(data.edges_z, expected.edges_z);
+    ASSERT_TRUE(std::all_of(data.materials.begin(),
+                            data.materials.end(),
+                            [](uint8_t material) { return material == 0; }));
+    ASSERT_EQ(chunk->archived_records, 0u);
+}